@@ -0,0 +1,5476 @@
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#define COM_NO_WINDOWS_H
+#include "engine.h"
+#include <PortableDeviceApi.h>
+#include <PortableDevice.h>
+#include <PathCch.h>
+#include <Shlwapi.h>
+#include <new>
+#include <stdio.h>
+#include <assert.h>
+#include <wchar.h>
+#include <stdarg.h>
+
+#pragma comment(lib, "PortableDeviceGUIDs.lib")
+#pragma comment(lib, "PathCch.lib")
+#pragma comment(lib, "Shlwapi.lib")
+
+template<typename T>
+static void safe_release(T** ptr) {
+    if (*ptr) {
+        (*ptr)->Release();
+        *ptr = nullptr;
+    }
+}
+
+wchar_t* string_clone(const wchar_t* src, int length) {
+    if (!src) return nullptr;
+    if (length < 0) {
+        length = (int)wcslen(src);
+    }
+    wchar_t* dst = new (std::nothrow) wchar_t[length + 1];
+    if (dst) {
+        memcpy(dst, src, sizeof(wchar_t) * length);
+        dst[length] = L'\0';
+    }
+    return dst;
+}
+
+wchar_t* string_format(const wchar_t* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int buffer_count = _vscwprintf(format, args);
+    va_end(args);
+    if (buffer_count < 0) {
+        return nullptr;
+    }
+
+    wchar_t* buffer = new (std::nothrow) wchar_t[buffer_count + 1];
+    if (!buffer) {
+        return nullptr;
+    }
+
+    va_start(args, format);
+    int count = _vsnwprintf_s(buffer, buffer_count + 1, buffer_count, format, args);
+    va_end(args);
+    if (count < 0) {
+        delete[] buffer;
+        return nullptr;
+    }
+
+    buffer[buffer_count] = L'\0';
+    return buffer;
+}
+
+static wchar_t* hresult_to_string(HRESULT hr) {
+    wchar_t* error = nullptr;
+    DWORD length = FormatMessageW(
+        FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+        nullptr,
+        hr,
+        MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+        (wchar_t*)&error,
+        0,
+        nullptr);
+
+    wchar_t* result;
+    if (error) {
+        if (length >= 2 && error[length - 2] == '\r' && error[length - 1] == '\n') {
+            length -= 2;
+        }
+        result = string_clone(error, (int)length);
+        LocalFree(error);
+    } else {
+        result = string_format(L"Unknown error 0x%0lX", hr);
+        if (!result) {
+            result = string_clone(L"Unknown error");
+        }
+    }
+    return result;
+}
+
+// Returns error message for HRESULT. Messages are formatted once per HRESULT and cached for
+// the lifetime of the process, so the returned string must not be freed.
+const wchar_t* error_string(HRESULT hr) {
+    const int CacheCapacity = 256;
+    struct CacheEntry {
+        HRESULT hr;
+        wchar_t* text;
+    };
+    static CacheEntry cache[CacheCapacity] = { 0 };
+    static SRWLOCK cache_lock = SRWLOCK_INIT;
+
+    DWORD start = ((DWORD)hr * 2654435761u) % CacheCapacity;
+    const wchar_t* result = nullptr;
+
+    AcquireSRWLockShared(&cache_lock);
+    for (DWORD i = 0; i < CacheCapacity; ++i) {
+        auto& entry = cache[(start + i) % CacheCapacity];
+        if (!entry.text || entry.hr == hr) {
+            result = entry.text;
+            break;
+        }
+    }
+    ReleaseSRWLockShared(&cache_lock);
+    if (result) {
+        return result;
+    }
+
+    AcquireSRWLockExclusive(&cache_lock);
+    for (DWORD i = 0; i < CacheCapacity; ++i) {
+        auto& entry = cache[(start + i) % CacheCapacity];
+        if (entry.text && entry.hr != hr) {
+            continue;
+        }
+        if (!entry.text) {
+            entry.text = hresult_to_string(hr);
+            entry.hr = hr;
+        }
+        result = entry.text;
+        break;
+    }
+    ReleaseSRWLockExclusive(&cache_lock);
+
+    return result ? result : L"Unknown error";
+}
+
+static bool is_cancelled(const volatile LONG* cancelled) {
+    return cancelled && *cancelled != 0;
+}
+
+// Watchdog, see device_call_begin.
+static bool device_call_begin(DeviceCall call);
+static HRESULT device_call_end(HRESULT hr);
+
+// Runs blocking device call under watchdog of its class.
+template<typename Call>
+static HRESULT device_call(DeviceCall call, Call function) {
+    HRESULT hr = E_WPD_DEVICE_IS_HUNG;
+    if (device_call_begin(call)) {
+        hr = function();
+    }
+    return device_call_end(hr);
+}
+
+// Creates key collection once and stores it in *cache. Safe to call from several threads at once,
+// the collection is never released.
+static HRESULT get_shared_key_collection(IPortableDeviceKeyCollection* volatile* cache, const PROPERTYKEY* keys, int nkeys, IPortableDeviceKeyCollection** out_keys) {
+    IPortableDeviceKeyCollection* collection = *cache;
+    if (collection) {
+        *out_keys = collection;
+        return S_OK;
+    }
+
+    HRESULT hr = CoCreateInstance(CLSID_PortableDeviceKeyCollection, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&collection));
+    if (FAILED(hr)) return hr;
+    for (int i = 0; i < nkeys; ++i) {
+        hr = collection->Add(keys[i]);
+        if (FAILED(hr)) {
+            safe_release(&collection);
+            return hr;
+        }
+    }
+
+    auto existing = (IPortableDeviceKeyCollection*)InterlockedCompareExchangePointer((void* volatile*)cache, collection, nullptr);
+    if (existing) {
+        // Other thread was faster.
+        safe_release(&collection);
+        collection = existing;
+    }
+    *out_keys = collection;
+    return S_OK;
+}
+
+// Gets file name of object, with extension when device reports it. Name is allocated with new[].
+static HRESULT get_device_object_name(IPortableDeviceProperties* properties, const wchar_t* object_id, wchar_t** out_object_name) {
+    HRESULT hr = E_FAIL;
+    *out_object_name = nullptr;
+
+    static IPortableDeviceKeyCollection* volatile original_name_keys_cache = nullptr;
+    IPortableDeviceKeyCollection* original_name_keys = nullptr;
+    hr = get_shared_key_collection(&original_name_keys_cache, &WPD_OBJECT_ORIGINAL_FILE_NAME, 1, &original_name_keys);
+    if (FAILED(hr)) return hr;
+
+    static IPortableDeviceKeyCollection* volatile name_keys_cache = nullptr;
+    IPortableDeviceKeyCollection* name_keys = nullptr;
+    hr = get_shared_key_collection(&name_keys_cache, &WPD_OBJECT_NAME, 1, &name_keys);
+    if (FAILED(hr)) return hr;
+
+    // ORIGINAL_FILE_NAME = with file extension
+    // NAME = without file extension
+
+    IPortableDeviceValues* values = nullptr;
+
+    // Try get file name with extension.
+    hr = device_call(DeviceCall_Enumerate, [&]() { return properties->GetValues(object_id, original_name_keys, &values); });
+    if (SUCCEEDED(hr)) {
+        wchar_t* original_name = nullptr;
+        hr = values->GetStringValue(WPD_OBJECT_ORIGINAL_FILE_NAME, &original_name);
+        if (SUCCEEDED(hr)) {
+            *out_object_name = string_clone(original_name);
+            if (!*out_object_name) {
+                hr = E_OUTOFMEMORY;
+            }
+            CoTaskMemFree(original_name);
+        }
+    }
+
+    // If failed, get normal name.
+    if (FAILED(hr) && hr != E_OUTOFMEMORY) {
+        safe_release(&values);
+        hr = device_call(DeviceCall_Enumerate, [&]() { return properties->GetValues(object_id, name_keys, &values); });
+        if (SUCCEEDED(hr)) {
+            wchar_t* name = nullptr;
+            hr = values->GetStringValue(WPD_OBJECT_NAME, &name);
+            if (SUCCEEDED(hr)) {
+                *out_object_name = string_clone(name);
+                if (!*out_object_name) {
+                    hr = E_OUTOFMEMORY;
+                }
+                CoTaskMemFree(name);
+            }
+        }
+    }
+
+    safe_release(&values);
+    return hr;
+}
+
+struct DeviceObjectMetadata {
+    wchar_t* name = nullptr;
+    wchar_t* persistent_id = nullptr; // <-- may be not set.
+    bool has_size = false;
+    ULONGLONG size = 0;
+    bool has_date_modified = false;
+    DATE date_modified = 0;
+    bool has_date_created = false;
+    DATE date_created = 0;
+    DWORD content_type = ContentType_Other;
+    bool hidden = false;
+    bool system = false;
+};
+
+static DWORD content_type_from_guid(const GUID& guid) {
+    if (IsEqualGUID(guid, WPD_CONTENT_TYPE_IMAGE)) return ContentType_Image;
+    if (IsEqualGUID(guid, WPD_CONTENT_TYPE_VIDEO)) return ContentType_Video;
+    if (IsEqualGUID(guid, WPD_CONTENT_TYPE_AUDIO)) return ContentType_Audio;
+    if (IsEqualGUID(guid, WPD_CONTENT_TYPE_DOCUMENT)) return ContentType_Document;
+    if (IsEqualGUID(guid, WPD_CONTENT_TYPE_FOLDER) || IsEqualGUID(guid, WPD_CONTENT_TYPE_FUNCTIONAL_OBJECT)) return ContentType_Folder;
+    return ContentType_Other;
+}
+
+static void free_device_object_metadata(DeviceObjectMetadata* metadata) {
+    delete[] metadata->name;
+    delete[] metadata->persistent_id;
+    metadata->name = nullptr;
+    metadata->persistent_id = nullptr;
+}
+
+// Gets name and properties used by object filters and catalog in single request to device.
+// Properties which are not supported by device are left unset, only missing name is an error.
+// Free result with free_device_object_metadata.
+static HRESULT get_device_object_metadata(IPortableDeviceProperties* properties, const wchar_t* object_id, DeviceObjectMetadata* out_metadata) {
+    const PROPERTYKEY keys[] = {
+        WPD_OBJECT_ORIGINAL_FILE_NAME,
+        WPD_OBJECT_NAME,
+        WPD_OBJECT_SIZE,
+        WPD_OBJECT_DATE_MODIFIED,
+        WPD_OBJECT_CONTENT_TYPE,
+        WPD_OBJECT_ISHIDDEN,
+        WPD_OBJECT_ISSYSTEM,
+        WPD_OBJECT_PERSISTENT_UNIQUE_ID,
+        WPD_OBJECT_DATE_CREATED,
+    };
+    static IPortableDeviceKeyCollection* volatile metadata_keys_cache = nullptr;
+    IPortableDeviceKeyCollection* metadata_keys = nullptr;
+    IPortableDeviceValues* values = nullptr;
+    DeviceObjectMetadata metadata;
+    wchar_t* name = nullptr;
+    wchar_t* persistent_id = nullptr;
+    PROPVARIANT date;
+    GUID content_type;
+    BOOL flag = FALSE;
+
+    PropVariantInit(&date);
+
+    HRESULT hr = get_shared_key_collection(&metadata_keys_cache, keys, _countof(keys), &metadata_keys);
+    if (FAILED(hr)) goto quit;
+
+    // Returns S_FALSE when some of properties are not available.
+    hr = device_call(DeviceCall_Enumerate, [&]() { return properties->GetValues(object_id, metadata_keys, &values); });
+    if (FAILED(hr)) goto quit;
+
+    // ORIGINAL_FILE_NAME = with file extension
+    // NAME = without file extension
+    hr = values->GetStringValue(WPD_OBJECT_ORIGINAL_FILE_NAME, &name);
+    if (FAILED(hr)) {
+        hr = values->GetStringValue(WPD_OBJECT_NAME, &name);
+        if (FAILED(hr)) goto quit;
+    }
+    metadata.name = string_clone(name);
+    CoTaskMemFree(name);
+    if (!metadata.name) {
+        hr = E_OUTOFMEMORY;
+        goto quit;
+    }
+
+    metadata.has_size = SUCCEEDED(values->GetUnsignedLargeIntegerValue(WPD_OBJECT_SIZE, &metadata.size));
+
+    if (SUCCEEDED(values->GetStringValue(WPD_OBJECT_PERSISTENT_UNIQUE_ID, &persistent_id))) {
+        metadata.persistent_id = string_clone(persistent_id);
+        CoTaskMemFree(persistent_id);
+        if (!metadata.persistent_id) {
+            hr = E_OUTOFMEMORY;
+            goto quit;
+        }
+    }
+
+    if (SUCCEEDED(values->GetValue(WPD_OBJECT_DATE_MODIFIED, &date)) && date.vt == VT_DATE) {
+        metadata.has_date_modified = true;
+        metadata.date_modified = date.date;
+    }
+    PropVariantClear(&date);
+
+    if (SUCCEEDED(values->GetValue(WPD_OBJECT_DATE_CREATED, &date)) && date.vt == VT_DATE) {
+        metadata.has_date_created = true;
+        metadata.date_created = date.date;
+    }
+
+    if (SUCCEEDED(values->GetGuidValue(WPD_OBJECT_CONTENT_TYPE, &content_type))) {
+        metadata.content_type = content_type_from_guid(content_type);
+    }
+
+    metadata.hidden = SUCCEEDED(values->GetBoolValue(WPD_OBJECT_ISHIDDEN, &flag)) && flag;
+    metadata.system = SUCCEEDED(values->GetBoolValue(WPD_OBJECT_ISSYSTEM, &flag)) && flag;
+
+    hr = S_OK;
+
+    quit:
+    PropVariantClear(&date);
+    safe_release(&values);
+    if (FAILED(hr)) {
+        free_device_object_metadata(&metadata);
+    }
+    *out_metadata = metadata;
+    return hr;
+}
+
+static bool object_filter_accepts(const ObjectFilter& filter, const DeviceObjectMetadata& metadata) {
+    if (filter.content_types && !(filter.content_types & metadata.content_type)) {
+        return false;
+    }
+    if (filter.exclude_hidden && (metadata.hidden || metadata.system)) {
+        return false;
+    }
+    if (metadata.has_size && (metadata.size < filter.min_size || metadata.size > filter.max_size)) {
+        return false;
+    }
+    if (metadata.has_date_modified) {
+        if (filter.has_modified_after && metadata.date_modified < filter.modified_after) {
+            return false;
+        }
+        if (filter.has_modified_before && metadata.date_modified >= filter.modified_before) {
+            return false;
+        }
+    }
+    if (filter.match && !wcsstr(metadata.name, filter.match)) {
+        return false;
+    }
+    return true;
+}
+
+// Gets friendly name and description of device whose id is set.
+static HRESULT get_device_names(IPortableDeviceManager* device_manager, PortableDeviceInformation* device) {
+    HRESULT hr = S_OK;
+
+    // HRESULT_FROM_WIN32(ERROR_INVALID_DATA)
+    // means that device friendly name/description is not set.
+
+    // Friendly name.
+    {
+        DWORD nfriendly_name = 0;
+        hr = device_manager->GetDeviceFriendlyName(device->id, nullptr, &nfriendly_name);
+        if (hr != HRESULT_FROM_WIN32(ERROR_INVALID_DATA)) {
+            if (FAILED(hr)) return hr;
+
+            device->friendly_name = new (std::nothrow) wchar_t[nfriendly_name + 1];
+            if (!device->friendly_name) {
+                return E_OUTOFMEMORY;
+            }
+
+            hr = device_manager->GetDeviceFriendlyName(device->id, device->friendly_name, &nfriendly_name);
+            if (FAILED(hr)) return hr;
+            device->friendly_name[nfriendly_name] = L'\0';
+        }
+    }
+
+    // Description.
+    {
+        DWORD ndescription = 0;
+        hr = device_manager->GetDeviceDescription(device->id, nullptr, &ndescription);
+        if (hr != HRESULT_FROM_WIN32(ERROR_INVALID_DATA)) {
+            if (FAILED(hr)) return hr;
+
+            device->description = new (std::nothrow) wchar_t[ndescription + 1];
+            if (!device->description) {
+                return E_OUTOFMEMORY;
+            }
+
+            hr = device_manager->GetDeviceDescription(device->id, device->description, &ndescription);
+            if (FAILED(hr)) return hr;
+            device->description[ndescription] = L'\0';
+        }
+    }
+    return S_OK;
+}
+
+HRESULT engine_enumerate_devices(PortableDeviceInformation** out_devices, int* out_ndevices) {
+    assert(out_devices);
+    assert(out_ndevices);
+
+    IPortableDeviceManager* device_manager = nullptr;
+    wchar_t** device_ids = nullptr;
+    DWORD ndevices = 0;
+    PortableDeviceInformation* devices = nullptr;
+    HRESULT hr = E_FAIL;
+
+    hr = CoCreateInstance(CLSID_PortableDeviceManager, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&device_manager));
+    if (FAILED(hr)) goto quit;
+
+    hr = device_manager->GetDevices(nullptr, &ndevices);
+    if (FAILED(hr)) goto quit;
+
+    device_ids = new (std::nothrow) wchar_t*[ndevices];
+    if (!device_ids) {
+        hr = E_OUTOFMEMORY;
+        goto quit;
+    }
+    
+    hr = device_manager->GetDevices(device_ids, &ndevices);
+    if (FAILED(hr)) goto quit;
+
+    devices = new (std::nothrow) PortableDeviceInformation[ndevices];
+    if (!devices) {
+        hr = E_OUTOFMEMORY;
+        goto quit;
+    }
+
+    for (DWORD i = 0; i < ndevices; ++i) {
+        auto& device = devices[i];
+
+        // Identifier.
+        device.id = string_clone(device_ids[i]);
+        if (!device.id) {
+            hr = E_OUTOFMEMORY;
+            goto quit;
+        }
+
+        hr = get_device_names(device_manager, &device);
+        if (FAILED(hr)) goto quit;
+    }
+
+    hr = S_OK;
+
+    quit:
+    if (device_ids) {
+        for (DWORD i = 0; i < ndevices; ++i) {
+            CoTaskMemFree(device_ids[i]);
+        }
+        delete[] device_ids;
+    }
+    if (devices && FAILED(hr)) {
+        engine_free_devices(devices, (int)ndevices);
+    }
+    safe_release(&device_manager);
+    *out_devices = SUCCEEDED(hr) ? devices : nullptr;
+    *out_ndevices = SUCCEEDED(hr) ? (int)ndevices : 0;
+    return hr;
+}
+
+static HRESULT find_device_object(IPortableDeviceContent* content, IPortableDeviceProperties* properties, const wchar_t* parent_object_id, const wchar_t* search_object_name, wchar_t** out_object_id) {
+    const int BatchSize = 32;
+    HRESULT hr = E_FAIL;
+    IEnumPortableDeviceObjectIDs* enumerator = nullptr;
+    DWORD nfetched = 0;
+    wchar_t* object_ids[BatchSize] = { 0 };
+    wchar_t* target_object_id = nullptr;
+
+    hr = device_call(DeviceCall_Enumerate, [&]() { return content->EnumObjects(0, parent_object_id, nullptr, &enumerator); });
+    if (FAILED(hr)) goto quit;
+    if (hr != S_OK) {
+        hr = E_FAIL;
+        goto quit;
+    }
+
+    do {
+        hr = device_call(DeviceCall_Enumerate, [&]() { return enumerator->Next(BatchSize, object_ids, &nfetched); });
+        if (SUCCEEDED(hr)) {
+            for (DWORD i = 0; i < nfetched; ++i) {
+                wchar_t* object_id = object_ids[i];
+                wchar_t* object_name = nullptr;
+
+                hr = get_device_object_name(properties, object_id, &object_name);
+                if (FAILED(hr)) goto quit;
+
+                if (0 == _wcsicmp(object_name, search_object_name)) {
+                    target_object_id = string_clone(object_id);
+                    if (!target_object_id) {
+                        hr = E_OUTOFMEMORY;
+                    }
+                }
+
+                delete[] object_name;
+                CoTaskMemFree(object_id);
+                object_ids[i] = nullptr;
+
+                if (FAILED(hr)) {
+                    delete[] target_object_id;
+                    goto quit;
+                }
+
+                if (target_object_id) {
+                    goto quit;
+                }
+            }
+            nfetched = 0;
+        }
+    } while (hr == S_OK);
+
+    quit:
+    safe_release(&enumerator);
+    if (FAILED(hr)) {
+        delete[] target_object_id;
+        target_object_id = nullptr;
+    }
+    for (DWORD i = 0; i < nfetched; ++i) {
+        CoTaskMemFree(object_ids[i]);
+    }
+    *out_object_id = SUCCEEDED(hr) ? target_object_id : nullptr;
+    return hr;
+}
+
+static HRESULT enumerate_device_objects(
+    IPortableDeviceContent* content, 
+    IPortableDeviceProperties* properties, 
+    const wchar_t* object_id,
+    DeviceObjectInformation** out_objectinfo, 
+    int* out_nobjectinfo,
+    const volatile LONG* cancelled,
+    void* userdata,
+    bool(*filter)(const DeviceObjectMetadata& metadata, void* userdata))
+{
+    const int BatchSize = 32;
+    HRESULT hr = E_FAIL;
+    IEnumPortableDeviceObjectIDs* enumerator = nullptr;
+    DWORD nfetched = 0;
+    wchar_t* object_ids[BatchSize] = { 0 };
+    DeviceObjectInformation* objectinfo = nullptr;
+    int objectinfo_count = 0;
+    int objectinfo_capacity = 0;
+    DeviceObjectMetadata metadata;
+
+    hr = device_call(DeviceCall_Enumerate, [&]() { return content->EnumObjects(0, object_id, nullptr, &enumerator); });
+    if (FAILED(hr)) goto quit;
+    if (hr != S_OK) {
+        hr = E_FAIL;
+        goto quit;
+    }
+
+    do {
+        if (is_cancelled(cancelled)) {
+            hr = HRESULT_FROM_WIN32(ERROR_CANCELLED);
+            goto quit;
+        }
+
+        hr = device_call(DeviceCall_Enumerate, [&]() { return enumerator->Next(BatchSize, object_ids, &nfetched); });
+        if (SUCCEEDED(hr)) {
+            for (DWORD i = 0; i < nfetched; ++i) {
+                wchar_t* object_id = object_ids[i];
+
+                hr = get_device_object_metadata(properties, object_id, &metadata);
+                if (FAILED(hr)) goto quit;
+
+                if (filter(metadata, userdata)) {
+                    if (objectinfo == nullptr || objectinfo_count + 1 >= objectinfo_capacity) {
+                        int new_capacity = objectinfo_capacity == 0 ? BatchSize : objectinfo_capacity * 2;
+                        DeviceObjectInformation* new_objectinfo = new (std::nothrow) DeviceObjectInformation[new_capacity];
+                        if (!new_objectinfo) {
+                            hr = E_OUTOFMEMORY;
+                            goto quit;
+                        }
+                        memcpy(new_objectinfo, objectinfo, sizeof(objectinfo[0]) * objectinfo_count);
+                        delete[] objectinfo;
+                        objectinfo = new_objectinfo;
+                        objectinfo_capacity = new_capacity;
+                    }
+                    wchar_t* id_copy = string_clone(object_id);
+                    if (!id_copy) {
+                        hr = E_OUTOFMEMORY;
+                        goto quit;
+                    }
+                    auto& info = objectinfo[objectinfo_count++];
+                    info.id = id_copy;
+                    info.name = metadata.name; // <-- take ownership.
+                    info.persistent_id = metadata.persistent_id;
+                    info.hr = S_OK;
+                    info.has_size = metadata.has_size;
+                    info.size = metadata.size;
+                    info.date_modified = metadata.date_modified;
+                    metadata.name = nullptr;
+                    metadata.persistent_id = nullptr;
+                }
+
+                free_device_object_metadata(&metadata);
+                CoTaskMemFree(object_id);
+                object_ids[i] = nullptr;
+            }
+            nfetched = 0;
+        }
+    } while (hr == S_OK);
+
+    quit:
+    safe_release(&enumerator);
+    free_device_object_metadata(&metadata);
+    if (FAILED(hr) && objectinfo) {
+        for (int i = 0; i < objectinfo_count; ++i) {
+            delete[] objectinfo[i].id;
+            delete[] objectinfo[i].name;
+            delete[] objectinfo[i].persistent_id;
+        }
+        delete[] objectinfo;
+    }
+    for (DWORD i = 0; i < nfetched; ++i) {
+        CoTaskMemFree(object_ids[i]);
+    }
+    *out_objectinfo = SUCCEEDED(hr) ? objectinfo : nullptr;
+    *out_nobjectinfo = SUCCEEDED(hr) ? objectinfo_count : 0;
+    return hr;
+}
+
+static HRESULT find_device_object_by_path(IPortableDeviceContent* content, IPortableDeviceProperties* properties, const wchar_t* path, wchar_t** out_object_id) {
+    wchar_t full_path[MAX_PATH];
+    wchar_t curr_object_id[MAX_PATH];
+    wchar_t* component = full_path;
+    HRESULT hr;
+    *out_object_id = nullptr;
+
+    hr = PathCchCanonicalize(full_path, _countof(full_path), path);
+    if (FAILED(hr)) goto quit;
+
+    if (0 != wcscpy_s(curr_object_id, WPD_DEVICE_OBJECT_ID)) {
+        hr = E_FAIL;
+        goto quit;
+    }
+
+    do {
+        auto backslash_pos = component ? wcschr(component, L'\\') : nullptr;
+        int component_length = (int)(backslash_pos ? backslash_pos - component : wcslen(component));
+        if (component_length == 0) {
+            break;
+        }
+        wchar_t component_copy[MAX_PATH];
+        if (0 != wcsncpy_s(component_copy, component, (size_t)component_length)) {
+            hr = E_FAIL;
+            goto quit;
+        }
+
+        wchar_t* next_object_id = nullptr;
+        hr = find_device_object(content, properties, curr_object_id, component_copy, &next_object_id);
+        if (FAILED(hr)) goto quit;
+
+        if (next_object_id == nullptr) {
+            hr = HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+            goto quit;
+        }
+
+        bool copied = 0 == wcscpy_s(curr_object_id, next_object_id);
+        delete[] next_object_id;
+
+        if (!copied) {
+            hr = E_FAIL;
+            goto quit;
+        }
+    } while (component = PathFindNextComponentW(component));
+
+    quit:
+    if (SUCCEEDED(hr)) {
+        auto copy = string_clone(curr_object_id);
+        if (!copy) {
+            hr = E_OUTOFMEMORY;
+        }
+        *out_object_id = copy;
+    }
+    return hr;
+}
+
+// --- Catalog ---
+// Local copy of device object tree, so listing doesn't have to walk device over slow WPD link.
+// File layout: CatalogHeader, CatalogEntry[entry_count], string pool (NUL-terminated UTF-16 strings),
+// name index (entry indices sorted by parent and case-insensitive name). Header keeps ID and names of
+// device, so catalogs can be listed and matched while their devices are not connected.
+// Entry 0 is device object, children of every folder are stored next to each other.
+// File is memory-mapped for reading and rewritten in full on refresh.
+
+const char CatalogMagic[8] = { 'D', 'D', 'T', 'C', 'A', 'T', 'L', 'G' };
+const DWORD CatalogVersion = 3;
+const DWORD CatalogNone = 0xFFFFFFFF;
+
+enum CatalogEntryFlags {
+    CatalogEntry_HasSize         = 1 << 0,
+    CatalogEntry_HasDateModified = 1 << 1,
+    CatalogEntry_HasDateCreated  = 1 << 2,
+    CatalogEntry_Hidden          = 1 << 3,
+    CatalogEntry_System          = 1 << 4,
+
+    CatalogEntry_Stale           = 1u << 31, // <-- refresh only: entry was copied from previous catalog.
+};
+
+struct CatalogHeader {
+    char magic[8];
+    DWORD version;
+    DWORD entry_count;
+    DWORD string_count; // <-- in wchar_t.
+    DWORD device_id;            // Offsets in string pool,
+    DWORD device_friendly_name; // CatalogNone if device has none.
+    DWORD device_description;   //
+    ULONGLONG entries_offset;
+    ULONGLONG strings_offset;
+    ULONGLONG name_index_offset;
+    FILETIME updated;
+};
+
+struct CatalogEntry {
+    DWORD parent;
+    DWORD first_child; // <-- CatalogNone if object is not a folder.
+    DWORD child_count;
+    DWORD flags;
+    DWORD content_type;
+    DWORD id;            // Offsets in string pool.
+    DWORD persistent_id; // <-- empty string if device reports none.
+    DWORD name;          //
+    DWORD reserved[2];
+    ULONGLONG size;
+    DATE date_modified;
+    DATE date_created;
+};
+
+static_assert(sizeof(CatalogEntry) == 64, "CatalogEntry layout is part of file format");
+
+struct Catalog {
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+    const BYTE* view = nullptr;
+    const CatalogHeader* header = nullptr;
+    const CatalogEntry* entries = nullptr;
+    const wchar_t* strings = nullptr;
+    const DWORD* name_index = nullptr;
+};
+
+static void catalog_close(Catalog* catalog) {
+    if (catalog->view) UnmapViewOfFile(catalog->view);
+    if (catalog->mapping) CloseHandle(catalog->mapping);
+    if (catalog->file != INVALID_HANDLE_VALUE) CloseHandle(catalog->file);
+    *catalog = Catalog();
+}
+
+static bool catalog_section_fits(ULONGLONG file_size, ULONGLONG offset, ULONGLONG count, ULONGLONG item_size) {
+    return offset <= file_size && count <= (file_size - offset) / item_size;
+}
+
+static HRESULT catalog_open(const wchar_t* path, Catalog* out_catalog) {
+    Catalog catalog;
+    LARGE_INTEGER file_size = { 0 };
+    const CatalogHeader* header = nullptr;
+    HRESULT hr = S_OK;
+
+    catalog.file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (catalog.file == INVALID_HANDLE_VALUE || !GetFileSizeEx(catalog.file, &file_size)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto quit;
+    }
+    if ((ULONGLONG)file_size.QuadPart < sizeof(CatalogHeader)) {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        goto quit;
+    }
+
+    catalog.mapping = CreateFileMappingW(catalog.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!catalog.mapping) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto quit;
+    }
+
+    catalog.view = (const BYTE*)MapViewOfFile(catalog.mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!catalog.view) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto quit;
+    }
+
+    header = (const CatalogHeader*)catalog.view;
+    if (0 != memcmp(header->magic, CatalogMagic, sizeof(CatalogMagic)) || header->version != CatalogVersion ||
+        header->entry_count == 0 || header->string_count == 0 ||
+        !catalog_section_fits(file_size.QuadPart, header->entries_offset, header->entry_count, sizeof(CatalogEntry)) ||
+        !catalog_section_fits(file_size.QuadPart, header->strings_offset, header->string_count, sizeof(wchar_t)) ||
+        !catalog_section_fits(file_size.QuadPart, header->name_index_offset, header->entry_count, sizeof(DWORD)))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        goto quit;
+    }
+
+    catalog.header = header;
+    catalog.entries = (const CatalogEntry*)(catalog.view + header->entries_offset);
+    catalog.strings = (const wchar_t*)(catalog.view + header->strings_offset);
+    catalog.name_index = (const DWORD*)(catalog.view + header->name_index_offset);
+
+    // String pool must be terminated, so every string lookup stays inside of it.
+    if (catalog.strings[header->string_count - 1] != L'\0') {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        goto quit;
+    }
+
+    quit:
+    if (FAILED(hr)) {
+        catalog_close(&catalog);
+    }
+    *out_catalog = catalog;
+    return hr;
+}
+
+static const wchar_t* catalog_string(const Catalog* catalog, DWORD offset) {
+    return offset < catalog->header->string_count ? &catalog->strings[offset] : L"";
+}
+
+// Returns nullptr if device reports no persistent ID of entry, like live enumeration does.
+static const wchar_t* catalog_persistent_id(const Catalog* catalog, const CatalogEntry& entry) {
+    const wchar_t* persistent_id = catalog_string(catalog, entry.persistent_id);
+    return persistent_id[0] ? persistent_id : nullptr;
+}
+
+static int catalog_compare_names(const wchar_t* a, const wchar_t* b) {
+    return CompareStringOrdinal(a, -1, b, -1, TRUE) - CSTR_EQUAL;
+}
+
+// Binary search in name index. Returns CatalogNone if not found.
+static DWORD catalog_find_child(const Catalog* catalog, DWORD parent, const wchar_t* name) {
+    DWORD low = 0;
+    DWORD high = catalog->header->entry_count;
+    while (low < high) {
+        DWORD middle = low + (high - low) / 2;
+        DWORD index = catalog->name_index[middle];
+        if (index >= catalog->header->entry_count) {
+            return CatalogNone;
+        }
+        const CatalogEntry& entry = catalog->entries[index];
+
+        int order = entry.parent < parent ? -1 : entry.parent > parent ? 1 : 0;
+        if (order == 0) {
+            order = catalog_compare_names(catalog_string(catalog, entry.name), name);
+        }
+
+        if (order == 0) {
+            return index;
+        } else if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return CatalogNone;
+}
+
+// Same path rules as find_device_object_by_path.
+static HRESULT catalog_find_by_path(const Catalog* catalog, const wchar_t* path, DWORD* out_index) {
+    wchar_t full_path[MAX_PATH];
+    DWORD current = 0;
+    *out_index = CatalogNone;
+
+    if (path) {
+        HRESULT hr = PathCchCanonicalize(full_path, _countof(full_path), path);
+        if (FAILED(hr)) return hr;
+
+        for (wchar_t* component = full_path; component; component = PathFindNextComponentW(component)) {
+            auto backslash_pos = wcschr(component, L'\\');
+            int component_length = (int)(backslash_pos ? backslash_pos - component : wcslen(component));
+            if (component_length == 0) {
+                break;
+            }
+            wchar_t component_copy[MAX_PATH];
+            if (0 != wcsncpy_s(component_copy, component, (size_t)component_length)) {
+                return E_FAIL;
+            }
+
+            current = catalog_find_child(catalog, current, component_copy);
+            if (current == CatalogNone) {
+                return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+            }
+        }
+    }
+
+    *out_index = current;
+    return S_OK;
+}
+
+static void catalog_entry_metadata(const Catalog* catalog, const CatalogEntry& entry, DeviceObjectMetadata* out_metadata) {
+    DeviceObjectMetadata metadata;
+    metadata.name = (wchar_t*)catalog_string(catalog, entry.name); // <-- not owned.
+    metadata.has_size = (entry.flags & CatalogEntry_HasSize) != 0;
+    metadata.size = entry.size;
+    metadata.has_date_modified = (entry.flags & CatalogEntry_HasDateModified) != 0;
+    metadata.date_modified = entry.date_modified;
+    metadata.has_date_created = (entry.flags & CatalogEntry_HasDateCreated) != 0;
+    metadata.date_created = entry.date_created;
+    metadata.content_type = entry.content_type;
+    metadata.hidden = (entry.flags & CatalogEntry_Hidden) != 0;
+    metadata.system = (entry.flags & CatalogEntry_System) != 0;
+    *out_metadata = metadata;
+}
+
+// Returns "%LOCALAPPDATA%\device_data_tool\<name>" and creates "device_data_tool" directory.
+static HRESULT get_tool_data_path(const wchar_t* name, wchar_t** out_path) {
+    wchar_t local_app_data[MAX_PATH];
+    *out_path = nullptr;
+
+    DWORD length = GetEnvironmentVariableW(L"LOCALAPPDATA", local_app_data, _countof(local_app_data));
+    if (length == 0 || length >= _countof(local_app_data)) {
+        return HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND);
+    }
+
+    wchar_t* directory = string_format(L"%s\\device_data_tool", local_app_data);
+    if (!directory) {
+        return E_OUTOFMEMORY;
+    }
+    if (!CreateDirectoryW(directory, nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+        delete[] directory;
+        return hr;
+    }
+    delete[] directory;
+
+    *out_path = string_format(L"%s\\device_data_tool\\%s", local_app_data, name);
+    return *out_path ? S_OK : E_OUTOFMEMORY;
+}
+
+// Catalog directory, default is "%LOCALAPPDATA%\device_data_tool\catalogs". Directory is created.
+static HRESULT get_catalog_directory(const wchar_t* catalog_directory, wchar_t** out_directory) {
+    wchar_t* directory = nullptr;
+    HRESULT hr = S_OK;
+    *out_directory = nullptr;
+
+    if (catalog_directory) {
+        directory = string_clone(catalog_directory);
+        if (!directory) return E_OUTOFMEMORY;
+    } else {
+        hr = get_tool_data_path(L"catalogs", &directory);
+        if (FAILED(hr)) return hr;
+    }
+
+    if (!CreateDirectoryW(directory, nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        delete[] directory;
+        return hr;
+    }
+    *out_directory = directory;
+    return S_OK;
+}
+
+// Catalog file of device, "<catalog directory>\<device id with invalid characters replaced>.catalog".
+static HRESULT get_catalog_path(const wchar_t* catalog_directory, const wchar_t* device_id, wchar_t** out_path) {
+    wchar_t* directory = nullptr;
+    wchar_t* file_name = nullptr;
+    wchar_t* path = nullptr;
+    *out_path = nullptr;
+
+    HRESULT hr = get_catalog_directory(catalog_directory, &directory);
+    if (FAILED(hr)) goto quit;
+
+    file_name = string_format(L"%s.catalog", device_id);
+    if (!file_name) {
+        hr = E_OUTOFMEMORY;
+        goto quit;
+    }
+    for (wchar_t* c = file_name; *c; ++c) {
+        if (*c < 32 || wcschr(L"<>:\"/\\|?*", *c)) {
+            *c = L'_';
+        }
+    }
+
+    hr = PathAllocCombine(directory, file_name, PATHCCH_ALLOW_LONG_PATHS, &path);
+    if (FAILED(hr)) goto quit;
+
+    *out_path = string_clone(path);
+    LocalFree(path);
+    if (!*out_path) {
+        hr = E_OUTOFMEMORY;
+    }
+
+    quit:
+    delete[] directory;
+    delete[] file_name;
+    return hr;
+}
+
+struct CatalogBuilder {
+    DWORD device_id = CatalogNone;
+    DWORD device_friendly_name = CatalogNone;
+    DWORD device_description = CatalogNone;
+    CatalogEntry* entries = nullptr;
+    DWORD entry_count = 0;
+    DWORD entry_capacity = 0;
+    wchar_t* strings = nullptr;
+    DWORD string_count = 0;
+    DWORD string_capacity = 0;
+};
+
+static void catalog_builder_free(CatalogBuilder* builder) {
+    delete[] builder->entries;
+    delete[] builder->strings;
+    *builder = CatalogBuilder();
+}
+
+static DWORD catalog_builder_add_string(CatalogBuilder* builder, const wchar_t* text) {
+    if (!text) return CatalogNone;
+
+    DWORD length = (DWORD)wcslen(text) + 1;
+    if (builder->string_count + length > builder->string_capacity) {
+        DWORD new_capacity = builder->string_capacity == 0 ? 64 * 1024 : builder->string_capacity * 2;
+        while (new_capacity < builder->string_count + length) new_capacity *= 2;
+        wchar_t* new_strings = new (std::nothrow) wchar_t[new_capacity];
+        if (!new_strings) return CatalogNone;
+        memcpy(new_strings, builder->strings, sizeof(wchar_t) * builder->string_count);
+        delete[] builder->strings;
+        builder->strings = new_strings;
+        builder->string_capacity = new_capacity;
+    }
+
+    DWORD offset = builder->string_count;
+    memcpy(&builder->strings[offset], text, sizeof(wchar_t) * length);
+    builder->string_count += length;
+    return offset;
+}
+
+static HRESULT catalog_builder_add_entry(CatalogBuilder* builder, DWORD parent, const wchar_t* id, const DeviceObjectMetadata& metadata, DWORD extra_flags, DWORD* out_index) {
+    if (builder->entry_count == builder->entry_capacity) {
+        DWORD new_capacity = builder->entry_capacity == 0 ? 1024 : builder->entry_capacity * 2;
+        CatalogEntry* new_entries = new (std::nothrow) CatalogEntry[new_capacity];
+        if (!new_entries) return E_OUTOFMEMORY;
+        memcpy(new_entries, builder->entries, sizeof(CatalogEntry) * builder->entry_count);
+        delete[] builder->entries;
+        builder->entries = new_entries;
+        builder->entry_capacity = new_capacity;
+    }
+
+    CatalogEntry entry = { 0 };
+    entry.parent = parent;
+    entry.first_child = CatalogNone;
+    entry.content_type = metadata.content_type;
+    entry.size = metadata.size;
+    entry.date_modified = metadata.date_modified;
+    entry.date_created = metadata.date_created;
+    entry.flags = extra_flags;
+    if (metadata.has_size) entry.flags |= CatalogEntry_HasSize;
+    if (metadata.has_date_modified) entry.flags |= CatalogEntry_HasDateModified;
+    if (metadata.has_date_created) entry.flags |= CatalogEntry_HasDateCreated;
+    if (metadata.hidden) entry.flags |= CatalogEntry_Hidden;
+    if (metadata.system) entry.flags |= CatalogEntry_System;
+
+    entry.id = catalog_builder_add_string(builder, id);
+    entry.name = catalog_builder_add_string(builder, metadata.name ? metadata.name : L"");
+    entry.persistent_id = metadata.persistent_id ? catalog_builder_add_string(builder, metadata.persistent_id) : catalog_builder_add_string(builder, L"");
+    if (entry.id == CatalogNone || entry.name == CatalogNone || entry.persistent_id == CatalogNone) {
+        return E_OUTOFMEMORY;
+    }
+
+    *out_index = builder->entry_count;
+    builder->entries[builder->entry_count++] = entry;
+    return S_OK;
+}
+
+static int catalog_builder_compare_names(void* context, const void* a, const void* b) {
+    auto builder = (const CatalogBuilder*)context;
+    const CatalogEntry& entry_a = builder->entries[*(const DWORD*)a];
+    const CatalogEntry& entry_b = builder->entries[*(const DWORD*)b];
+    if (entry_a.parent != entry_b.parent) {
+        return entry_a.parent < entry_b.parent ? -1 : 1;
+    }
+    return catalog_compare_names(&builder->strings[entry_a.name], &builder->strings[entry_b.name]);
+}
+
+static HRESULT write_all(HANDLE file, const void* data, ULONGLONG size) {
+    const BYTE* bytes = (const BYTE*)data;
+    while (size > 0) {
+        DWORD chunk = size > 64 * 1024 * 1024 ? 64 * 1024 * 1024 : (DWORD)size;
+        DWORD nwritten = 0;
+        if (!WriteFile(file, bytes, chunk, &nwritten, nullptr)) {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+        bytes += nwritten;
+        size -= nwritten;
+    }
+    return S_OK;
+}
+
+// Writes catalog into temporary file and replaces old catalog with it, so readers
+// never see partially written catalog. Old catalog must not be mapped.
+static HRESULT catalog_builder_write(CatalogBuilder* builder, const wchar_t* path) {
+    HANDLE file = INVALID_HANDLE_VALUE;
+    wchar_t* temp_path = string_format(L"%s.tmp", path);
+    DWORD* name_index = new (std::nothrow) DWORD[builder->entry_count];
+    CatalogHeader header = { 0 };
+    HRESULT hr = S_OK;
+
+    if (!temp_path || !name_index) {
+        hr = E_OUTOFMEMORY;
+        goto quit;
+    }
+
+    for (DWORD i = 0; i < builder->entry_count; ++i) {
+        builder->entries[i].flags &= ~(DWORD)CatalogEntry_Stale;
+        name_index[i] = i;
+    }
+    qsort_s(name_index, builder->entry_count, sizeof(DWORD), catalog_builder_compare_names, builder);
+
+    memcpy(header.magic, CatalogMagic, sizeof(CatalogMagic));
+    header.version = CatalogVersion;
+    header.entry_count = builder->entry_count;
+    header.string_count = builder->string_count;
+    header.device_id = builder->device_id;
+    header.device_friendly_name = builder->device_friendly_name;
+    header.device_description = builder->device_description;
+    header.entries_offset = sizeof(CatalogHeader);
+    header.strings_offset = header.entries_offset + sizeof(CatalogEntry) * (ULONGLONG)builder->entry_count;
+    header.name_index_offset = header.strings_offset + sizeof(wchar_t) * (ULONGLONG)builder->string_count;
+    header.name_index_offset = (header.name_index_offset + 7) & ~7ull;
+    GetSystemTimeAsFileTime(&header.updated);
+
+    file = CreateFileW(temp_path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto quit;
+    }
+
+    {
+        const BYTE padding[8] = { 0 };
+        ULONGLONG padding_size = header.name_index_offset - (header.strings_offset + sizeof(wchar_t) * (ULONGLONG)builder->string_count);
+
+        hr = write_all(file, &header, sizeof(header));
+        if (SUCCEEDED(hr)) hr = write_all(file, builder->entries, sizeof(CatalogEntry) * (ULONGLONG)builder->entry_count);
+        if (SUCCEEDED(hr)) hr = write_all(file, builder->strings, sizeof(wchar_t) * (ULONGLONG)builder->string_count);
+        if (SUCCEEDED(hr)) hr = write_all(file, padding, padding_size);
+        if (SUCCEEDED(hr)) hr = write_all(file, name_index, sizeof(DWORD) * (ULONGLONG)builder->entry_count);
+        if (FAILED(hr)) goto quit;
+    }
+
+    if (!FlushFileBuffers(file)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto quit;
+    }
+    CloseHandle(file);
+    file = INVALID_HANDLE_VALUE;
+
+    if (!MoveFileExW(temp_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto quit;
+    }
+
+    quit:
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+    if (FAILED(hr) && temp_path) {
+        DeleteFileW(temp_path);
+    }
+    delete[] temp_path;
+    delete[] name_index;
+    return hr;
+}
+
+// Hash table from persistent ID to entry index of previous catalog. Object IDs may change between
+// device sessions, persistent IDs don't. Entries without persistent ID are not in it.
+struct CatalogIdMap {
+    DWORD* slots = nullptr;
+    DWORD mask = 0;
+};
+
+static DWORD hash_string(const wchar_t* text) {
+    DWORD hash = 2166136261u;
+    for (; *text; ++text) {
+        hash = (hash ^ (DWORD)*text) * 16777619u;
+    }
+    return hash;
+}
+
+static HRESULT catalog_id_map_build(const Catalog* catalog, CatalogIdMap* out_map) {
+    DWORD capacity = 1024;
+    while (capacity < catalog->header->entry_count * 2) capacity *= 2;
+
+    CatalogIdMap map;
+    map.slots = new (std::nothrow) DWORD[capacity];
+    if (!map.slots) return E_OUTOFMEMORY;
+    map.mask = capacity - 1;
+    memset(map.slots, 0xFF, sizeof(DWORD) * capacity);
+
+    for (DWORD i = 0; i < catalog->header->entry_count; ++i) {
+        const wchar_t* persistent_id = catalog_persistent_id(catalog, catalog->entries[i]);
+        if (!persistent_id) continue;
+        DWORD slot = hash_string(persistent_id) & map.mask;
+        while (map.slots[slot] != CatalogNone) {
+            slot = (slot + 1) & map.mask;
+        }
+        map.slots[slot] = i;
+    }
+
+    *out_map = map;
+    return S_OK;
+}
+
+static DWORD catalog_id_map_find(const CatalogIdMap* map, const Catalog* catalog, const wchar_t* persistent_id) {
+    if (!map->slots || !persistent_id || !persistent_id[0]) return CatalogNone;
+    DWORD slot = hash_string(persistent_id) & map->mask;
+    while (map->slots[slot] != CatalogNone) {
+        DWORD index = map->slots[slot];
+        if (0 == wcscmp(catalog_string(catalog, catalog->entries[index].persistent_id), persistent_id)) {
+            return index;
+        }
+        slot = (slot + 1) & map->mask;
+    }
+    return CatalogNone;
+}
+
+// Returns IDs of all children of object, free every ID with CoTaskMemFree and array with delete[].
+static HRESULT enumerate_device_object_ids(IPortableDeviceContent* content, const wchar_t* parent_object_id, wchar_t*** out_ids, DWORD* out_count) {
+    const int BatchSize = 32;
+    IEnumPortableDeviceObjectIDs* enumerator = nullptr;
+    wchar_t** ids = nullptr;
+    DWORD count = 0;
+    DWORD capacity = 0;
+    DWORD nfetched = 0;
+
+    HRESULT hr = device_call(DeviceCall_Enumerate, [&]() { return content->EnumObjects(0, parent_object_id, nullptr, &enumerator); });
+    if (FAILED(hr)) goto quit;
+    if (hr != S_OK) {
+        hr = E_FAIL;
+        goto quit;
+    }
+
+    do {
+        if (count + BatchSize > capacity) {
+            DWORD new_capacity = capacity == 0 ? BatchSize * 2 : capacity * 2;
+            wchar_t** new_ids = new (std::nothrow) wchar_t*[new_capacity];
+            if (!new_ids) {
+                hr = E_OUTOFMEMORY;
+                goto quit;
+            }
+            memcpy(new_ids, ids, sizeof(ids[0]) * count);
+            delete[] ids;
+            ids = new_ids;
+            capacity = new_capacity;
+        }
+
+        nfetched = 0;
+        hr = device_call(DeviceCall_Enumerate, [&]() { return enumerator->Next(BatchSize, &ids[count], &nfetched); });
+        if (SUCCEEDED(hr)) {
+            count += nfetched;
+        }
+    } while (hr == S_OK);
+
+    quit:
+    safe_release(&enumerator);
+    if (FAILED(hr)) {
+        for (DWORD i = 0; i < count; ++i) {
+            CoTaskMemFree(ids[i]);
+        }
+        delete[] ids;
+        ids = nullptr;
+        count = 0;
+    } else {
+        hr = S_OK;
+    }
+    *out_ids = ids;
+    *out_count = count;
+    return hr;
+}
+
+static int compare_object_ids(void* context, const void* a, const void* b) {
+    auto ids = (wchar_t* const*)context;
+    return wcscmp(ids[*(const DWORD*)a], ids[*(const DWORD*)b]);
+}
+
+// Finds entry of previous catalog for every current child of folder: persistent IDs of old children are
+// translated to current object IDs with one device call. Returns S_FALSE if children are not the same
+// objects as old ones, then out_old_children is not valid.
+static HRESULT catalog_match_children(IPortableDeviceContent* content, const Catalog* old_catalog, DWORD old_folder, wchar_t** child_ids, DWORD nchild_ids, DWORD* out_old_children) {
+    const CatalogEntry& folder = old_catalog->entries[old_folder];
+    IPortableDevicePropVariantCollection* persistent_ids = nullptr;
+    IPortableDevicePropVariantCollection* object_ids = nullptr;
+    DWORD* order = nullptr; // <-- indices of child_ids sorted by ID.
+    DWORD nobject_ids = 0;
+    HRESULT hr = S_OK;
+
+    if (folder.child_count != nchild_ids) return S_FALSE;
+    if (nchild_ids == 0) return S_OK;
+    if (folder.first_child == CatalogNone || folder.first_child > old_catalog->header->entry_count ||
+        nchild_ids > old_catalog->header->entry_count - folder.first_child)
+    {
+        return S_FALSE;
+    }
+
+    hr = CoCreateInstance(CLSID_PortableDevicePropVariantCollection, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&persistent_ids));
+    if (FAILED(hr)) goto quit;
+
+    for (DWORD i = 0; i < nchild_ids; ++i) {
+        const wchar_t* persistent_id = catalog_persistent_id(old_catalog, old_catalog->entries[folder.first_child + i]);
+        if (!persistent_id) {
+            hr = S_FALSE;
+            goto quit;
+        }
+
+        PROPVARIANT value;
+        PropVariantInit(&value);
+        size_t id_size = (1 + wcslen(persistent_id)) * sizeof(wchar_t);
+        value.vt = VT_LPWSTR;
+        value.pwszVal = (wchar_t*)CoTaskMemAlloc(id_size);
+        if (!value.pwszVal) {
+            hr = E_OUTOFMEMORY;
+            goto quit;
+        }
+        memcpy(value.pwszVal, persistent_id, id_size);
+        hr = persistent_ids->Add(&value);
+        PropVariantClear(&value);
+        if (FAILED(hr)) goto quit;
+    }
+
+    hr = device_call(DeviceCall_Enumerate, [&]() { return content->GetObjectIDsFromPersistentUniqueIDs(persistent_ids, &object_ids); });
+    if (FAILED(hr)) goto quit;
+    hr = object_ids->GetCount(&nobject_ids);
+    if (FAILED(hr)) goto quit;
+    if (nobject_ids != nchild_ids) {
+        hr = S_FALSE;
+        goto quit;
+    }
+
+    order = new (std::nothrow) DWORD[nchild_ids];
+    if (!order) {
+        hr = E_OUTOFMEMORY;
+        goto quit;
+    }
+    for (DWORD k = 0; k < nchild_ids; ++k) {
+        order[k] = k;
+        out_old_children[k] = CatalogNone;
+    }
+    qsort_s(order, nchild_ids, sizeof(DWORD), compare_object_ids, child_ids);
+
+    // Every old child must be one of current children, and no two the same one.
+    for (DWORD i = 0; i < nchild_ids && hr == S_OK; ++i) {
+        PROPVARIANT value;
+        PropVariantInit(&value);
+        hr = object_ids->GetAt(i, &value);
+        if (FAILED(hr)) goto quit;
+
+        DWORD found = CatalogNone;
+        if (value.vt == VT_LPWSTR && value.pwszVal) {
+            DWORD low = 0;
+            DWORD high = nchild_ids;
+            while (low < high) {
+                DWORD middle = low + (high - low) / 2;
+                int order_result = wcscmp(child_ids[order[middle]], value.pwszVal);
+                if (order_result == 0) {
+                    found = order[middle];
+                    break;
+                }
+                if (order_result < 0) low = middle + 1; else high = middle;
+            }
+        }
+        PropVariantClear(&value);
+
+        if (found == CatalogNone || out_old_children[found] != CatalogNone) {
+            hr = S_FALSE;
+        } else {
+            out_old_children[found] = folder.first_child + i;
+        }
+    }
+
+    quit:
+    delete[] order;
+    safe_release(&object_ids);
+    safe_release(&persistent_ids);
+    return hr;
+}
+
+// Walks whole device and writes new catalog. Objects of folders whose children and modification date
+// are the same as in previous catalog are copied from it without asking device for their properties.
+// Folders and children are matched with previous catalog by persistent ID.
+static HRESULT refresh_device_catalog(IPortableDeviceContent* content, IPortableDeviceProperties* properties, const wchar_t* device_id, const wchar_t* catalog_path, const volatile LONG* cancelled, CatalogRefreshStats* out_stats) {
+    Catalog old_catalog;
+    CatalogIdMap old_ids;
+    CatalogBuilder builder;
+    CatalogRefreshStats stats;
+    PortableDeviceInformation device;
+    IPortableDeviceManager* device_manager = nullptr;
+    wchar_t** child_ids = nullptr;
+    DWORD* old_children = nullptr;
+    DWORD nchild_ids = 0;
+    DeviceObjectMetadata metadata;
+    DWORD root = 0;
+    HRESULT hr = S_OK;
+
+    bool has_old_catalog = SUCCEEDED(catalog_open(catalog_path, &old_catalog));
+    if (has_old_catalog) {
+        hr = catalog_id_map_build(&old_catalog, &old_ids);
+        if (FAILED(hr)) goto quit;
+    }
+
+    // Names let catalog be matched while device is disconnected, catalog is still useful without them.
+    device.id = (wchar_t*)device_id; // <-- not owned.
+    if (SUCCEEDED(CoCreateInstance(CLSID_PortableDeviceManager, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&device_manager)))) {
+        get_device_names(device_manager, &device);
+    }
+    builder.device_id = catalog_builder_add_string(&builder, device_id);
+    builder.device_friendly_name = catalog_builder_add_string(&builder, device.friendly_name);
+    builder.device_description = catalog_builder_add_string(&builder, device.description);
+    if (builder.device_id == CatalogNone) {
+        hr = E_OUTOFMEMORY;
+        goto quit;
+    }
+
+    metadata.name = (wchar_t*)L"";
+    metadata.content_type = ContentType_Folder;
+    hr = catalog_builder_add_entry(&builder, CatalogNone, WPD_DEVICE_OBJECT_ID, metadata, 0, &root);
+    metadata = DeviceObjectMetadata();
+    if (FAILED(hr)) goto quit;
+
+    // Breadth-first walk: children of every folder are appended after all previously added entries,
+    // so they end up stored next to each other.
+    for (DWORD i = 0; i < builder.entry_count; ++i) {
+        if (builder.entries[i].content_type != ContentType_Folder) {
+            continue;
+        }
+        if (is_cancelled(cancelled)) {
+            hr = HRESULT_FROM_WIN32(ERROR_CANCELLED);
+            goto quit;
+        }
+        ++stats.folders;
+
+        const wchar_t* folder_id = &builder.strings[builder.entries[i].id];
+        DWORD old_folder = CatalogNone;
+        if (has_old_catalog) {
+            old_folder = i == root ? 0 : catalog_id_map_find(&old_ids, &old_catalog, &builder.strings[builder.entries[i].persistent_id]);
+        }
+
+        // Entry copied from old catalog may be outdated: get current modification date of folder.
+        if (builder.entries[i].flags & CatalogEntry_Stale) {
+            hr = get_device_object_metadata(properties, folder_id, &metadata);
+            if (FAILED(hr)) goto quit;
+            ++stats.fetched_objects;
+            builder.entries[i].flags &= ~(DWORD)CatalogEntry_HasDateModified;
+            if (metadata.has_date_modified) builder.entries[i].flags |= CatalogEntry_HasDateModified;
+            builder.entries[i].date_modified = metadata.date_modified;
+            free_device_object_metadata(&metadata);
+        }
+
+        hr = enumerate_device_object_ids(content, folder_id, &child_ids, &nchild_ids);
+        if (FAILED(hr)) goto quit;
+
+        bool unchanged = false;
+        if (old_folder != CatalogNone) {
+            const CatalogEntry& old_entry = old_catalog.entries[old_folder];
+            const CatalogEntry& new_entry = builder.entries[i];
+            unchanged = old_entry.child_count == nchild_ids &&
+                (old_entry.flags & CatalogEntry_HasDateModified) == (new_entry.flags & CatalogEntry_HasDateModified) &&
+                old_entry.date_modified == new_entry.date_modified;
+            if (unchanged) {
+                old_children = new (std::nothrow) DWORD[nchild_ids > 0 ? nchild_ids : 1];
+                if (!old_children) {
+                    hr = E_OUTOFMEMORY;
+                    goto quit;
+                }
+                hr = catalog_match_children(content, &old_catalog, old_folder, child_ids, nchild_ids, old_children);
+                if (FAILED(hr)) goto quit;
+                unchanged = hr == S_OK;
+            }
+        }
+        if (!unchanged) {
+            ++stats.changed_folders;
+        }
+
+        builder.entries[i].first_child = builder.entry_count;
+        builder.entries[i].child_count = nchild_ids;
+
+        for (DWORD k = 0; k < nchild_ids; ++k) {
+            DWORD child = 0;
+            if (unchanged) {
+                const CatalogEntry& old_entry = old_catalog.entries[old_children[k]];
+                catalog_entry_metadata(&old_catalog, old_entry, &metadata);
+                metadata.persistent_id = (wchar_t*)catalog_persistent_id(&old_catalog, old_entry);
+                hr = catalog_builder_add_entry(&builder, i, child_ids[k], metadata, CatalogEntry_Stale, &child);
+                metadata = DeviceObjectMetadata(); // <-- strings are owned by old catalog.
+            } else {
+                hr = get_device_object_metadata(properties, child_ids[k], &metadata);
+                if (SUCCEEDED(hr)) {
+                    ++stats.fetched_objects;
+                    hr = catalog_builder_add_entry(&builder, i, child_ids[k], metadata, 0, &child);
+                }
+                free_device_object_metadata(&metadata);
+            }
+            if (FAILED(hr)) goto quit;
+        }
+
+        for (DWORD k = 0; k < nchild_ids; ++k) {
+            CoTaskMemFree(child_ids[k]);
+        }
+        delete[] child_ids;
+        child_ids = nullptr;
+        nchild_ids = 0;
+        delete[] old_children;
+        old_children = nullptr;
+    }
+
+    // File can't be replaced while it's mapped.
+    catalog_close(&old_catalog);
+    has_old_catalog = false;
+
+    hr = catalog_builder_write(&builder, catalog_path);
+
+    quit:
+    for (DWORD k = 0; k < nchild_ids; ++k) {
+        CoTaskMemFree(child_ids[k]);
+    }
+    delete[] child_ids;
+    delete[] old_children;
+    delete[] device.friendly_name;
+    delete[] device.description;
+    safe_release(&device_manager);
+    free_device_object_metadata(&metadata);
+    catalog_builder_free(&builder);
+    delete[] old_ids.slots;
+    catalog_close(&old_catalog);
+    *out_stats = stats;
+    return hr;
+}
+
+// Gets children of directory which pass filter from catalog file.
+static HRESULT load_catalog_objects(const wchar_t* catalog_path, const wchar_t* directory, const ObjectFilter& filter, DeviceObjectInformation** out_objects, int* out_nobjects, FILETIME* out_updated) {
+    Catalog catalog;
+    DWORD folder = CatalogNone;
+    DeviceObjectInformation* objects = nullptr;
+    int nobjects = 0;
+    DWORD first = 0;
+    DWORD count = 0;
+
+    HRESULT hr = catalog_open(catalog_path, &catalog);
+    if (FAILED(hr)) goto quit;
+
+    hr = catalog_find_by_path(&catalog, directory, &folder);
+    if (FAILED(hr)) goto quit;
+
+    first = catalog.entries[folder].first_child;
+    count = catalog.entries[folder].child_count;
+    if (first == CatalogNone || first > catalog.header->entry_count || count > catalog.header->entry_count - first) {
+        first = 0;
+        count = 0;
+    }
+
+    objects = new (std::nothrow) DeviceObjectInformation[count > 0 ? count : 1];
+    if (!objects) {
+        hr = E_OUTOFMEMORY;
+        goto quit;
+    }
+
+    for (DWORD i = first; i < first + count; ++i) {
+        const CatalogEntry& entry = catalog.entries[i];
+        DeviceObjectMetadata metadata;
+        catalog_entry_metadata(&catalog, entry, &metadata);
+        if (!object_filter_accepts(filter, metadata)) {
+            continue;
+        }
+
+        auto& object = objects[nobjects++];
+        object.id = string_clone(catalog_string(&catalog, entry.id));
+        object.name = string_clone(metadata.name);
+        const wchar_t* persistent_id = catalog_persistent_id(&catalog, entry);
+        object.persistent_id = persistent_id ? string_clone(persistent_id) : nullptr;
+        object.hr = S_OK;
+        object.has_size = (entry.flags & CatalogEntry_HasSize) != 0;
+        object.size = entry.size;
+        object.date_modified = entry.date_modified;
+        if (!object.id || !object.name || (persistent_id && !object.persistent_id)) {
+            hr = E_OUTOFMEMORY;
+            goto quit;
+        }
+    }
+
+    *out_updated = catalog.header->updated;
+
+    quit:
+    catalog_close(&catalog);
+    if (FAILED(hr)) {
+        engine_free_objects(objects, nobjects);
+        objects = nullptr;
+        nobjects = 0;
+    }
+    *out_objects = objects;
+    *out_nobjects = nobjects;
+    return hr;
+}
+
+// --- Ledger ---
+// History of transferred objects, so objects which were moved away from destination since they were
+// copied are still recognized. Record key is 128-bit hash of device ID, persistent object ID, size and
+// modification date, so object which was changed on device doesn't match its old record. Objects without
+// persistent ID are not recorded.
+// File layout: LedgerHeader, LedgerRecord[]. First sorted_count records are sorted by key and memory-mapped,
+// records after them were appended later. Appended records are merged into sorted part when ledger is opened
+// and there are many of them. Bloom filter of all keys is kept in memory, so looking up object which was
+// never transferred doesn't touch the file.
+// Several processes may use ledger at once. Appends and merge take exclusive lock of a byte range past the
+// end of file, and merge replaces file while holding it, so no append lands between reading records and
+// replacing file. Process whose file was replaced switches to the merged one before its next append.
+
+const char LedgerMagic[8] = { 'D', 'D', 'T', 'L', 'E', 'D', 'G', 'R' };
+const DWORD LedgerVersion = 1;
+const ULONGLONG LedgerMergeThreshold = 4096; // <-- appended records which trigger merge on open.
+const ULONGLONG LedgerBloomSpareKeys = 65536; // <-- keys which may be added after open without raising false positive rate.
+const int LedgerBloomBitsPerKey = 16;
+const int LedgerBloomHashes = 8;
+
+struct LedgerHeader {
+    char magic[8];
+    DWORD version;
+    DWORD reserved;
+    ULONGLONG sorted_count;
+};
+
+struct LedgerRecord {
+    ULONGLONG key[2];
+    ULONGLONG size;
+    DATE date_modified;
+    FILETIME ingested;
+};
+
+static_assert(sizeof(LedgerRecord) == 40, "LedgerRecord layout is part of file format");
+
+struct Ledger {
+    SRWLOCK lock = SRWLOCK_INIT; // <-- shared by lookups, exclusive when adding.
+    wchar_t* path = nullptr;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+    const BYTE* view = nullptr;
+    const LedgerRecord* sorted = nullptr;
+    ULONGLONG nsorted = 0;
+    LedgerRecord* tail = nullptr; // <-- appended records, kept sorted in memory.
+    size_t ntail = 0;
+    size_t tail_capacity = 0;
+    ULONGLONG* bloom = nullptr;
+    ULONGLONG bloom_mask = 0; // <-- number of bits - 1.
+    bool unflushed = false;
+};
+
+static ULONGLONG mix_hash(ULONGLONG hash) {
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBull;
+    return hash ^ (hash >> 31);
+}
+
+static void hash_bytes(ULONGLONG* hash, const void* data, size_t size) {
+    const BYTE* bytes = (const BYTE*)data;
+    for (size_t i = 0; i < size; ++i) {
+        *hash = (*hash ^ bytes[i]) * 1099511628211ull;
+    }
+}
+
+// Object must have persistent ID.
+static void ledger_key(const wchar_t* device_id, const DeviceObjectInformation& object, ULONGLONG* out_key) {
+    const ULONGLONG bases[2] = { 14695981039346656037ull, 0x6C62272E07BB0142ull };
+    for (int i = 0; i < 2; ++i) {
+        ULONGLONG hash = bases[i];
+        hash_bytes(&hash, device_id, (wcslen(device_id) + 1) * sizeof(wchar_t));
+        hash_bytes(&hash, object.persistent_id, (wcslen(object.persistent_id) + 1) * sizeof(wchar_t));
+        hash_bytes(&hash, &object.size, sizeof(object.size));
+        hash_bytes(&hash, &object.date_modified, sizeof(object.date_modified));
+        out_key[i] = mix_hash(hash);
+    }
+}
+
+static int ledger_compare_keys(const ULONGLONG* a, const ULONGLONG* b) {
+    if (a[0] != b[0]) return a[0] < b[0] ? -1 : 1;
+    if (a[1] != b[1]) return a[1] < b[1] ? -1 : 1;
+    return 0;
+}
+
+static int ledger_compare_records(const void* a, const void* b) {
+    return ledger_compare_keys(((const LedgerRecord*)a)->key, ((const LedgerRecord*)b)->key);
+}
+
+// Returns index of first record which is not less than key.
+static ULONGLONG ledger_lower_bound(const LedgerRecord* records, ULONGLONG count, const ULONGLONG* key) {
+    ULONGLONG low = 0;
+    ULONGLONG high = count;
+    while (low < high) {
+        ULONGLONG middle = low + (high - low) / 2;
+        if (ledger_compare_keys(records[middle].key, key) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static bool ledger_records_contain(const LedgerRecord* records, ULONGLONG count, const ULONGLONG* key) {
+    ULONGLONG index = ledger_lower_bound(records, count, key);
+    return index < count && 0 == ledger_compare_keys(records[index].key, key);
+}
+
+static void ledger_bloom_add(Ledger* ledger, const ULONGLONG* key) {
+    for (int i = 0; i < LedgerBloomHashes; ++i) {
+        ULONGLONG bit = (key[0] + i * (key[1] | 1)) & ledger->bloom_mask;
+        ledger->bloom[bit / 64] |= 1ull << (bit % 64);
+    }
+}
+
+static bool ledger_bloom_test(const Ledger* ledger, const ULONGLONG* key) {
+    for (int i = 0; i < LedgerBloomHashes; ++i) {
+        ULONGLONG bit = (key[0] + i * (key[1] | 1)) & ledger->bloom_mask;
+        if (!(ledger->bloom[bit / 64] & (1ull << (bit % 64)))) return false;
+    }
+    return true;
+}
+
+static HRESULT read_all_at(HANDLE file, ULONGLONG offset, void* data, ULONGLONG size) {
+    BYTE* bytes = (BYTE*)data;
+    while (size > 0) {
+        OVERLAPPED overlapped = { 0 };
+        overlapped.Offset = (DWORD)offset;
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD chunk = size > 64 * 1024 * 1024 ? 64 * 1024 * 1024 : (DWORD)size;
+        DWORD nread = 0;
+        if (!ReadFile(file, bytes, chunk, &nread, &overlapped)) {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+        if (nread == 0) {
+            return HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+        }
+        bytes += nread;
+        offset += nread;
+        size -= nread;
+    }
+    return S_OK;
+}
+
+static void ledger_close(Ledger* ledger) {
+    if (ledger->view) UnmapViewOfFile(ledger->view);
+    if (ledger->mapping) CloseHandle(ledger->mapping);
+    if (ledger->file != INVALID_HANDLE_VALUE) CloseHandle(ledger->file); // <-- releases file lock too.
+    delete[] ledger->path;
+    delete[] ledger->tail;
+    delete[] ledger->bloom;
+    *ledger = Ledger();
+}
+
+static HRESULT ledger_lock_file(HANDLE file) {
+    OVERLAPPED overlapped = { 0 };
+    overlapped.Offset = 0xFFFFFFFF;
+    overlapped.OffsetHigh = 0x7FFFFFFF; // <-- far past any real record, so locked range never holds data.
+    if (!LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped)) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    return S_OK;
+}
+
+static void ledger_unlock_file(HANDLE file) {
+    OVERLAPPED overlapped = { 0 };
+    overlapped.Offset = 0xFFFFFFFF;
+    overlapped.OffsetHigh = 0x7FFFFFFF;
+    UnlockFileEx(file, 0, 1, 0, &overlapped);
+}
+
+// Whether merge of other process has replaced file since it was opened.
+static bool ledger_file_replaced(HANDLE file) {
+    FILE_STANDARD_INFO info = { 0 };
+    if (!GetFileInformationByHandleEx(file, FileStandardInfo, &info, sizeof(info))) {
+        return false;
+    }
+    return info.DeletePending || info.NumberOfLinks == 0;
+}
+
+// Opens ledger file, creating it if it doesn't exist, and returns it locked. Record which was cut short
+// by crash is dropped, so records appended after it stay aligned.
+static HRESULT ledger_open_file(const wchar_t* path, HANDLE* out_file, LedgerHeader* out_header, ULONGLONG* out_count) {
+    LARGE_INTEGER file_size = { 0 };
+    LedgerHeader header = { 0 };
+    ULONGLONG count = 0;
+    HRESULT hr = S_OK;
+    HANDLE file = INVALID_HANDLE_VALUE;
+
+    // File may be replaced by merge between opening and locking it.
+    while (1) {
+        file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            goto quit;
+        }
+        hr = ledger_lock_file(file);
+        if (FAILED(hr)) goto quit;
+        if (!ledger_file_replaced(file)) break;
+        CloseHandle(file);
+    }
+
+    if (!GetFileSizeEx(file, &file_size)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto quit;
+    }
+
+    if (file_size.QuadPart == 0) {
+        memcpy(header.magic, LedgerMagic, sizeof(LedgerMagic));
+        header.version = LedgerVersion;
+        hr = write_all(file, &header, sizeof(header));
+        if (FAILED(hr)) goto quit;
+        file_size.QuadPart = sizeof(header);
+    } else {
+        if ((ULONGLONG)file_size.QuadPart < sizeof(header)) {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            goto quit;
+        }
+        hr = read_all_at(file, 0, &header, sizeof(header));
+        if (FAILED(hr)) goto quit;
+    }
+
+    count = ((ULONGLONG)file_size.QuadPart - sizeof(header)) / sizeof(LedgerRecord);
+    if (0 != memcmp(header.magic, LedgerMagic, sizeof(LedgerMagic)) || header.version != LedgerVersion || header.sorted_count > count) {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        goto quit;
+    }
+
+    if (sizeof(header) + count * sizeof(LedgerRecord) != (ULONGLONG)file_size.QuadPart) {
+        LARGE_INTEGER end;
+        end.QuadPart = sizeof(header) + count * sizeof(LedgerRecord);
+        if (!SetFilePointerEx(file, end, nullptr, FILE_BEGIN) || !SetEndOfFile(file)) {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            goto quit;
+        }
+    }
+
+    quit:
+    if (FAILED(hr) && file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+    }
+    *out_file = file;
+    *out_header = header;
+    *out_count = count;
+    return hr;
+}
+
+// Writes all records of ledger file sorted and without duplicates into temporary file.
+static HRESULT ledger_write_merged(HANDLE file, ULONGLONG count, const wchar_t* temp_path) {
+    HANDLE temp_file = INVALID_HANDLE_VALUE;
+    LedgerHeader header = { 0 };
+    ULONGLONG nunique = 0;
+    HRESULT hr = S_OK;
+
+    LedgerRecord* records = count <= (size_t)-1 / sizeof(LedgerRecord) ? new (std::nothrow) LedgerRecord[(size_t)count] : nullptr;
+    if (!records) {
+        hr = E_OUTOFMEMORY;
+        goto quit;
+    }
+
+    hr = read_all_at(file, sizeof(header), records, count * sizeof(LedgerRecord));
+    if (FAILED(hr)) goto quit;
+
+    qsort(records, (size_t)count, sizeof(LedgerRecord), ledger_compare_records);
+    for (ULONGLONG i = 0; i < count; ++i) {
+        if (nunique == 0 || 0 != ledger_compare_keys(records[nunique - 1].key, records[i].key)) {
+            records[nunique++] = records[i];
+        }
+    }
+
+    memcpy(header.magic, LedgerMagic, sizeof(LedgerMagic));
+    header.version = LedgerVersion;
+    header.sorted_count = nunique;
+
+    temp_file = CreateFileW(temp_path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (temp_file == INVALID_HANDLE_VALUE) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto quit;
+    }
+
+    hr = write_all(temp_file, &header, sizeof(header));
+    if (SUCCEEDED(hr)) hr = write_all(temp_file, records, nunique * sizeof(LedgerRecord));
+    if (FAILED(hr)) goto quit;
+
+    if (!FlushFileBuffers(temp_file)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto quit;
+    }
+
+    quit:
+    if (temp_file != INVALID_HANDLE_VALUE) {
+        CloseHandle(temp_file);
+    }
+    if (FAILED(hr)) {
+        DeleteFileW(temp_path);
+    }
+    delete[] records;
+    return hr;
+}
+
+static HRESULT ledger_open(const wchar_t* path, Ledger* out_ledger) {
+    Ledger& ledger = *out_ledger;
+    LedgerHeader header = { 0 };
+    ULONGLONG count = 0;
+    ULONGLONG nbits = 1 << 20;
+    HRESULT hr = ledger_open_file(path, &ledger.file, &header, &count);
+    if (FAILED(hr)) goto quit;
+
+    ledger.path = string_clone(path);
+    if (!ledger.path) {
+        hr = E_OUTOFMEMORY;
+        goto quit;
+    }
+
+    // Merging is only an optimization: if file can't be replaced, it's left for later. File stays locked
+    // until it's replaced, so other processes can't append records which merged file would miss.
+    if (count - header.sorted_count > LedgerMergeThreshold) {
+        wchar_t* temp_path = string_format(L"%s.tmp", path);
+        bool merged = temp_path && SUCCEEDED(ledger_write_merged(ledger.file, count, temp_path));
+        if (merged && !MoveFileExW(temp_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+            DeleteFileW(temp_path);
+            merged = false;
+        }
+        delete[] temp_path;
+        if (merged) {
+            CloseHandle(ledger.file);
+            ledger.file = INVALID_HANDLE_VALUE;
+            hr = ledger_open_file(path, &ledger.file, &header, &count);
+            if (FAILED(hr)) goto quit;
+        }
+    }
+
+    if (header.sorted_count > 0) {
+        ULONGLONG mapping_size = sizeof(header) + header.sorted_count * sizeof(LedgerRecord);
+        ledger.mapping = CreateFileMappingW(ledger.file, nullptr, PAGE_READONLY, (DWORD)(mapping_size >> 32), (DWORD)mapping_size, nullptr);
+        if (!ledger.mapping) {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            goto quit;
+        }
+        ledger.view = (const BYTE*)MapViewOfFile(ledger.mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!ledger.view) {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            goto quit;
+        }
+        ledger.sorted = (const LedgerRecord*)(ledger.view + sizeof(header));
+        ledger.nsorted = header.sorted_count;
+    }
+
+    ledger.ntail = (size_t)(count - header.sorted_count);
+    ledger.tail_capacity = ledger.ntail * 2 + 256;
+    ledger.tail = new (std::nothrow) LedgerRecord[ledger.tail_capacity];
+    if (!ledger.tail) {
+        hr = E_OUTOFMEMORY;
+        goto quit;
+    }
+    hr = read_all_at(ledger.file, sizeof(header) + header.sorted_count * sizeof(LedgerRecord), ledger.tail, ledger.ntail * sizeof(LedgerRecord));
+    if (FAILED(hr)) goto quit;
+    qsort(ledger.tail, ledger.ntail, sizeof(LedgerRecord), ledger_compare_records);
+
+    while (nbits < (count + LedgerBloomSpareKeys) * LedgerBloomBitsPerKey) nbits *= 2;
+    ledger.bloom = new (std::nothrow) ULONGLONG[(size_t)(nbits / 64)]();
+    if (!ledger.bloom) {
+        hr = E_OUTOFMEMORY;
+        goto quit;
+    }
+    ledger.bloom_mask = nbits - 1;
+    for (ULONGLONG i = 0; i < ledger.nsorted; ++i) ledger_bloom_add(&ledger, ledger.sorted[i].key);
+    for (size_t i = 0; i < ledger.ntail; ++i) ledger_bloom_add(&ledger, ledger.tail[i].key);
+    ledger_unlock_file(ledger.file);
+
+    quit:
+    if (FAILED(hr)) {
+        ledger_close(&ledger);
+    }
+    return hr;
+}
+
+static bool ledger_contains_key(const Ledger* ledger, const ULONGLONG* key) {
+    return ledger_bloom_test(ledger, key) &&
+        (ledger_records_contain(ledger->sorted, ledger->nsorted, key) || ledger_records_contain(ledger->tail, ledger->ntail, key));
+}
+
+static bool ledger_contains(Ledger* ledger, const wchar_t* device_id, const DeviceObjectInformation& object) {
+    if (!object.persistent_id) return false;
+    ULONGLONG key[2];
+    ledger_key(device_id, object, key);
+
+    AcquireSRWLockShared(&ledger->lock);
+    bool found = ledger_contains_key(ledger, key);
+    ReleaseSRWLockShared(&ledger->lock);
+    return found;
+}
+
+// Appends record of transferred object. Returns S_FALSE if object is not recorded because it has no
+// persistent ID or it's already in ledger.
+static HRESULT ledger_add(Ledger* ledger, const wchar_t* device_id, const DeviceObjectInformation& object) {
+    if (!object.persistent_id) return S_FALSE;
+
+    LedgerRecord record = { 0 };
+    ledger_key(device_id, object, record.key);
+    record.size = object.size;
+    record.date_modified = object.date_modified;
+    GetSystemTimeAsFileTime(&record.ingested);
+
+    HRESULT hr = S_OK;
+    AcquireSRWLockExclusive(&ledger->lock);
+    if (ledger_contains_key(ledger, record.key)) {
+        hr = S_FALSE;
+        goto quit;
+    }
+
+    if (ledger->ntail == ledger->tail_capacity) {
+        size_t capacity = ledger->tail_capacity * 2;
+        LedgerRecord* tail = new (std::nothrow) LedgerRecord[capacity];
+        if (!tail) {
+            hr = E_OUTOFMEMORY;
+            goto quit;
+        }
+        memcpy(tail, ledger->tail, ledger->ntail * sizeof(LedgerRecord));
+        delete[] ledger->tail;
+        ledger->tail = tail;
+        ledger->tail_capacity = capacity;
+    }
+
+    // Records of other processes appended since open are not looked up until next open, but they stay in file.
+    hr = ledger_lock_file(ledger->file);
+    if (SUCCEEDED(hr) && ledger_file_replaced(ledger->file)) {
+        HANDLE file = INVALID_HANDLE_VALUE;
+        LedgerHeader header = { 0 };
+        ULONGLONG count = 0;
+        ledger_unlock_file(ledger->file);
+        hr = ledger_open_file(ledger->path, &file, &header, &count);
+        if (SUCCEEDED(hr)) {
+            CloseHandle(ledger->file);
+            ledger->file = file;
+        }
+    }
+    if (FAILED(hr)) goto quit;
+
+    {
+        // Offset of all ones writes at the end of file, even if other process has appended since.
+        OVERLAPPED overlapped = { 0 };
+        overlapped.Offset = 0xFFFFFFFF;
+        overlapped.OffsetHigh = 0xFFFFFFFF;
+        DWORD nwritten = 0;
+        BOOL written = WriteFile(ledger->file, &record, sizeof(record), &nwritten, &overlapped);
+        if (!written) hr = HRESULT_FROM_WIN32(GetLastError());
+        ledger_unlock_file(ledger->file);
+        if (FAILED(hr)) goto quit;
+        if (nwritten != sizeof(record)) {
+            hr = E_FAIL;
+            goto quit;
+        }
+    }
+
+    {
+        size_t index = (size_t)ledger_lower_bound(ledger->tail, ledger->ntail, record.key);
+        memmove(&ledger->tail[index + 1], &ledger->tail[index], (ledger->ntail - index) * sizeof(LedgerRecord));
+        ledger->tail[index] = record;
+        ++ledger->ntail;
+    }
+    ledger_bloom_add(ledger, record.key);
+    ledger->unflushed = true;
+
+    quit:
+    ReleaseSRWLockExclusive(&ledger->lock);
+    return hr;
+}
+
+static HRESULT ledger_flush(Ledger* ledger) {
+    HRESULT hr = S_OK;
+    AcquireSRWLockExclusive(&ledger->lock);
+    if (ledger->unflushed) {
+        if (FlushFileBuffers(ledger->file)) {
+            ledger->unflushed = false;
+        } else {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+    ReleaseSRWLockExclusive(&ledger->lock);
+    return hr;
+}
+
+// --- Disk scheduler ---
+// Limits number of concurrent writes to destination disk when several devices are copied at once.
+// When writers have to wait, free slots are handed to devices which have written the fewest bytes so far,
+// so every device gets a fair share of disk bandwidth regardless of how fast it reads.
+
+const int DiskSchedulerMaxClients = 64;
+
+struct DiskScheduler {
+    SRWLOCK lock = SRWLOCK_INIT;
+    CONDITION_VARIABLE slot_released = CONDITION_VARIABLE_INIT;
+    int max_writers = 1;
+    int active_writers = 0;
+    int nclients = 0;
+    LONG64 client_bytes[DiskSchedulerMaxClients] = { 0 };
+    bool client_waiting[DiskSchedulerMaxClients] = { 0 };
+};
+
+static int disk_scheduler_register(DiskScheduler* scheduler) {
+    AcquireSRWLockExclusive(&scheduler->lock);
+    int client = scheduler->nclients < DiskSchedulerMaxClients ? scheduler->nclients++ : -1;
+    ReleaseSRWLockExclusive(&scheduler->lock);
+    return client;
+}
+
+static void disk_scheduler_acquire(DiskScheduler* scheduler, int client) {
+    AcquireSRWLockExclusive(&scheduler->lock);
+    scheduler->client_waiting[client] = true;
+    while (1) {
+        int free_slots = scheduler->max_writers - scheduler->active_writers;
+        int nbefore = 0;
+        for (int i = 0; i < scheduler->nclients; ++i) {
+            if (i != client && scheduler->client_waiting[i] && scheduler->client_bytes[i] < scheduler->client_bytes[client]) {
+                ++nbefore;
+            }
+        }
+        if (nbefore < free_slots) {
+            break;
+        }
+        SleepConditionVariableSRW(&scheduler->slot_released, &scheduler->lock, INFINITE, 0);
+    }
+    scheduler->client_waiting[client] = false;
+    ++scheduler->active_writers;
+    ReleaseSRWLockExclusive(&scheduler->lock);
+}
+
+static void disk_scheduler_release(DiskScheduler* scheduler, int client, DWORD nwritten) {
+    AcquireSRWLockExclusive(&scheduler->lock);
+    --scheduler->active_writers;
+    scheduler->client_bytes[client] += nwritten;
+    ReleaseSRWLockExclusive(&scheduler->lock);
+    WakeAllConditionVariable(&scheduler->slot_released);
+}
+
+// --- Device session ---
+
+// Blocking device call of one thread, checked by watchdog.
+struct DeviceCallWatch {
+    SRWLOCK lock = SRWLOCK_INIT;      // <-- protects fields below, watchdog cancels call only while holding it.
+    int call = -1;                    // <-- DeviceCall in progress, -1 if none.
+    ULONGLONG deadline = 0;           // <-- 0 if call has no deadline.
+    DWORD thread_id = 0;
+    bool timed_out = false;
+    LONGLONG start = 0;
+    DeviceCallStats* stats = nullptr; // <-- of thread, indexed by DeviceCall.
+    HANDLE event = nullptr;           // <-- set by watchdog when call misses deadline.
+};
+
+// Threads of one device which may make calls at once: operation thread and its workers.
+const int DeviceCallWatchCount = 9;
+
+struct DeviceSession {
+    wchar_t* device_id = nullptr;
+    IPortableDevice* device = nullptr;
+    IPortableDeviceContent* content = nullptr;
+    IPortableDeviceProperties* properties = nullptr;
+    IPortableDeviceResources* resources = nullptr;
+    const wchar_t* error_context = nullptr; // <-- set when open_device_session fails.
+    int generation = 0; // <-- incremented every time session is opened, object ids may change between sessions.
+
+    LONG64 bytes_reused = 0; // <-- with append: bytes which were already in destination files.
+    int files_appended = 0;  //
+    const EngineCallbacks* callbacks = nullptr; // <-- of running operation.
+    const volatile LONG* cancelled = nullptr;   //
+    DiskScheduler* disk_scheduler = nullptr; // <-- writes are not throttled if not set.
+    int disk_client = -1;
+    LONG64 bytes_copied = 0;
+
+    // Watchdog of blocking calls, see device_call_begin.
+    const DWORD* call_timeouts_ms = nullptr; // <-- of engine.
+    LONG volatile* simulate_hang = nullptr;  //
+    LONG volatile hung = 0; // <-- set by watchdog, no more calls are made until session is reopened.
+    DeviceCallWatch call_watches[DeviceCallWatchCount]; // <-- [0] is operation thread, others are its workers.
+};
+
+static void session_vlog(DeviceSession* session, const wchar_t* format, va_list args) {
+    if (!session->callbacks || !session->callbacks->message) return;
+    wchar_t text[1024];
+    if (_vsnwprintf_s(text, _countof(text), _TRUNCATE, format, args) < 0) {
+        text[_countof(text) - 2] = L'\n';
+    }
+    session->callbacks->message(session->callbacks->userdata, text);
+}
+
+static void session_log(DeviceSession* session, const wchar_t* format, ...) {
+    va_list args;
+    va_start(args, format);
+    session_vlog(session, format, args);
+    va_end(args);
+}
+
+// Same as session_log, but message is reported only in verbose mode.
+static void session_log_verbose(DeviceSession* session, const wchar_t* format, ...) {
+    if (!session->callbacks || !session->callbacks->verbose) return;
+    va_list args;
+    va_start(args, format);
+    session_vlog(session, format, args);
+    va_end(args);
+}
+
+static void session_object_done(DeviceSession* session, bool ok) {
+    if (session->callbacks && session->callbacks->object_done) {
+        session->callbacks->object_done(session->callbacks->userdata, ok);
+    }
+}
+
+// Called from range threads of ranged copy too.
+static void session_bytes_copied(DeviceSession* session, DWORD nbytes) {
+    InterlockedAdd64(&session->bytes_copied, nbytes);
+    if (session->callbacks && session->callbacks->bytes_copied) {
+        session->callbacks->bytes_copied(session->callbacks->userdata, nbytes);
+    }
+}
+
+static HRESULT create_client_information(IPortableDeviceValues** out_client_information) {
+    IPortableDeviceValues* client_information = nullptr;
+    HRESULT hr = CoCreateInstance(CLSID_PortableDeviceValues, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&client_information));
+    if (FAILED(hr)) goto quit;
+
+    // Attempt to set all bits of client information.
+    hr = client_information->SetStringValue(WPD_CLIENT_NAME, L"ru.miere.device_data_tool");
+    if (SUCCEEDED(hr)) {
+        hr = client_information->SetUnsignedIntegerValue(WPD_CLIENT_MAJOR_VERSION, 1);
+        if (SUCCEEDED(hr)) {
+            hr = client_information->SetUnsignedIntegerValue(WPD_CLIENT_MINOR_VERSION, 0);
+            if (SUCCEEDED(hr)) {
+                hr = client_information->SetUnsignedIntegerValue(WPD_CLIENT_REVISION, 0);
+                if (SUCCEEDED(hr)) {
+                    // Some device drivers need to impersonate the caller in order to function correctly.  Since our application does not
+                    // need to restrict its identity, specify SECURITY_IMPERSONATION so that we work with all devices.
+                    hr = client_information->SetUnsignedIntegerValue(WPD_CLIENT_SECURITY_QUALITY_OF_SERVICE, SECURITY_IMPERSONATION);
+                }
+            }
+        }
+    }
+
+    quit:
+    if (FAILED(hr)) {
+        safe_release(&client_information);
+    }
+    *out_client_information = client_information;
+    return hr;
+}
+
+// Closing runs on helper thread too: driver which hung on a call often hangs on Close as well.
+// Helper owns the interfaces, whichever of the two threads finishes last frees the call.
+struct DeviceCloseCall {
+    LONG volatile references = 2;
+    IPortableDevice* device = nullptr;
+    IPortableDeviceContent* content = nullptr;
+    IPortableDeviceProperties* properties = nullptr;
+    IPortableDeviceResources* resources = nullptr;
+    HRESULT hr = S_OK;
+};
+
+static void release_device_close_call(DeviceCloseCall* call) {
+    if (InterlockedDecrement(&call->references) != 0) return;
+    delete call;
+}
+
+static void close_device_interfaces(DeviceCloseCall* call) {
+    safe_release(&call->content);
+    safe_release(&call->resources);
+    safe_release(&call->properties);
+
+    if (call->device) {
+        // Close explicitly to avoid Windows Explorer hanging after deleting files via this program.
+        call->hr = call->device->Close();
+
+        ULONG last_reference = call->device->Release();
+        assert(last_reference == 0);
+        call->device = nullptr;
+    }
+}
+
+static DWORD WINAPI device_close_thread_proc(void* userdata) {
+    auto call = (DeviceCloseCall*)userdata;
+    HRESULT hr = CoInitializeEx(0, COINIT_MULTITHREADED | COINIT_DISABLE_OLE1DDE);
+    close_device_interfaces(call);
+    release_device_close_call(call);
+    if (SUCCEEDED(hr)) {
+        CoUninitialize();
+    }
+    return 0;
+}
+
+// Releases all device interfaces. Session can be opened again with open_device_session.
+// Waits for Close at most as long as for connecting, then abandons the interfaces to helper thread.
+static void close_device_session(DeviceSession* session, bool report_errors) {
+    if (!session->device && !session->content && !session->resources && !session->properties) return;
+
+    DeviceCloseCall local_call;
+    DeviceCloseCall* call = new (std::nothrow) DeviceCloseCall();
+    HANDLE thread = nullptr;
+    if (!call) {
+        call = &local_call;
+    }
+    call->device = session->device;
+    call->content = session->content;
+    call->properties = session->properties;
+    call->resources = session->resources;
+    session->device = nullptr;
+    session->content = nullptr;
+    session->properties = nullptr;
+    session->resources = nullptr;
+
+    if (call != &local_call) {
+        thread = CreateThread(nullptr, 0, device_close_thread_proc, call, 0, nullptr);
+        if (!thread) call->references = 1;
+    }
+
+    HRESULT close_hr = S_OK;
+    if (!thread) {
+        close_device_interfaces(call);
+        close_hr = call->hr;
+    } else {
+        DWORD timeout_ms = session->call_timeouts_ms ? session->call_timeouts_ms[DeviceCall_Open] : 0;
+        if (WaitForSingleObject(thread, timeout_ms ? timeout_ms : INFINITE) == WAIT_OBJECT_0) {
+            close_hr = call->hr;
+        } else {
+            // Abandoned: helper thread releases the interfaces when driver returns.
+            session_log_verbose(session, L"Device didn't close in time, connection is abandoned.\n");
+        }
+        CloseHandle(thread);
+    }
+
+    if (FAILED(close_hr) && report_errors) {
+        session_log(session, L"Unable to close device: %s\n", error_string(close_hr));
+    }
+    if (call != &local_call) {
+        release_device_close_call(call);
+    }
+}
+
+// Connecting runs on helper thread, so it can be abandoned when driver hangs.
+// Whichever of the two threads finishes last frees the call.
+struct DeviceOpenCall {
+    LONG volatile references = 2;
+    wchar_t* device_id = nullptr;
+    IPortableDeviceValues* client_information = nullptr;
+    IPortableDevice* device = nullptr;
+    HRESULT hr = E_FAIL;
+    const wchar_t* error_context = nullptr;
+};
+
+static void release_device_open_call(DeviceOpenCall* call) {
+    if (InterlockedDecrement(&call->references) != 0) return;
+    safe_release(&call->device);
+    safe_release(&call->client_information);
+    delete[] call->device_id;
+    delete call;
+}
+
+static DWORD WINAPI device_open_thread_proc(void* userdata) {
+    auto call = (DeviceOpenCall*)userdata;
+    HRESULT hr = CoInitializeEx(0, COINIT_MULTITHREADED | COINIT_DISABLE_OLE1DDE);
+
+    call->hr = CoCreateInstance(CLSID_PortableDeviceFTM, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&call->device));
+    if (FAILED(call->hr)) {
+        call->error_context = L"Unable to create device structure";
+    } else {
+        call->hr = call->device->Open(call->device_id, call->client_information);
+        if (FAILED(call->hr)) {
+            call->error_context = L"Unable to connect to device";
+        }
+    }
+
+    release_device_open_call(call);
+    if (SUCCEEDED(hr)) {
+        CoUninitialize();
+    }
+    return 0;
+}
+
+// Opens device on helper thread and waits until it's opened or watchdog gives up on it.
+static HRESULT open_device(DeviceSession* session, IPortableDeviceValues* client_information, IPortableDevice** out_device) {
+    DeviceOpenCall* call = new (std::nothrow) DeviceOpenCall();
+    if (!call) return E_OUTOFMEMORY;
+    call->client_information = client_information;
+    call->client_information->AddRef();
+    call->device_id = string_clone(session->device_id);
+    if (!call->device_id) {
+        call->references = 1;
+        release_device_open_call(call);
+        return E_OUTOFMEMORY;
+    }
+
+    HANDLE thread = CreateThread(nullptr, 0, device_open_thread_proc, call, 0, nullptr);
+    if (!thread) {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+        call->references = 1;
+        release_device_open_call(call);
+        return hr;
+    }
+
+    HRESULT hr = E_FAIL;
+    HANDLE handles[] = { thread, session->call_watches[0].event }; // <-- sessions are opened only by operation thread.
+    DWORD wait = WaitForMultipleObjects(handles[1] ? 2 : 1, handles, FALSE, INFINITE);
+    if (wait == WAIT_OBJECT_0) {
+        hr = call->hr;
+        session->error_context = call->error_context;
+        if (SUCCEEDED(hr)) {
+            *out_device = call->device;
+            call->device = nullptr;
+        }
+    } else {
+        // Abandoned: helper thread frees the call when driver returns.
+        hr = E_WPD_DEVICE_IS_HUNG;
+        session->error_context = L"Device didn't respond to connection request in time";
+    }
+
+    CloseHandle(thread);
+    release_device_open_call(call);
+    return hr;
+}
+
+static HRESULT open_device_session(DeviceSession* session) {
+    assert(session->device_id);
+    assert(!session->device);
+    session->error_context = nullptr;
+    InterlockedExchange(&session->hung, 0);
+
+    IPortableDeviceValues* client_information = nullptr;
+    HRESULT hr = create_client_information(&client_information);
+    if (FAILED(hr)) {
+        session->error_context = L"Unable to set client information";
+        goto quit;
+    }
+
+    hr = device_call(DeviceCall_Open, [&]() { return open_device(session, client_information, &session->device); });
+    if (FAILED(hr)) {
+        if (!session->error_context) session->error_context = L"Unable to connect to device";
+        goto quit;
+    }
+
+    hr = session->device->Content(&session->content);
+    if (SUCCEEDED(hr)) {
+        hr = session->content->Transfer(&session->resources);
+        if (SUCCEEDED(hr)) {
+            hr = session->content->Properties(&session->properties);
+        }
+    }
+
+    if (FAILED(hr)) {
+        session->error_context = L"Unable to get device structures";
+        goto quit;
+    }
+
+    ++session->generation;
+
+    quit:
+    safe_release(&client_information);
+    if (FAILED(hr)) {
+        close_device_session(session, false);
+    }
+    return hr;
+}
+
+// --- Watchdog ---
+// Blocking device calls are made between device_call_begin and device_call_end, see device_call.
+// Watchdog thread of engine checks calls of all devices. When call misses deadline of its class,
+// watchdog cancels pending I/O of device, and call fails with E_WPD_DEVICE_IS_HUNG even if driver
+// returns success later; retry logic then reopens session. Other calls of hung session fail at once
+// instead of reaching the driver. Connecting and closing are abandoned instead.
+
+const DWORD WatchdogIntervalMs = 100;
+
+static thread_local DeviceSession* watched_session = nullptr; // <-- of operation running on this thread.
+static thread_local DeviceCallWatch* watched_call = nullptr;  // <-- slot of this thread in watched session.
+
+// Calls of this thread are watched until unwatch_device_calls. Slot is index in DeviceSession::call_watches,
+// every thread which makes calls at the same time must use its own slot.
+static void watch_device_calls(DeviceSession* session, int slot, DeviceCallStats* stats) {
+    assert(slot >= 0 && slot < DeviceCallWatchCount);
+    watched_session = session;
+    watched_call = &session->call_watches[slot];
+    watched_call->stats = stats;
+}
+
+static void unwatch_device_calls() {
+    if (watched_call) {
+        watched_call->stats = nullptr;
+    }
+    watched_session = nullptr;
+    watched_call = nullptr;
+}
+
+static void record_device_call(DeviceCallStats* stats, ULONGLONG elapsed_us, bool timed_out) {
+    int bucket = 0;
+    while (bucket + 1 < _countof(stats->buckets) && (elapsed_us >> (bucket + 1)) != 0) {
+        ++bucket;
+    }
+    ++stats->buckets[bucket];
+    ++stats->count;
+    if (timed_out) ++stats->timeouts;
+    if (elapsed_us > stats->max_us) stats->max_us = elapsed_us;
+}
+
+// Device which hangs on demand: blocks in synchronous read of pipe nobody writes to, which only
+// CancelSynchronousIo of watchdog can interrupt.
+static void simulate_device_hang() {
+    HANDLE read_pipe = nullptr;
+    HANDLE write_pipe = nullptr;
+    if (!CreatePipe(&read_pipe, &write_pipe, nullptr, 0)) return;
+    BYTE byte = 0;
+    DWORD nread = 0;
+    ReadFile(read_pipe, &byte, 1, &nread, nullptr);
+    CloseHandle(read_pipe);
+    CloseHandle(write_pipe);
+}
+
+// Returns false if call must not be made (hung session or simulated hang).
+static bool device_call_begin(DeviceCall call) {
+    DeviceSession* session = watched_session;
+    DeviceCallWatch* watch = watched_call;
+    if (!session) return true;
+    assert(watch->call < 0);
+    if (session->hung && call != DeviceCall_Open) {
+        return false;
+    }
+
+    DWORD timeout_ms = session->call_timeouts_ms ? session->call_timeouts_ms[call] : 0;
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    watch->start = now.QuadPart;
+    if (watch->event) {
+        ResetEvent(watch->event);
+    }
+
+    AcquireSRWLockExclusive(&watch->lock);
+    watch->call = call;
+    watch->deadline = timeout_ms ? GetTickCount64() + timeout_ms : 0;
+    watch->thread_id = GetCurrentThreadId();
+    watch->timed_out = false;
+    ReleaseSRWLockExclusive(&watch->lock);
+
+    if (session->simulate_hang && InterlockedCompareExchange(session->simulate_hang, -1, (LONG)call) == (LONG)call) {
+        if (timeout_ms) {
+            simulate_device_hang();
+        }
+        return false;
+    }
+    return true;
+}
+
+static HRESULT device_call_end(HRESULT hr) {
+    DeviceCallWatch* watch = watched_call;
+    if (!watch) return hr;
+
+    AcquireSRWLockExclusive(&watch->lock);
+    int call = watch->call;
+    bool timed_out = watch->timed_out;
+    watch->call = -1;
+    ReleaseSRWLockExclusive(&watch->lock);
+
+    LARGE_INTEGER now;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    if (watch->stats && call >= 0) {
+        ULONGLONG elapsed_us = (ULONGLONG)((now.QuadPart - watch->start) * 1000000 / frequency.QuadPart);
+        record_device_call(&watch->stats[call], elapsed_us, timed_out);
+    }
+    return timed_out ? E_WPD_DEVICE_IS_HUNG : hr;
+}
+
+// Called by watchdog thread. Cancelling device I/O also fails calls of other threads of the session,
+// they are retried like after connection loss.
+static void watchdog_check_session(DeviceSession* session, ULONGLONG now) {
+    for (int i = 0; i < DeviceCallWatchCount; ++i) {
+        DeviceCallWatch* watch = &session->call_watches[i];
+        AcquireSRWLockExclusive(&watch->lock);
+        if (watch->call >= 0 && watch->deadline && now >= watch->deadline && !watch->timed_out) {
+            watch->timed_out = true;
+            InterlockedExchange(&session->hung, 1);
+            SetEvent(watch->event);
+
+            // Device interfaces are not released while call is in progress.
+            if (session->device) {
+                session->device->Cancel();
+            }
+            HANDLE thread = OpenThread(THREAD_TERMINATE, FALSE, watch->thread_id);
+            if (thread) {
+                CancelSynchronousIo(thread);
+                CloseHandle(thread);
+            }
+        }
+        ReleaseSRWLockExclusive(&watch->lock);
+    }
+}
+
+void device_call_stats_add(DeviceCallStats* dest, const DeviceCallStats& source) {
+    dest->count += source.count;
+    dest->timeouts += source.timeouts;
+    if (source.max_us > dest->max_us) dest->max_us = source.max_us;
+    for (int i = 0; i < _countof(dest->buckets); ++i) {
+        dest->buckets[i] += source.buckets[i];
+    }
+}
+
+ULONGLONG device_call_percentile_us(const DeviceCallStats& stats, double fraction) {
+    if (stats.count == 0) return 0;
+    ULONGLONG target = (ULONGLONG)(fraction * stats.count + 0.999999);
+    if (target < 1) target = 1;
+    ULONGLONG seen = 0;
+    for (int i = 0; i < _countof(stats.buckets); ++i) {
+        seen += stats.buckets[i];
+        if (seen >= target) {
+            ULONGLONG upper = (2ull << i) - 1;
+            return upper < stats.max_us ? upper : stats.max_us;
+        }
+    }
+    return stats.max_us;
+}
+
+// --- Retries ---
+
+enum ErrorClass {
+    ErrorClass_Permanent,    // Retrying won't help.
+    ErrorClass_Transient,    // Device busy, timeouts, I/O errors.
+    ErrorClass_Disconnected, // Session is unusable and must be reopened.
+};
+
+static ErrorClass classify_error(HRESULT hr) {
+    switch (hr) {
+        case E_WPD_DEVICE_NOT_OPEN:
+        case RPC_E_DISCONNECTED:
+        case HRESULT_FROM_WIN32(ERROR_DEVICE_NOT_CONNECTED):
+        case HRESULT_FROM_WIN32(ERROR_DEV_NOT_EXIST):
+        case HRESULT_FROM_WIN32(ERROR_DEVICE_REMOVED):
+        case HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE):
+        case HRESULT_FROM_WIN32(ERROR_BROKEN_PIPE):
+        case E_WPD_DEVICE_IS_HUNG: // <-- also returned by calls cancelled by watchdog.
+            return ErrorClass_Disconnected;
+
+        case E_PENDING:
+        case RPC_E_CALL_REJECTED:
+        case RPC_E_SERVERCALL_RETRYLATER:
+        case HRESULT_FROM_WIN32(ERROR_BUSY):
+        case HRESULT_FROM_WIN32(ERROR_DEVICE_IN_USE):
+        case HRESULT_FROM_WIN32(ERROR_NOT_READY):
+        case HRESULT_FROM_WIN32(ERROR_RETRY):
+        case HRESULT_FROM_WIN32(ERROR_SEM_TIMEOUT):
+        case HRESULT_FROM_WIN32(ERROR_TIMEOUT):
+        case HRESULT_FROM_WIN32(ERROR_GEN_FAILURE):
+        case HRESULT_FROM_WIN32(ERROR_IO_DEVICE):
+        case HRESULT_FROM_WIN32(ERROR_CRC):
+        case HRESULT_FROM_WIN32(ERROR_SHARING_VIOLATION):
+        case HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED):
+            return ErrorClass_Transient;
+    }
+    return ErrorClass_Permanent;
+}
+
+// Errors of destination files say nothing about device, its session is never reopened because of them.
+// Only files held by other processes (antivirus, indexer) are worth waiting for, failing disk is not.
+static ErrorClass classify_destination_error(HRESULT hr) {
+    switch (hr) {
+        case HRESULT_FROM_WIN32(ERROR_SHARING_VIOLATION):
+        case HRESULT_FROM_WIN32(ERROR_LOCK_VIOLATION):
+            return ErrorClass_Transient;
+    }
+    return ErrorClass_Permanent;
+}
+
+struct RetryPolicy {
+    int max_attempts = 4;
+    DWORD base_delay_ms = 250;
+    DWORD max_delay_ms = 8000;
+};
+
+static ULONG random_next() {
+    static thread_local ULONG state = 0;
+    if (state == 0) {
+        state = (ULONG)GetTickCount64() ^ (GetCurrentThreadId() * 2654435761u);
+        if (state == 0) state = 1;
+    }
+    // xorshift32
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// Delay before attempt number "attempt + 1": exponential backoff with full jitter, uniform in [0, ceiling],
+// so many items failing at once don't hammer the device in lockstep.
+static DWORD retry_delay_ms(const RetryPolicy& policy, int attempt) {
+    DWORD ceiling = policy.base_delay_ms;
+    for (int i = 1; i < attempt && ceiling < policy.max_delay_ms; ++i) {
+        ceiling *= 2;
+    }
+    if (ceiling > policy.max_delay_ms) {
+        ceiling = policy.max_delay_ms;
+    }
+    return random_next() % (ceiling + 1);
+}
+
+// Makes sure session is open, reopening it if it was closed after disconnect.
+static HRESULT ensure_device_session(DeviceSession* session, RetryStats* stats) {
+    if (session->device) {
+        return S_OK;
+    }
+    ++stats->reopens;
+    HRESULT hr = open_device_session(session);
+    if (SUCCEEDED(hr)) {
+        session_log_verbose(session, L"Reconnected to device.\n");
+    }
+    return hr;
+}
+
+// Calls operation until it succeeds, fails with permanent error or runs out of attempts.
+// Session is reopened when operation fails because device was disconnected.
+template<typename Operation>
+static HRESULT retry_device_operation(DeviceSession* session, const RetryPolicy& policy, RetryStats* stats, Operation operation) {
+    HRESULT hr = E_FAIL;
+
+    for (int attempt = 1; ; ++attempt) {
+        if (is_cancelled(session->cancelled)) {
+            hr = HRESULT_FROM_WIN32(ERROR_CANCELLED);
+            break;
+        }
+
+        hr = ensure_device_session(session, stats);
+        if (SUCCEEDED(hr)) {
+            hr = operation();
+            if (SUCCEEDED(hr)) {
+                if (attempt > 1) ++stats->recovered;
+                break;
+            }
+        }
+
+        ErrorClass error_class = classify_error(hr);
+        if (error_class == ErrorClass_Permanent || attempt >= policy.max_attempts) {
+            break;
+        }
+        if (error_class == ErrorClass_Disconnected) {
+            close_device_session(session, false);
+        }
+
+        ++stats->retries;
+        Sleep(retry_delay_ms(policy, attempt));
+    }
+
+    return hr;
+}
+
+// --- Usage ---
+// Walks device tree with several threads listing folders at once and sums sizes of files per folder
+// and content type. Folders wait for listing on shared stack, so walk goes depth-first, and only folders
+// which are not finished are kept in memory: folder is freed as soon as it and all of its subfolders are
+// listed, after its totals are added to parent. Memory doesn't grow with number of objects on device.
+
+const int UsageMaxWalkers = 8;
+
+static_assert(UsageMaxWalkers <= DeviceCallWatchCount, "every walker needs its own watch slot");
+
+struct UsageFolder {
+    UsageFolder* parent = nullptr;
+    wchar_t* id = nullptr;
+    wchar_t* path = nullptr; // <-- relative to walked directory, empty for walked directory.
+    ULONGLONG size = 0;      // <-- of files in subtree which were listed so far.
+    DWORD files = 0;         //
+    int pending = 1;         // <-- own listing and subfolders which are not finished.
+};
+
+// Result of listing one folder, added to walk totals only if whole folder was listed,
+// so folder which is listed again after transient error isn't counted twice.
+struct UsageListing {
+    ULONGLONG size = 0;
+    DWORD files = 0;
+    DWORD errors = 0;
+    ULONGLONG type_sizes[UsageContentTypes] = {};
+    DWORD type_files[UsageContentTypes] = {};
+    UsageFolder** folders = nullptr;
+    int nfolders = 0;
+    int folders_capacity = 0;
+    UsageEntry* top_files = nullptr; // <-- min-heap of walk's top_count largest files.
+    int ntop_files = 0;
+};
+
+struct UsageWalk {
+    DeviceSession* session = nullptr;
+    const RetryPolicy* policy = nullptr;
+    int top_count = 0;
+
+    SRWLOCK lock = SRWLOCK_INIT; // <-- protects fields below.
+    CONDITION_VARIABLE wake = CONDITION_VARIABLE_INIT;
+    UsageFolder** stack = nullptr; // <-- folders waiting for listing.
+    int nstack = 0;
+    int stack_capacity = 0;
+    int active = 0;     // <-- walkers listing folder.
+    HRESULT hr = S_OK;  // <-- error which stopped walk.
+    RetryStats* stats = nullptr;
+    UsageReport report; // <-- top arrays are min-heaps until walk is finished.
+};
+
+struct UsageWalker {
+    UsageWalk* walk = nullptr;
+    int slot = 0;
+    HANDLE thread = nullptr;
+    DeviceCallStats call_stats[DeviceCall_Count];
+};
+
+static int usage_type_index(DWORD content_type) {
+    for (int i = 0; i < UsageContentTypes; ++i) {
+        if (content_type & (1u << i)) return i;
+    }
+    return UsageContentTypes - 1;
+}
+
+static wchar_t* join_usage_path(const wchar_t* directory, const wchar_t* name) {
+    return directory[0] ? string_format(L"%s\\%s", directory, name) : string_clone(name);
+}
+
+static void free_usage_folder(UsageFolder* folder) {
+    delete[] folder->id;
+    delete[] folder->path;
+    delete folder;
+}
+
+static void free_usage_entries(UsageEntry* entries, int count) {
+    for (int i = 0; i < count; ++i) {
+        delete[] entries[i].path;
+    }
+    delete[] entries;
+}
+
+static void free_usage_report(UsageReport* report) {
+    free_usage_entries(report->top_folders, report->ntop_folders);
+    free_usage_entries(report->top_files, report->ntop_files);
+    *report = UsageReport();
+}
+
+static void free_usage_listing(UsageListing* listing) {
+    for (int i = 0; i < listing->nfolders; ++i) {
+        free_usage_folder(listing->folders[i]);
+    }
+    delete[] listing->folders;
+    free_usage_entries(listing->top_files, listing->ntop_files);
+    *listing = UsageListing();
+}
+
+static void usage_heap_sift_down(UsageEntry* heap, int count, int index) {
+    while (1) {
+        int smallest = index;
+        int left = index * 2 + 1;
+        int right = left + 1;
+        if (left < count && heap[left].size < heap[smallest].size) smallest = left;
+        if (right < count && heap[right].size < heap[smallest].size) smallest = right;
+        if (smallest == index) break;
+        UsageEntry swap = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = swap;
+        index = smallest;
+    }
+}
+
+static bool usage_heap_accepts(const UsageEntry* heap, int count, int capacity, ULONGLONG size) {
+    return capacity > 0 && (count < capacity || size > heap[0].size);
+}
+
+// Heap keeps capacity largest entries, it takes ownership of entry path.
+static void usage_heap_insert(UsageEntry* heap, int* count, int capacity, UsageEntry entry) {
+    if (!usage_heap_accepts(heap, *count, capacity, entry.size)) {
+        delete[] entry.path;
+        return;
+    }
+    if (*count == capacity) {
+        delete[] heap[0].path;
+        heap[0] = entry;
+        usage_heap_sift_down(heap, *count, 0);
+        return;
+    }
+    int index = (*count)++;
+    heap[index] = entry;
+    while (index > 0 && heap[(index - 1) / 2].size > heap[index].size) {
+        UsageEntry swap = heap[index];
+        heap[index] = heap[(index - 1) / 2];
+        heap[(index - 1) / 2] = swap;
+        index = (index - 1) / 2;
+    }
+}
+
+static int usage_compare_entries(const void* a, const void* b) {
+    ULONGLONG size_a = ((const UsageEntry*)a)->size;
+    ULONGLONG size_b = ((const UsageEntry*)b)->size;
+    return size_a < size_b ? 1 : size_a > size_b ? -1 : 0;
+}
+
+static HRESULT usage_listing_add_file(UsageListing* listing, int top_count, const wchar_t* directory, const DeviceObjectMetadata& metadata) {
+    int type = usage_type_index(metadata.content_type);
+    listing->size += metadata.size;
+    listing->files += 1;
+    listing->type_sizes[type] += metadata.size;
+    listing->type_files[type] += 1;
+
+    if (!usage_heap_accepts(listing->top_files, listing->ntop_files, top_count, metadata.size)) {
+        return S_OK;
+    }
+    if (!listing->top_files) {
+        listing->top_files = new (std::nothrow) UsageEntry[top_count];
+        if (!listing->top_files) return E_OUTOFMEMORY;
+    }
+    UsageEntry entry;
+    entry.path = join_usage_path(directory, metadata.name);
+    entry.size = metadata.size;
+    entry.files = 1;
+    if (!entry.path) return E_OUTOFMEMORY;
+    usage_heap_insert(listing->top_files, &listing->ntop_files, top_count, entry);
+    return S_OK;
+}
+
+static HRESULT usage_listing_add_folder(UsageListing* listing, UsageFolder* parent, const wchar_t* id, const wchar_t* name) {
+    if (listing->nfolders == listing->folders_capacity) {
+        int capacity = listing->folders_capacity ? listing->folders_capacity * 2 : 16;
+        UsageFolder** folders = new (std::nothrow) UsageFolder*[capacity];
+        if (!folders) return E_OUTOFMEMORY;
+        if (listing->folders) memcpy(folders, listing->folders, sizeof(UsageFolder*) * listing->nfolders);
+        delete[] listing->folders;
+        listing->folders = folders;
+        listing->folders_capacity = capacity;
+    }
+
+    UsageFolder* folder = new (std::nothrow) UsageFolder();
+    if (!folder) return E_OUTOFMEMORY;
+    folder->parent = parent;
+    folder->id = string_clone(id);
+    folder->path = join_usage_path(parent->path, name);
+    if (!folder->id || !folder->path) {
+        free_usage_folder(folder);
+        return E_OUTOFMEMORY;
+    }
+    listing->folders[listing->nfolders++] = folder;
+    return S_OK;
+}
+
+// Objects which can't be read because of permanent error are counted as errors and skipped,
+// other errors fail the listing.
+static HRESULT list_usage_folder_once(UsageWalk* walk, UsageFolder* folder, UsageListing* out_listing) {
+    const int BatchSize = 32;
+    DeviceSession* session = walk->session;
+    IEnumPortableDeviceObjectIDs* enumerator = nullptr;
+    wchar_t* object_ids[BatchSize] = { 0 };
+    DWORD nfetched = 0;
+    DeviceObjectMetadata metadata;
+    UsageListing listing;
+
+    HRESULT hr = device_call(DeviceCall_Enumerate, [&]() { return session->content->EnumObjects(0, folder->id, nullptr, &enumerator); });
+    if (FAILED(hr)) goto quit;
+    if (hr != S_OK) {
+        hr = E_FAIL;
+        goto quit;
+    }
+
+    do {
+        if (is_cancelled(session->cancelled)) {
+            hr = HRESULT_FROM_WIN32(ERROR_CANCELLED);
+            goto quit;
+        }
+
+        hr = device_call(DeviceCall_Enumerate, [&]() { return enumerator->Next(BatchSize, object_ids, &nfetched); });
+        if (SUCCEEDED(hr)) {
+            for (DWORD i = 0; i < nfetched; ++i) {
+                HRESULT object_hr = get_device_object_metadata(session->properties, object_ids[i], &metadata);
+                if (FAILED(object_hr)) {
+                    if (classify_error(object_hr) != ErrorClass_Permanent || object_hr == E_OUTOFMEMORY) {
+                        hr = object_hr;
+                        goto quit;
+                    }
+                    ++listing.errors;
+                } else if (metadata.content_type == ContentType_Folder) {
+                    object_hr = usage_listing_add_folder(&listing, folder, object_ids[i], metadata.name);
+                } else {
+                    object_hr = usage_listing_add_file(&listing, walk->top_count, folder->path, metadata);
+                }
+                free_device_object_metadata(&metadata);
+                if (object_hr == E_OUTOFMEMORY) {
+                    hr = object_hr;
+                    goto quit;
+                }
+
+                CoTaskMemFree(object_ids[i]);
+                object_ids[i] = nullptr;
+            }
+            nfetched = 0;
+        }
+    } while (hr == S_OK);
+
+    quit:
+    safe_release(&enumerator);
+    free_device_object_metadata(&metadata);
+    for (DWORD i = 0; i < nfetched; ++i) {
+        CoTaskMemFree(object_ids[i]);
+    }
+    if (FAILED(hr)) {
+        free_usage_listing(&listing);
+    } else {
+        hr = S_OK;
+    }
+    *out_listing = listing;
+    return hr;
+}
+
+// Transient errors are retried here. Session can't be reopened while other walkers use it,
+// so walk is stopped on disconnect and started again by caller.
+static HRESULT list_usage_folder(UsageWalk* walk, UsageFolder* folder, UsageListing* out_listing) {
+    for (int attempt = 1; ; ++attempt) {
+        HRESULT hr = list_usage_folder_once(walk, folder, out_listing);
+        if (SUCCEEDED(hr) || classify_error(hr) != ErrorClass_Transient || attempt >= walk->policy->max_attempts) {
+            if (SUCCEEDED(hr) && attempt > 1) {
+                AcquireSRWLockExclusive(&walk->lock);
+                ++walk->stats->recovered;
+                ReleaseSRWLockExclusive(&walk->lock);
+            }
+            return hr;
+        }
+
+        AcquireSRWLockExclusive(&walk->lock);
+        ++walk->stats->retries;
+        ReleaseSRWLockExclusive(&walk->lock);
+        Sleep(retry_delay_ms(*walk->policy, attempt));
+    }
+}
+
+// Called when listing of folder or one of its subfolders is finished. Finished folder is added
+// to top folders and to totals of its parent, unless walk was stopped. Walk lock must be held.
+static void finish_usage_folder(UsageWalk* walk, UsageFolder* folder) {
+    while (folder && --folder->pending == 0) {
+        UsageFolder* parent = folder->parent;
+        if (SUCCEEDED(walk->hr)) {
+            if (parent) {
+                parent->size += folder->size;
+                parent->files += folder->files;
+            }
+            if (parent && usage_heap_accepts(walk->report.top_folders, walk->report.ntop_folders, walk->top_count, folder->size)) {
+                UsageEntry entry;
+                entry.path = folder->path; // <-- take ownership.
+                entry.size = folder->size;
+                entry.files = folder->files;
+                folder->path = nullptr;
+                usage_heap_insert(walk->report.top_folders, &walk->report.ntop_folders, walk->top_count, entry);
+            }
+        }
+        free_usage_folder(folder);
+        folder = parent;
+    }
+}
+
+static HRESULT push_usage_folder(UsageWalk* walk, UsageFolder* folder) {
+    if (walk->nstack == walk->stack_capacity) {
+        int capacity = walk->stack_capacity ? walk->stack_capacity * 2 : 256;
+        UsageFolder** stack = new (std::nothrow) UsageFolder*[capacity];
+        if (!stack) return E_OUTOFMEMORY;
+        if (walk->stack) memcpy(stack, walk->stack, sizeof(UsageFolder*) * walk->nstack);
+        delete[] walk->stack;
+        walk->stack = stack;
+        walk->stack_capacity = capacity;
+    }
+    walk->stack[walk->nstack++] = folder;
+    return S_OK;
+}
+
+// Adds listing to walk and queues its subfolders. Walk lock must be held.
+static void merge_usage_listing(UsageWalk* walk, UsageFolder* folder, UsageListing* listing) {
+    UsageReport& report = walk->report;
+    report.size += listing->size;
+    report.files += listing->files;
+    report.errors += listing->errors;
+    for (int i = 0; i < UsageContentTypes; ++i) {
+        report.type_sizes[i] += listing->type_sizes[i];
+        report.type_files[i] += listing->type_files[i];
+    }
+    folder->size += listing->size;
+    folder->files += listing->files;
+
+    for (int i = 0; i < listing->ntop_files; ++i) {
+        usage_heap_insert(report.top_files, &report.ntop_files, walk->top_count, listing->top_files[i]);
+        listing->top_files[i].path = nullptr;
+    }
+
+    // Pushed in reverse order, so they are listed in device order.
+    for (int i = listing->nfolders - 1; i >= 0; --i) {
+        HRESULT hr = push_usage_folder(walk, listing->folders[i]);
+        if (FAILED(hr)) {
+            walk->hr = hr;
+            break;
+        }
+        ++folder->pending;
+        ++report.folders;
+        listing->folders[i] = nullptr;
+        listing->nfolders = i;
+    }
+}
+
+static void run_usage_walker(UsageWalk* walk) {
+    AcquireSRWLockExclusive(&walk->lock);
+    while (1) {
+        while (walk->nstack == 0 && walk->active > 0 && SUCCEEDED(walk->hr)) {
+            SleepConditionVariableSRW(&walk->wake, &walk->lock, INFINITE, 0);
+        }
+        if (walk->nstack == 0 || FAILED(walk->hr)) {
+            break;
+        }
+
+        UsageFolder* folder = walk->stack[--walk->nstack];
+        ++walk->active;
+        ReleaseSRWLockExclusive(&walk->lock);
+
+        UsageListing listing;
+        HRESULT hr = list_usage_folder(walk, folder, &listing);
+
+        AcquireSRWLockExclusive(&walk->lock);
+        --walk->active;
+        if (SUCCEEDED(hr)) {
+            merge_usage_listing(walk, folder, &listing);
+        } else if (classify_error(hr) == ErrorClass_Permanent && hr != HRESULT_FROM_WIN32(ERROR_CANCELLED) && hr != E_OUTOFMEMORY && folder->parent) {
+            ++walk->report.errors;
+            session_log(walk->session, L"Unable to list folder \"%s\": %s\n", folder->path, error_string(hr));
+        } else if (SUCCEEDED(walk->hr)) {
+            walk->hr = hr;
+        }
+        finish_usage_folder(walk, folder);
+        free_usage_listing(&listing);
+        WakeAllConditionVariable(&walk->wake);
+    }
+    ReleaseSRWLockExclusive(&walk->lock);
+}
+
+static DWORD WINAPI usage_walker_thread_proc(void* userdata) {
+    auto walker = (UsageWalker*)userdata;
+    HRESULT hr = CoInitializeEx(0, COINIT_MULTITHREADED | COINIT_DISABLE_OLE1DDE);
+    if (FAILED(hr)) return 0; // <-- other walkers do the work.
+
+    watch_device_calls(walker->walk->session, walker->slot, walker->call_stats);
+    run_usage_walker(walker->walk);
+    unwatch_device_calls();
+    CoUninitialize();
+    return 0;
+}
+
+// Walks tree under folder with given number of walkers, calling thread is one of them.
+// Device calls of other walkers are added to call_stats.
+static HRESULT walk_device_usage(DeviceSession* session, const RetryPolicy& policy, const wchar_t* folder_id, const EngineUsageOptions& options, RetryStats* stats, DeviceCallStats* call_stats, UsageReport* out_report) {
+    UsageWalk walk;
+    UsageWalker walkers[UsageMaxWalkers];
+    int nwalkers = options.walkers < 1 ? 1 : options.walkers > UsageMaxWalkers ? UsageMaxWalkers : options.walkers;
+    UsageFolder* root = new (std::nothrow) UsageFolder();
+    HRESULT hr = S_OK;
+
+    walk.session = session;
+    walk.policy = &policy;
+    walk.top_count = options.top_count > 0 ? options.top_count : 0;
+    walk.stats = stats;
+    if (walk.top_count > 0) {
+        walk.report.top_folders = new (std::nothrow) UsageEntry[walk.top_count];
+        walk.report.top_files = new (std::nothrow) UsageEntry[walk.top_count];
+    }
+    if (!root || (walk.top_count > 0 && (!walk.report.top_folders || !walk.report.top_files))) {
+        delete root;
+        free_usage_report(&walk.report);
+        return E_OUTOFMEMORY;
+    }
+
+    root->id = string_clone(folder_id);
+    root->path = string_clone(L"");
+    if (!root->id || !root->path || FAILED(push_usage_folder(&walk, root))) {
+        free_usage_folder(root);
+        free_usage_report(&walk.report);
+        return E_OUTOFMEMORY;
+    }
+
+    for (int i = 1; i < nwalkers; ++i) {
+        walkers[i].walk = &walk;
+        walkers[i].slot = i;
+        walkers[i].thread = CreateThread(nullptr, 0, usage_walker_thread_proc, &walkers[i], 0, nullptr);
+    }
+    run_usage_walker(&walk);
+    for (int i = 1; i < nwalkers; ++i) {
+        if (!walkers[i].thread) continue;
+        WaitForSingleObject(walkers[i].thread, INFINITE);
+        CloseHandle(walkers[i].thread);
+        for (int k = 0; k < DeviceCall_Count; ++k) {
+            device_call_stats_add(&call_stats[k], walkers[i].call_stats[k]);
+        }
+    }
+
+    // Folders left after walk was stopped.
+    while (walk.nstack > 0) {
+        finish_usage_folder(&walk, walk.stack[--walk.nstack]);
+    }
+    delete[] walk.stack;
+
+    hr = walk.hr;
+    if (FAILED(hr)) {
+        free_usage_report(&walk.report);
+    } else {
+        qsort(walk.report.top_folders, walk.report.ntop_folders, sizeof(UsageEntry), usage_compare_entries);
+        qsort(walk.report.top_files, walk.report.ntop_files, sizeof(UsageEntry), usage_compare_entries);
+    }
+    *out_report = walk.report;
+    return hr;
+}
+
+// --- Destination layout ---
+// Path of copied object relative to destination directory is built from layout template, see engine_validate_layout.
+// Paths of all objects of a copy are built before copying. Which object owns a path is decided against
+// destination files when object is copied, see open_destination.
+
+const int LayoutMaxLength = 1024;
+
+// Case-insensitive set of strings with value per string. Strings are owned.
+struct StringMap {
+    wchar_t** keys = nullptr;
+    int* values = nullptr;
+    DWORD mask = 0;
+    DWORD count = 0;
+};
+
+static DWORD hash_string_nocase(const wchar_t* text) {
+    DWORD hash = 2166136261u;
+    for (; *text; ++text) {
+        hash = (hash ^ (DWORD)towlower(*text)) * 16777619u;
+    }
+    return hash;
+}
+
+static void string_map_free(StringMap* map) {
+    for (DWORD i = 0; map->keys && i <= map->mask; ++i) {
+        delete[] map->keys[i];
+    }
+    delete[] map->keys;
+    delete[] map->values;
+    *map = StringMap();
+}
+
+// Returns slot of key, or empty slot where it should be inserted.
+static DWORD string_map_slot(const StringMap* map, const wchar_t* key) {
+    DWORD slot = hash_string_nocase(key) & map->mask;
+    while (map->keys[slot] && 0 != _wcsicmp(map->keys[slot], key)) {
+        slot = (slot + 1) & map->mask;
+    }
+    return slot;
+}
+
+static const int* string_map_find(const StringMap* map, const wchar_t* key) {
+    if (!map->keys) return nullptr;
+    DWORD slot = string_map_slot(map, key);
+    return map->keys[slot] ? &map->values[slot] : nullptr;
+}
+
+// Inserts key or replaces its value.
+static HRESULT string_map_set(StringMap* map, const wchar_t* key, int value) {
+    if (!map->keys || (map->count + 1) * 2 > map->mask + 1) {
+        DWORD capacity = map->keys ? (map->mask + 1) * 2 : 64;
+        StringMap grown;
+        grown.keys = new (std::nothrow) wchar_t*[capacity]();
+        grown.values = new (std::nothrow) int[capacity];
+        if (!grown.keys || !grown.values) {
+            delete[] grown.keys;
+            delete[] grown.values;
+            return E_OUTOFMEMORY;
+        }
+        grown.mask = capacity - 1;
+        for (DWORD i = 0; map->keys && i <= map->mask; ++i) {
+            if (!map->keys[i]) continue;
+            DWORD slot = string_map_slot(&grown, map->keys[i]);
+            grown.keys[slot] = map->keys[i];
+            grown.values[slot] = map->values[i];
+        }
+        grown.count = map->count;
+        delete[] map->keys;
+        delete[] map->values;
+        *map = grown;
+    }
+
+    DWORD slot = string_map_slot(map, key);
+    if (!map->keys[slot]) {
+        map->keys[slot] = string_clone(key);
+        if (!map->keys[slot]) return E_OUTOFMEMORY;
+        ++map->count;
+    }
+    map->values[slot] = value;
+    return S_OK;
+}
+
+static bool layout_append(wchar_t* path, int* length, const wchar_t* text, int text_length, bool sanitize) {
+    if (text_length < 0) text_length = (int)wcslen(text);
+    if (*length + text_length >= LayoutMaxLength) return false;
+    for (int i = 0; i < text_length; ++i) {
+        wchar_t c = text[i];
+        // Values of tokens must not add path segments.
+        if (sanitize && (c < 32 || wcschr(L"<>:\"/\\|?*", c))) {
+            c = L'_';
+        }
+        path[(*length)++] = c;
+    }
+    path[*length] = L'\0';
+    return true;
+}
+
+// Builds path of object relative to destination directory. Returns E_INVALIDARG if layout is malformed
+// or result is not a relative file path.
+static HRESULT expand_layout(const wchar_t* layout, const DeviceObjectInformation& object, const wchar_t* device_name, wchar_t* path) {
+    int length = 0;
+    bool has_name = false;
+    path[0] = L'\0';
+
+    const wchar_t* name = object.name ? object.name : L"";
+    const wchar_t* extension = wcsrchr(name, L'.');
+    if (!extension || extension == name) {
+        extension = name + wcslen(name);
+    }
+
+    SYSTEMTIME date = { 0 };
+    bool has_date = object.date_modified != 0 && VariantTimeToSystemTime(object.date_modified, &date);
+
+    for (const wchar_t* c = layout; *c; ) {
+        if (*c == L'/' || *c == L'\\') {
+            if (!layout_append(path, &length, L"\\", 1, false)) return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+            ++c;
+            continue;
+        }
+        if (*c != L'{') {
+            if (!layout_append(path, &length, c, 1, true)) return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+            ++c;
+            continue;
+        }
+
+        const wchar_t* token = c + 1;
+        const wchar_t* token_end = wcschr(token, L'}');
+        if (!token_end) return E_INVALIDARG;
+        int token_length = (int)(token_end - token);
+        c = token_end + 1;
+
+        wchar_t value[32];
+        const wchar_t* text = value;
+        int text_length = -1;
+        if (token_length == 4 && 0 == wcsncmp(token, L"name", 4)) {
+            text = name;
+            has_name = true;
+        } else if (token_length == 4 && 0 == wcsncmp(token, L"stem", 4)) {
+            text = name;
+            text_length = (int)(extension - name);
+            has_name = true;
+        } else if (token_length == 3 && 0 == wcsncmp(token, L"ext", 3)) {
+            text = extension;
+        } else if (token_length == 4 && 0 == wcsncmp(token, L"yyyy", 4)) {
+            swprintf_s(value, L"%04u", has_date ? date.wYear : 0);
+        } else if (token_length == 2 && 0 == wcsncmp(token, L"mm", 2)) {
+            swprintf_s(value, L"%02u", has_date ? date.wMonth : 0);
+        } else if (token_length == 2 && 0 == wcsncmp(token, L"dd", 2)) {
+            swprintf_s(value, L"%02u", has_date ? date.wDay : 0);
+        } else if (token_length == 6 && 0 == wcsncmp(token, L"device", 6)) {
+            text = device_name && device_name[0] ? device_name : L"device";
+        } else if (token_length == 6 && 0 == wcsncmp(token, L"hash:", 5) && token[5] >= L'1' && token[5] <= L'8') {
+            // Persistent ID doesn't change when object is renamed or device is reconnected.
+            DWORD hash = hash_string(object.persistent_id ? object.persistent_id : name);
+            swprintf_s(value, L"%08x", hash);
+            text_length = token[5] - L'0';
+        } else {
+            return E_INVALIDARG;
+        }
+
+        if (!layout_append(path, &length, text, text_length, true)) return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+    }
+
+    if (!has_name) return E_INVALIDARG;
+
+    // Every segment must be a name: no empty, "." or ".." segments, so path stays inside destination directory.
+    for (const wchar_t* segment = path; ; ) {
+        const wchar_t* segment_end = wcschr(segment, L'\\');
+        int segment_length = segment_end ? (int)(segment_end - segment) : (int)wcslen(segment);
+        if (segment_length == 0 || (segment_length <= 2 && 0 == wcsncmp(segment, L"..", segment_length))) {
+            return E_INVALIDARG;
+        }
+        if (!segment_end) break;
+        segment = segment_end + 1;
+    }
+    return S_OK;
+}
+
+HRESULT engine_validate_layout(const wchar_t* layout) {
+    DeviceObjectInformation object;
+    object.name = (wchar_t*)L"name.ext";
+    wchar_t path[LayoutMaxLength];
+    return expand_layout(layout, object, L"device", path);
+}
+
+static void free_destination_paths(wchar_t** paths, wchar_t** suffixed_paths, int nobjects) {
+    for (int i = 0; paths && i < nobjects; ++i) delete[] paths[i];
+    for (int i = 0; suffixed_paths && i < nobjects; ++i) delete[] suffixed_paths[i];
+    delete[] paths;
+    delete[] suffixed_paths;
+}
+
+// Builds two destination paths of every object: layout path, and the same path with "~<hash>" suffix before
+// extension, where hash is of persistent ID. Object uses suffixed path when layout path is taken by other
+// object, see open_destination. Both depend only on the object, so they are the same in every copy.
+// Paths of objects whose layout fails to expand are nullptr. Returned arrays and paths are allocated with new[].
+static HRESULT build_destination_paths(const DeviceObjectInformation* objects, int nobjects, const wchar_t* layout, const wchar_t* device_name, wchar_t*** out_paths, wchar_t*** out_suffixed_paths) {
+    wchar_t path[LayoutMaxLength];
+    HRESULT hr = S_OK;
+    *out_paths = nullptr;
+    *out_suffixed_paths = nullptr;
+
+    wchar_t** paths = new (std::nothrow) wchar_t*[nobjects]();
+    wchar_t** suffixed_paths = new (std::nothrow) wchar_t*[nobjects]();
+    if (!paths || !suffixed_paths) {
+        hr = E_OUTOFMEMORY;
+        goto quit;
+    }
+
+    for (int i = 0; i < nobjects; ++i) {
+        if (FAILED(expand_layout(layout ? layout : L"{name}", objects[i], device_name, path))) {
+            // Reported when object is copied.
+            continue;
+        }
+
+        wchar_t* file_name = wcsrchr(path, L'\\');
+        file_name = file_name ? file_name + 1 : path;
+        wchar_t* extension = wcsrchr(file_name, L'.');
+        if (!extension || extension == file_name) {
+            extension = file_name + wcslen(file_name);
+        }
+        wchar_t* stem = string_clone(path, (int)(extension - path));
+        DWORD hash = hash_string(objects[i].persistent_id ? objects[i].persistent_id : objects[i].id);
+        paths[i] = string_clone(path);
+        suffixed_paths[i] = stem ? string_format(L"%s~%08x%s", stem, hash, extension) : nullptr;
+        delete[] stem;
+        if (!paths[i] || !suffixed_paths[i]) {
+            hr = E_OUTOFMEMORY;
+            goto quit;
+        }
+    }
+
+    *out_paths = paths;
+    *out_suffixed_paths = suffixed_paths;
+    paths = nullptr;
+    suffixed_paths = nullptr;
+
+    quit:
+    free_destination_paths(paths, suffixed_paths, nobjects);
+    return hr;
+}
+
+// Creates directories of relative path inside destination directory. Directories which were created
+// or found earlier are remembered in created set, so they are not touched again.
+static HRESULT create_destination_directories(StringMap* created, const wchar_t* destination_directory, const wchar_t* relative_path) {
+    const wchar_t* last_separator = wcsrchr(relative_path, L'\\');
+    if (!last_separator) return S_OK;
+
+    wchar_t* directory = string_clone(relative_path, (int)(last_separator - relative_path));
+    if (!directory) return E_OUTOFMEMORY;
+
+    HRESULT hr = S_OK;
+    if (!string_map_find(created, directory)) {
+        for (wchar_t* c = directory; SUCCEEDED(hr); ++c) {
+            if (*c != L'\\' && *c != L'\0') continue;
+            wchar_t saved = *c;
+            *c = L'\0';
+            if (!string_map_find(created, directory)) {
+                wchar_t* path = nullptr;
+                hr = PathAllocCombine(destination_directory, directory, PATHCCH_ALLOW_LONG_PATHS, &path);
+                if (SUCCEEDED(hr) && !CreateDirectoryW(path, nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) {
+                    hr = HRESULT_FROM_WIN32(GetLastError());
+                }
+                LocalFree(path);
+                if (SUCCEEDED(hr)) {
+                    hr = string_map_set(created, directory, 0);
+                }
+            }
+            *c = saved;
+            if (saved == L'\0') break;
+        }
+    }
+
+    delete[] directory;
+    return hr;
+}
+
+// --- Destinations ---
+// Object may be copied into several destination directories at once. Every buffer read from device is
+// written into all of them with overlapped writes which run together, so device is read only once.
+// Destination which fails is dropped and the rest continue, object is copied again later only into
+// destinations it's missing from.
+
+struct CopyDestination {
+    int index = 0;                      // <-- in EngineCopyOptions::destination_directories.
+    const wchar_t* directory = nullptr;
+    wchar_t* path = nullptr;            // <-- free with LocalFree.
+    HANDLE file = INVALID_HANDLE_VALUE; // <-- opened for overlapped I/O.
+    bool suffixed = false;              // <-- file is at suffixed path of object.
+    ULONGLONG start = 0;                // <-- with append: data before it is already in file.
+    LONG volatile failed = 0;
+    HRESULT hr = S_OK;                  // <-- of the first failure, read only after copy is finished.
+    const wchar_t* error_context = nullptr;
+};
+
+static void fail_destination(CopyDestination* destination, HRESULT hr, const wchar_t* error_context) {
+    if (0 == InterlockedCompareExchange(&destination->failed, 1, 0)) {
+        destination->hr = hr;
+        destination->error_context = error_context;
+    }
+}
+
+static bool has_live_destinations(const CopyDestination* destinations, int ndestinations) {
+    for (int i = 0; i < ndestinations; ++i) {
+        if (!destinations[i].failed) return true;
+    }
+    return false;
+}
+
+// Returns error of the first failed destination, or S_OK.
+static HRESULT get_destination_error(const CopyDestination* destinations, int ndestinations, const wchar_t** out_error_context) {
+    for (int i = 0; i < ndestinations; ++i) {
+        if (destinations[i].failed) {
+            *out_error_context = destinations[i].error_context;
+            return destinations[i].hr;
+        }
+    }
+    return S_OK;
+}
+
+static bool truncate_destination(CopyDestination* destination) {
+    LARGE_INTEGER zero = { 0 };
+    return SetFilePointerEx(destination->file, zero, nullptr, FILE_BEGIN) && SetEndOfFile(destination->file);
+}
+
+static void close_destinations(CopyDestination* destinations, int ndestinations) {
+    for (int i = 0; i < ndestinations; ++i) {
+        if (destinations[i].file != INVALID_HANDLE_VALUE) {
+            CloseHandle(destinations[i].file);
+            destinations[i].file = INVALID_HANDLE_VALUE;
+        }
+        LocalFree(destinations[i].path);
+        destinations[i].path = nullptr;
+    }
+}
+
+// Every thread which does I/O on destination files waits for it on its own events, one per destination.
+static HRESULT create_io_events(HANDLE* events, int count) {
+    for (int i = 0; i < count; ++i) {
+        events[i] = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (!events[i]) return HRESULT_FROM_WIN32(GetLastError());
+    }
+    return S_OK;
+}
+
+static void close_io_events(HANDLE* events, int count) {
+    for (int i = 0; i < count; ++i) {
+        if (events[i]) CloseHandle(events[i]);
+        events[i] = nullptr;
+    }
+}
+
+static HRESULT begin_file_io(HANDLE file, HANDLE event, bool write, ULONGLONG offset, void* data, DWORD size, OVERLAPPED* overlapped) {
+    memset(overlapped, 0, sizeof(*overlapped));
+    overlapped->Offset = (DWORD)offset;
+    overlapped->OffsetHigh = (DWORD)(offset >> 32);
+    overlapped->hEvent = event;
+    BOOL ok = write ? WriteFile(file, data, size, nullptr, overlapped) : ReadFile(file, data, size, nullptr, overlapped);
+    if (!ok && GetLastError() != ERROR_IO_PENDING) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    return S_OK;
+}
+
+static HRESULT end_file_io(HANDLE file, OVERLAPPED* overlapped, DWORD* out_ntransferred) {
+    if (!GetOverlappedResult(file, overlapped, out_ntransferred, TRUE)) {
+        *out_ntransferred = 0;
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    return S_OK;
+}
+
+// Reads range which lies within destination file.
+static HRESULT read_destination_at(HANDLE file, HANDLE event, ULONGLONG offset, BYTE* data, DWORD size) {
+    while (size > 0) {
+        OVERLAPPED overlapped;
+        DWORD nread = 0;
+        HRESULT hr = begin_file_io(file, event, false, offset, data, size, &overlapped);
+        if (SUCCEEDED(hr)) hr = end_file_io(file, &overlapped, &nread);
+        if (FAILED(hr)) return hr;
+        if (nread == 0) return HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+        data += nread;
+        offset += nread;
+        size -= nread;
+    }
+    return S_OK;
+}
+
+// Writes data, which is at offset of device object, into every destination which hasn't failed. Writes run at once.
+// Part of data before destination start is skipped. Returns false if no destination is left.
+static bool write_destinations(CopyDestination* destinations, int ndestinations, const HANDLE* events, ULONGLONG offset, const char* data, DWORD size) {
+    OVERLAPPED overlapped[EngineMaxDestinations];
+    DWORD lengths[EngineMaxDestinations] = {};
+
+    for (int i = 0; i < ndestinations; ++i) {
+        auto& destination = destinations[i];
+        if (destination.failed || offset + size <= destination.start) continue;
+
+        DWORD skip = destination.start > offset ? (DWORD)(destination.start - offset) : 0;
+        HRESULT hr = begin_file_io(destination.file, events[i], true, offset + skip, (void*)(data + skip), size - skip, &overlapped[i]);
+        if (FAILED(hr)) {
+            fail_destination(&destination, hr, L"Unable to write to destination file");
+            continue;
+        }
+        lengths[i] = size - skip;
+    }
+
+    for (int i = 0; i < ndestinations; ++i) {
+        if (lengths[i] == 0) continue;
+
+        DWORD nwritten = 0;
+        HRESULT hr = end_file_io(destinations[i].file, &overlapped[i], &nwritten);
+        if (FAILED(hr)) {
+            fail_destination(&destinations[i], hr, L"Unable to write to destination file");
+        } else if (nwritten != lengths[i]) {
+            fail_destination(&destinations[i], E_FAIL, L"Incomplete write to destination file");
+        }
+    }
+    return has_live_destinations(destinations, ndestinations);
+}
+
+// --- Append ---
+// Append-only files (recordings, logs) grow between runs. If destination file is an unchanged prefix
+// of device object, only the tail is read from device. Reading whole prefix back from device would
+// cost as much as copying it, so prefix is verified by comparing its first and last AppendVerifyWindow bytes.
+
+const DWORD AppendVerifyWindow = 64 * 1024;
+
+static HRESULT seek_stream(IStream* stream, ULONGLONG offset) {
+    LARGE_INTEGER position;
+    position.QuadPart = (LONGLONG)offset;
+    return stream->Seek(position, STREAM_SEEK_SET, nullptr);
+}
+
+// Reads until buffer is full or stream ends.
+static HRESULT read_stream_full(IStream* stream, BYTE* buffer, DWORD size, DWORD* out_nread) {
+    DWORD total = 0;
+    HRESULT hr = S_OK;
+    while (total < size) {
+        DWORD nread = 0;
+        hr = stream->Read(buffer + total, size - total, &nread);
+        if (FAILED(hr) || nread == 0) break;
+        total += nread;
+    }
+    *out_nread = total;
+    return FAILED(hr) ? hr : S_OK;
+}
+
+// Range must lie within destination file.
+static HRESULT compare_stream_ranges(IStream* stream, HANDLE file, HANDLE event, ULONGLONG offset, DWORD length, BYTE* buffer, bool* out_equal) {
+    BYTE* device_data = buffer;
+    BYTE* file_data = buffer + AppendVerifyWindow;
+    DWORD device_nread = 0;
+    *out_equal = false;
+
+    HRESULT hr = device_call(DeviceCall_Read, [&]() { return seek_stream(stream, offset); });
+    if (SUCCEEDED(hr)) hr = device_call(DeviceCall_Read, [&]() { return read_stream_full(stream, device_data, length, &device_nread); });
+    if (SUCCEEDED(hr)) hr = read_destination_at(file, event, offset, file_data, length);
+    if (FAILED(hr)) return hr;
+
+    *out_equal = device_nread == length && 0 == memcmp(device_data, file_data, length);
+    return S_OK;
+}
+
+// Checks whether destination file is unchanged prefix of device object, comparing its first and last
+// AppendVerifyWindow bytes with device data. Returns S_FALSE if file can't be checked because device
+// reports no size or can't seek. Sets out_stream_moved if device stream was read.
+static HRESULT verify_destination_prefix(IStream* stream, HANDLE file, HANDLE event, const DeviceObjectInformation& object, ULONGLONG file_size, bool* out_prefix, bool* out_stream_moved) {
+    BYTE* buffer = nullptr;
+    bool equal = false;
+    HRESULT hr = S_OK;
+    *out_prefix = false;
+
+    if (!object.has_size) return S_FALSE;
+    if (file_size == 0 || file_size > object.size) return S_OK;
+
+    // Probe whether driver supports seeking before anything is read from device stream.
+    {
+        LARGE_INTEGER no_move = { 0 };
+        if (FAILED(device_call(DeviceCall_Read, [&]() { return stream->Seek(no_move, STREAM_SEEK_CUR, nullptr); }))) {
+            return S_FALSE;
+        }
+    }
+
+    buffer = new (std::nothrow) BYTE[2 * AppendVerifyWindow];
+    if (!buffer) return E_OUTOFMEMORY;
+
+    *out_stream_moved = true;
+    if (file_size <= AppendVerifyWindow) {
+        hr = compare_stream_ranges(stream, file, event, 0, (DWORD)file_size, buffer, &equal);
+    } else {
+        hr = compare_stream_ranges(stream, file, event, 0, AppendVerifyWindow, buffer, &equal);
+        if (SUCCEEDED(hr) && equal) {
+            hr = compare_stream_ranges(stream, file, event, file_size - AppendVerifyWindow, AppendVerifyWindow, buffer, &equal);
+        }
+    }
+    delete[] buffer;
+    if (FAILED(hr)) return hr;
+
+    *out_prefix = equal;
+    return S_OK;
+}
+
+// Opens destination file of object. File at layout path belongs to the object which created it: existing
+// non-empty file there is used only if it's verified prefix of this object, otherwise object is written to
+// its suffixed path, and stays there in later copies. File which can't be verified may belong to other
+// object, so it's never touched. With append, destination start is set to the end of verified prefix;
+// otherwise, and if own file can't be continued, file is truncated.
+// Destination failures are stored in destination, returned error means device stream couldn't be read.
+// Sets out_stream_moved if device stream was read.
+static HRESULT open_destination(IStream* stream, CopyDestination* destination, HANDLE event, const DeviceObjectInformation& object, const wchar_t* relative_path, const wchar_t* suffixed_path, bool append, bool* out_stream_moved) {
+    LARGE_INTEGER file_size = { 0 };
+    bool prefix = false;
+    HRESULT hr = S_OK;
+
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        // Suffixed path which exists is always used, layout path is tried first otherwise.
+        hr = PathAllocCombine(destination->directory, suffixed_path, PATHCCH_ALLOW_LONG_PATHS, &destination->path);
+        if (SUCCEEDED(hr)) {
+            destination->suffixed = attempt > 0 || GetFileAttributesW(destination->path) != INVALID_FILE_ATTRIBUTES;
+            if (!destination->suffixed) {
+                LocalFree(destination->path);
+                destination->path = nullptr;
+                hr = PathAllocCombine(destination->directory, relative_path, PATHCCH_ALLOW_LONG_PATHS, &destination->path);
+            }
+        }
+        if (FAILED(hr)) {
+            fail_destination(destination, hr, L"Cannot build destination path");
+            return S_OK;
+        }
+
+        destination->file = CreateFileW(destination->path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, nullptr);
+        if (destination->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(destination->file, &file_size)) {
+            fail_destination(destination, HRESULT_FROM_WIN32(GetLastError()), L"Unable to create destination file");
+            return S_OK;
+        }
+
+        // Own file at suffixed path is overwritten without looking at it unless it may be continued.
+        if (file_size.QuadPart == 0 || (destination->suffixed && !append)) break;
+
+        hr = verify_destination_prefix(stream, destination->file, event, object, (ULONGLONG)file_size.QuadPart, &prefix, out_stream_moved);
+        if (FAILED(hr)) return hr;
+        if (prefix || destination->suffixed) break;
+
+        // File of other object, of this one before it was changed on device, or file which can't be
+        // verified is left as is.
+        CloseHandle(destination->file);
+        destination->file = INVALID_HANDLE_VALUE;
+        LocalFree(destination->path);
+        destination->path = nullptr;
+    }
+
+    destination->start = append && prefix ? (ULONGLONG)file_size.QuadPart : 0;
+    if (destination->start == 0 && file_size.QuadPart > 0) {
+        if (!truncate_destination(destination)) {
+            fail_destination(destination, HRESULT_FROM_WIN32(GetLastError()), L"Unable to truncate destination file");
+        }
+    }
+    return S_OK;
+}
+
+// --- Ranged copy ---
+// Large file is split into ranges which are read at once, every range through its own device stream
+// seeked to range start, and written at its offset into destination files which are preallocated to
+// object size. Helps when per-request latency of driver, not the link, limits speed of single stream.
+// Range count depends on file size and on how many streams device lets to open. If device can't seek
+// in its streams, file is copied with single stream.
+
+const ULONGLONG RangedCopyMinRangeSize = 64ull * 1024 * 1024;
+const int RangedCopyMaxRanges = DeviceCallWatchCount; // <-- every range thread needs its own watch slot.
+
+struct RangedCopy {
+    DeviceSession* session = nullptr;
+    CopyDestination* destinations = nullptr;
+    int ndestinations = 0;
+    DWORD buffer_size = 0;
+    LONG volatile failed = 0; // <-- set by first range which fails, other ranges stop.
+};
+
+struct CopyRange {
+    RangedCopy* copy = nullptr;
+    int slot = 0;
+    IStream* stream = nullptr;
+    ULONGLONG offset = 0;
+    ULONGLONG length = 0;
+    bool last = false;    // <-- also checks that stream ends after the range.
+    ULONGLONG nread = 0;
+    HRESULT hr = S_OK;
+    const wchar_t* error_context = nullptr;
+    HANDLE thread = nullptr;
+    DeviceCallStats call_stats[DeviceCall_Count];
+};
+
+static void copy_range(CopyRange* range) {
+    RangedCopy* copy = range->copy;
+    DeviceSession* session = copy->session;
+    HANDLE events[EngineMaxDestinations] = {};
+    char* buffer = new (std::nothrow) char[copy->buffer_size];
+    HRESULT hr = S_OK;
+
+    if (!buffer) {
+        hr = E_OUTOFMEMORY;
+        range->error_context = L"Unable to create copy buffer";
+        goto quit;
+    }
+
+    hr = create_io_events(events, copy->ndestinations);
+    if (FAILED(hr)) {
+        range->error_context = L"Unable to create destination file events";
+        goto quit;
+    }
+
+    while (range->nread < range->length) {
+        if (is_cancelled(session->cancelled)) {
+            hr = HRESULT_FROM_WIN32(ERROR_CANCELLED);
+            range->error_context = L"Copy was cancelled";
+            goto quit;
+        }
+        if (copy->failed) {
+            goto quit; // <-- error is reported by range which failed.
+        }
+
+        DWORD request = copy->buffer_size;
+        if (range->length - range->nread < request) {
+            request = (DWORD)(range->length - range->nread);
+        }
+        DWORD nread = 0;
+        hr = device_call(DeviceCall_Read, [&]() { return range->stream->Read(buffer, request, &nread); });
+        if (FAILED(hr)) {
+            range->error_context = L"Unable to read from source file";
+            goto quit;
+        }
+        if (nread == 0) {
+            hr = S_OK;
+            break;
+        }
+
+        if (session->disk_scheduler) disk_scheduler_acquire(session->disk_scheduler, session->disk_client);
+        bool live = write_destinations(copy->destinations, copy->ndestinations, events, range->offset + range->nread, buffer, nread);
+        if (session->disk_scheduler) disk_scheduler_release(session->disk_scheduler, session->disk_client, nread);
+        if (!live) {
+            hr = get_destination_error(copy->destinations, copy->ndestinations, &range->error_context);
+            goto quit;
+        }
+
+        range->nread += nread;
+        session_bytes_copied(session, nread);
+    }
+
+    if (range->nread != range->length) {
+        hr = HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+        range->error_context = L"Source file ended before its reported size";
+        goto quit;
+    }
+
+    // Data past reported size is never written, but file which grew can't be copied in full.
+    if (range->last) {
+        DWORD nread = 0;
+        hr = device_call(DeviceCall_Read, [&]() { return range->stream->Read(buffer, 1, &nread); });
+        if (FAILED(hr)) {
+            range->error_context = L"Unable to read from source file";
+            goto quit;
+        }
+        if (nread > 0) {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            range->error_context = L"Source file is larger than its reported size";
+            goto quit;
+        }
+        hr = S_OK;
+    }
+
+    quit:
+    delete[] buffer;
+    close_io_events(events, copy->ndestinations);
+    range->hr = hr;
+    if (FAILED(hr)) {
+        InterlockedExchange(&copy->failed, 1);
+    }
+}
+
+static DWORD WINAPI copy_range_thread_proc(void* userdata) {
+    auto range = (CopyRange*)userdata;
+    HRESULT hr = CoInitializeEx(0, COINIT_MULTITHREADED | COINIT_DISABLE_OLE1DDE);
+    if (FAILED(hr)) {
+        range->hr = hr;
+        range->error_context = L"Unable to start reading range of source file";
+        InterlockedExchange(&range->copy->failed, 1);
+        return 0;
+    }
+
+    watch_device_calls(range->copy->session, range->slot, range->call_stats);
+    copy_range(range);
+    unwatch_device_calls();
+    CoUninitialize();
+    return 0;
+}
+
+// Returns S_FALSE without writing into destinations if file should be copied with single stream.
+// Stream is used for the first range.
+static HRESULT copy_device_object_ranged(DeviceSession* session, const DeviceObjectInformation& object, IStream* stream, DWORD buffer_size, CopyDestination* destinations, int ndestinations, int max_ranges, const wchar_t** out_error_context) {
+    CopyRange ranges[RangedCopyMaxRanges];
+    RangedCopy copy;
+    const wchar_t* error_context = nullptr;
+    ULONGLONG range_length = 0;
+    ULONGLONG total = 0;
+    int nranges = 0;
+    bool preallocated = false;
+    HRESULT hr = S_OK;
+
+    ULONGLONG fitting_ranges = object.size / RangedCopyMinRangeSize;
+    int max_count = max_ranges < RangedCopyMaxRanges ? max_ranges : RangedCopyMaxRanges;
+    int wanted = fitting_ranges < (ULONGLONG)max_count ? (int)fitting_ranges : max_count;
+    if (wanted < 2) {
+        return S_FALSE;
+    }
+
+    // Streams are opened and seeked before anything is written, so file can still be copied
+    // with single stream when device doesn't allow several streams or seeking.
+    ranges[0].stream = stream;
+    stream->AddRef();
+    for (nranges = 1; nranges < wanted; ++nranges) {
+        DWORD unused_buffer_size = 0;
+        hr = device_call(DeviceCall_Read, [&]() { return session->resources->GetStream(object.id, WPD_RESOURCE_DEFAULT, STGM_READ, &unused_buffer_size, &ranges[nranges].stream); });
+        if (FAILED(hr)) break;
+    }
+    hr = S_OK;
+    if (nranges < 2) {
+        hr = S_FALSE;
+        goto quit;
+    }
+
+    // Ranges are multiples of 1 MiB, last one takes the rest.
+    range_length = (object.size / nranges) & ~(ULONGLONG)(1024 * 1024 - 1);
+    for (int i = 0; i < nranges; ++i) {
+        ranges[i].copy = &copy;
+        ranges[i].slot = i;
+        ranges[i].offset = range_length * i;
+        ranges[i].last = i == nranges - 1;
+        ranges[i].length = ranges[i].last ? object.size - ranges[i].offset : range_length;
+        if (i > 0) {
+            hr = device_call(DeviceCall_Read, [&]() { return seek_stream(ranges[i].stream, ranges[i].offset); });
+            if (FAILED(hr)) {
+                if (classify_error(hr) == ErrorClass_Permanent) {
+                    hr = S_FALSE;
+                } else {
+                    error_context = L"Unable to seek in source file";
+                }
+                goto quit;
+            }
+        }
+    }
+
+    // File system zero-fills the gap when range is written past the end of data written so far,
+    // allocating whole files first at least keeps them in one piece.
+    for (int i = 0; i < ndestinations; ++i) {
+        if (destinations[i].failed) continue;
+        LARGE_INTEGER end;
+        end.QuadPart = (LONGLONG)object.size;
+        if (!SetFilePointerEx(destinations[i].file, end, nullptr, FILE_BEGIN) || !SetEndOfFile(destinations[i].file)) {
+            fail_destination(&destinations[i], HRESULT_FROM_WIN32(GetLastError()), L"Unable to allocate destination file");
+        }
+    }
+    preallocated = true;
+    if (!has_live_destinations(destinations, ndestinations)) {
+        hr = get_destination_error(destinations, ndestinations, &error_context);
+        goto quit;
+    }
+
+    copy.session = session;
+    copy.destinations = destinations;
+    copy.ndestinations = ndestinations;
+    copy.buffer_size = buffer_size;
+
+    for (int i = 1; i < nranges; ++i) {
+        ranges[i].thread = CreateThread(nullptr, 0, copy_range_thread_proc, &ranges[i], 0, nullptr);
+        if (!ranges[i].thread) {
+            ranges[i].hr = HRESULT_FROM_WIN32(GetLastError());
+            ranges[i].error_context = L"Unable to start reading range of source file";
+            InterlockedExchange(&copy.failed, 1);
+        }
+    }
+    copy_range(&ranges[0]);
+
+    for (int i = 1; i < nranges; ++i) {
+        if (!ranges[i].thread) continue;
+        WaitForSingleObject(ranges[i].thread, INFINITE);
+        CloseHandle(ranges[i].thread);
+        ranges[i].thread = nullptr;
+        if (watched_call && watched_call->stats) {
+            for (int k = 0; k < DeviceCall_Count; ++k) {
+                device_call_stats_add(&watched_call->stats[k], ranges[i].call_stats[k]);
+            }
+        }
+    }
+
+    // Reassemble: every range must have been read and written exactly at its place, and together
+    // they must make the whole file. Any short range fails the whole object.
+    for (int i = 0; i < nranges; ++i) {
+        if (FAILED(ranges[i].hr)) {
+            hr = ranges[i].hr;
+            error_context = ranges[i].error_context;
+            goto quit;
+        }
+    }
+    for (int i = 0; i < nranges; ++i) {
+        if (ranges[i].offset != total || ranges[i].nread != ranges[i].length) {
+            hr = HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+            error_context = L"Source file ended before its reported size";
+            goto quit;
+        }
+        total += ranges[i].nread;
+    }
+    if (total != object.size) {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        error_context = L"Size of source file changed while it was copied";
+        goto quit;
+    }
+
+    quit:
+    // File which wasn't written in full has zero-filled holes of full size, which later copies could
+    // take for data. It's emptied, so it's never mistaken for a copy or a prefix of the object.
+    for (int i = 0; preallocated && i < ndestinations; ++i) {
+        if (destinations[i].file != INVALID_HANDLE_VALUE && (FAILED(hr) || destinations[i].failed)) {
+            truncate_destination(&destinations[i]);
+        }
+    }
+    for (int i = 0; i < nranges; ++i) {
+        safe_release(&ranges[i].stream);
+    }
+    *out_error_context = error_context;
+    return hr;
+}
+
+// Copies object into destinations which haven't failed yet, destination paths are relative to every destination
+// directory and their directories must exist. Object is written to its layout path or suffixed path, see
+// open_destination; destination suffixed is set for the latter. With append, existing destination files which
+// are verified prefix of device object are continued. Fails if object couldn't be read or all destinations failed, otherwise
+// destinations which failed on their own are marked failed. Destination files are closed on return.
+static HRESULT copy_device_object(DeviceSession* session, const DeviceObjectInformation& object, CopyDestination* destinations, int ndestinations, const wchar_t* relative_path, const wchar_t* suffixed_path, bool append, int read_streams, const wchar_t** out_error_context) {
+    DWORD optimal_buffer_size = 0;
+    IStream* stream = nullptr;
+    HANDLE events[EngineMaxDestinations] = {};
+    const wchar_t* error_context = nullptr;
+    char* buffer = nullptr;
+    ULONGLONG position = 0; // <-- of device stream.
+
+    HRESULT hr = device_call(DeviceCall_Read, [&]() { return session->resources->GetStream(object.id, WPD_RESOURCE_DEFAULT, STGM_READ, &optimal_buffer_size, &stream); });
+    if (FAILED(hr)) {
+        error_context = L"Unable to get source file stream";
+        goto quit;
+    }
+
+    hr = create_io_events(events, ndestinations);
+    if (FAILED(hr)) {
+        error_context = L"Unable to create destination file events";
+        goto quit;
+    }
+
+    // Every destination is verified on its own, device stream then continues from the shortest one.
+    // When no destination file was verified, stream was never moved from start, which also works with
+    // devices which can't seek.
+    {
+        ULONGLONG start = (ULONGLONG)-1;
+        bool stream_moved = false;
+        for (int i = 0; i < ndestinations; ++i) {
+            if (destinations[i].failed) continue;
+            hr = open_destination(stream, &destinations[i], events[i], object, relative_path, suffixed_path, append, &stream_moved);
+            if (FAILED(hr)) {
+                error_context = L"Unable to compare destination file with device object";
+                goto quit;
+            }
+            if (!destinations[i].failed && destinations[i].start < start) start = destinations[i].start;
+        }
+        if (!has_live_destinations(destinations, ndestinations)) {
+            hr = get_destination_error(destinations, ndestinations, &error_context);
+            goto quit;
+        }
+        if (stream_moved) {
+            hr = device_call(DeviceCall_Read, [&]() { return seek_stream(stream, start); });
+            if (FAILED(hr)) {
+                error_context = L"Unable to seek in source file";
+                goto quit;
+            }
+        }
+        position = start;
+        if (position > 0) {
+            ++session->files_appended;
+            session->bytes_reused += position;
+        }
+    }
+
+    if (!append && read_streams > 1) {
+        hr = copy_device_object_ranged(session, object, stream, optimal_buffer_size, destinations, ndestinations, read_streams, &error_context);
+        if (hr != S_FALSE) goto quit;
+        hr = S_OK; // <-- stream is still at the start.
+    }
+
+    buffer = new (std::nothrow) char[optimal_buffer_size];
+    if (!buffer) {
+        hr = E_OUTOFMEMORY;
+        error_context = L"Unable to create copy buffer";
+        goto quit;
+    }
+
+    while (1) {
+        DWORD nread = 0;
+
+        if (is_cancelled(session->cancelled)) {
+            hr = HRESULT_FROM_WIN32(ERROR_CANCELLED);
+            error_context = L"Copy was cancelled";
+            goto quit;
+        }
+
+        hr = device_call(DeviceCall_Read, [&]() { return stream->Read(buffer, optimal_buffer_size, &nread); });
+        if (FAILED(hr)) {
+            error_context = L"Unable to read from source file";
+            goto quit;
+        }
+
+        if (nread == 0) {
+            hr = S_OK;
+            break;
+        }
+
+        if (session->disk_scheduler) disk_scheduler_acquire(session->disk_scheduler, session->disk_client);
+        bool live = write_destinations(destinations, ndestinations, events, position, buffer, nread);
+        if (session->disk_scheduler) disk_scheduler_release(session->disk_scheduler, session->disk_client, nread);
+        if (!live) {
+            hr = get_destination_error(destinations, ndestinations, &error_context);
+            goto quit;
+        }
+
+        position += nread;
+        session_bytes_copied(session, nread);
+    }
+
+    quit:
+    delete[] buffer;
+    safe_release(&stream);
+    close_destinations(destinations, ndestinations);
+    close_io_events(events, ndestinations);
+    *out_error_context = error_context;
+    return hr;
+}
+
+// Deletes objects which have succeeded status. Objects which failed to delete with transient error
+// are collected into the next batch, which is sent after backoff delay.
+// If indices are set, only objects[indices[0..count)] are considered, otherwise objects[0..count).
+// Returns number of deleted objects, number of objects attempted is stored in out_delete_count.
+static int delete_device_objects(DeviceSession* session, DeviceObjectInformation* objects, const int* indices, int count, const RetryPolicy& policy, RetryStats* stats, int* out_delete_count) {
+    IPortableDevicePropVariantCollection* files_to_delete = nullptr;
+    IPortableDevicePropVariantCollection* file_deletion_results = nullptr;
+    int* pending = new (std::nothrow) int[count];
+    int* next_pending = new (std::nothrow) int[count];
+    int npending = 0;
+    int success_count = 0;
+    int delete_count = 0;
+
+    HRESULT hr = CoCreateInstance(CLSID_PortableDevicePropVariantCollection, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&files_to_delete));
+    if (FAILED(hr)) {
+        session_log(session, L"Cannot create collection to hold deletion files: %s\n", error_string(hr));
+        goto quit;
+    }
+
+    if (!pending || !next_pending) {
+        session_log(session, L"Cannot create deletion queue: %s\n", error_string(E_OUTOFMEMORY));
+        goto quit;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        int index = indices ? indices[i] : i;
+        if (SUCCEEDED(objects[index].hr) && objects[index].hr != ENGINE_S_SKIPPED) {
+            objects[index].attempts = 0;
+            pending[npending++] = index;
+        }
+    }
+    delete_count = npending;
+
+    for (int pass = 1; npending > 0; ++pass) {
+        int nbatch = 0;
+        int nnext_pending = 0;
+
+        if (pass > 1) {
+            Sleep(retry_delay_ms(policy, pass - 1));
+        }
+
+        if (is_cancelled(session->cancelled)) {
+            for (int k = 0; k < npending; ++k) {
+                objects[pending[k]].hr = HRESULT_FROM_WIN32(ERROR_CANCELLED);
+            }
+            break;
+        }
+
+        files_to_delete->Clear();
+        for (int k = 0; k < npending; ++k) {
+            auto& object = objects[pending[k]];
+
+            PROPVARIANT file;
+            PropVariantInit(&file);
+
+            size_t id_size = (1 + wcslen(object.id)) * sizeof(wchar_t);
+            file.vt = VT_LPWSTR;
+            file.pwszVal = (wchar_t*)CoTaskMemAlloc(id_size);
+            if (!file.pwszVal) {
+                hr = E_OUTOFMEMORY;
+            } else {
+                memcpy(file.pwszVal, object.id, id_size);
+                hr = files_to_delete->Add(&file);
+                PropVariantClear(&file);
+            }
+
+            if (FAILED(hr)) {
+                object.hr = hr;
+                session_log(session, L"- [FAILED] %s\n  - %s: %s\n", object.name, L"Unable to queue file for deletion", error_string(hr));
+                continue;
+            }
+            pending[nbatch++] = pending[k];
+        }
+
+        safe_release(&file_deletion_results);
+        hr = retry_device_operation(session, policy, stats, [&]() {
+            return device_call(DeviceCall_Delete, [&]() { return session->content->Delete(PORTABLE_DEVICE_DELETE_NO_RECURSION, files_to_delete, &file_deletion_results); });
+        });
+        if (FAILED(hr)) {
+            session_log(session, L"Unable to delete files: %s\n", error_string(hr));
+            for (int k = 0; k < nbatch; ++k) {
+                objects[pending[k]].hr = hr;
+            }
+            break;
+        }
+
+        for (int k = 0; k < nbatch; ++k) {
+            auto& object = objects[pending[k]];
+            const wchar_t* error_context = nullptr;
+            PROPVARIANT value;
+            PropVariantInit(&value);
+
+            ++object.attempts;
+            if (object.attempts > 1) {
+                ++stats->retries;
+            }
+
+            hr = file_deletion_results->GetAt((DWORD)k, &value);
+            if (FAILED(hr)) {
+                error_context = L"Unable to get file deletion result";
+            } else if (value.vt != VT_ERROR) {
+                hr = E_FAIL;
+                error_context = L"Unexpected file deleting result value type";
+            } else {
+                hr = HRESULT_FROM_WIN32(value.scode);
+                if (FAILED(hr)) {
+                    error_context = L"Deletion error";
+                }
+            }
+            PropVariantClear(&value);
+
+            // Previous attempt may have been applied by the device before the error was reported.
+            if (object.attempts > 1 && hr == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND)) {
+                hr = S_OK;
+            }
+
+            if (FAILED(hr) && classify_error(hr) != ErrorClass_Permanent && object.attempts < policy.max_attempts) {
+                session_log_verbose(session, L"- [RETRY] %s\n  - %s: %s\n", object.name, error_context, error_string(hr));
+                next_pending[nnext_pending++] = pending[k];
+                continue;
+            }
+
+            object.hr = hr;
+            if (SUCCEEDED(hr)) {
+                if (object.attempts > 1) ++stats->recovered;
+                session_log_verbose(session, L"- [OK] %s\n", object.name);
+                ++success_count;
+            } else {
+                session_log(session, L"- [FAILED] %s\n  - %s: %s\n", object.name, error_context, error_string(hr));
+            }
+        }
+
+        int* swap = pending;
+        pending = next_pending;
+        next_pending = swap;
+        npending = nnext_pending;
+    }
+
+    quit:
+    safe_release(&files_to_delete);
+    safe_release(&file_deletion_results);
+    delete[] pending;
+    delete[] next_pending;
+    *out_delete_count = delete_count;
+    return success_count;
+}
+
+// --- Durable move ---
+// With --durable_move, copied files are collected into commit batches. Batch is flushed to disk
+// and only then deleted from device, so host crash can't lose the only copy of a file.
+// With several destinations, files are flushed in every one of them.
+
+struct DurableDestination {
+    const wchar_t* directory = nullptr;
+    wchar_t volume_letter = 0;
+    bool shares_volume = false;              // <-- volume is flushed with earlier destination.
+    HANDLE volume = INVALID_HANDLE_VALUE;    // <-- flushes all files and metadata at once, needs administrator rights.
+    HANDLE handle = INVALID_HANDLE_VALUE;    // <-- of directory, used with per-file flush when volume can't be opened.
+    bool parent_flushed = false;             // <-- with per-file flush: entry of directory itself.
+};
+
+struct DurableCommit {
+    DurableDestination destinations[EngineMaxDestinations];
+    int ndestinations = 0;
+    wchar_t** paths = nullptr; // <-- destination paths of objects, relative to destination directories.
+    wchar_t** suffixed_paths = nullptr;
+    const DWORD* suffixed = nullptr; // <-- bit N is set when object is at suffixed path in destination N.
+    int max_files = 64;
+    DWORD max_latency_ms = 10 * 1000;
+    int* batch = nullptr;
+    int nbatch = 0;
+    ULONGLONG batch_start_tick = 0;
+    int batches = 0;
+    int delete_count = 0;
+    int deleted = 0;
+};
+
+static HRESULT durable_commit_init(DurableCommit* commit, const wchar_t* const* destination_directories, int ndestinations, int max_files, int max_latency_seconds) {
+    wchar_t volume_path[MAX_PATH];
+
+    commit->ndestinations = ndestinations;
+    commit->max_files = max_files;
+    commit->max_latency_ms = (DWORD)max_latency_seconds * 1000;
+    commit->batch = new (std::nothrow) int[max_files];
+    if (!commit->batch) {
+        return E_OUTOFMEMORY;
+    }
+
+    for (int i = 0; i < ndestinations; ++i) {
+        auto& destination = commit->destinations[i];
+        destination.directory = destination_directories[i];
+
+        if (GetVolumePathNameW(destination.directory, volume_path, _countof(volume_path)) &&
+            wcslen(volume_path) == 3 && volume_path[1] == L':')
+        {
+            destination.volume_letter = towupper(volume_path[0]);
+            for (int j = 0; j < i; ++j) {
+                const auto& other = commit->destinations[j];
+                if (other.volume != INVALID_HANDLE_VALUE && other.volume_letter == destination.volume_letter) {
+                    destination.shares_volume = true;
+                }
+            }
+            if (!destination.shares_volume) {
+                wchar_t volume_name[] = L"\\\\.\\X:";
+                volume_name[4] = volume_path[0];
+                destination.volume = CreateFileW(volume_name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+            }
+        }
+
+        if (destination.volume == INVALID_HANDLE_VALUE && !destination.shares_volume) {
+            destination.handle = CreateFileW(destination.directory, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+            if (destination.handle == INVALID_HANDLE_VALUE) {
+                return HRESULT_FROM_WIN32(GetLastError());
+            }
+        }
+    }
+    return S_OK;
+}
+
+static void durable_commit_free(DurableCommit* commit) {
+    for (int i = 0; i < commit->ndestinations; ++i) {
+        auto& destination = commit->destinations[i];
+        if (destination.volume != INVALID_HANDLE_VALUE) CloseHandle(destination.volume);
+        if (destination.handle != INVALID_HANDLE_VALUE) CloseHandle(destination.handle);
+    }
+    delete[] commit->batch;
+    *commit = DurableCommit();
+}
+
+static bool durable_commit_is_due(const DurableCommit* commit) {
+    return commit->nbatch >= commit->max_files ||
+        (commit->nbatch > 0 && GetTickCount64() - commit->batch_start_tick >= commit->max_latency_ms);
+}
+
+// Flushes file, or directory if is_directory is set, at path relative to destination directory.
+static HRESULT flush_destination_file(const wchar_t* destination_directory, const wchar_t* name, bool is_directory) {
+    wchar_t* path = nullptr;
+    HRESULT hr = PathAllocCombine(destination_directory, name, PATHCCH_ALLOW_LONG_PATHS, &path);
+    if (FAILED(hr)) return hr;
+
+    HANDLE file = CreateFileW(path, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | (is_directory ? FILE_SHARE_DELETE : 0), nullptr, OPEN_EXISTING,
+        is_directory ? FILE_FLAG_BACKUP_SEMANTICS : FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE || !FlushFileBuffers(file)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    LocalFree(path);
+    return hr;
+}
+
+// Flushes directories between file and destination directory, which hold directory entries of new
+// files and directories. Directories flushed earlier in the batch are skipped.
+static HRESULT flush_destination_directories(StringMap* flushed, const wchar_t* destination_directory, const wchar_t* relative_path) {
+    wchar_t* directory = string_clone(relative_path);
+    if (!directory) return E_OUTOFMEMORY;
+
+    HRESULT hr = S_OK;
+    while (SUCCEEDED(hr)) {
+        wchar_t* separator = wcsrchr(directory, L'\\');
+        if (!separator) break;
+        *separator = L'\0';
+        if (string_map_find(flushed, directory)) break;
+
+        hr = flush_destination_file(destination_directory, directory, true);
+        if (SUCCEEDED(hr)) {
+            hr = string_map_set(flushed, directory, 0);
+        }
+    }
+
+    delete[] directory;
+    return hr;
+}
+
+// Marks objects of the batch which are not failed yet as failed.
+static void durable_commit_fail_batch(DeviceSession* session, DurableCommit* commit, DeviceObjectInformation* objects, HRESULT hr, const wchar_t* error_context) {
+    for (int k = 0; k < commit->nbatch; ++k) {
+        auto& object = objects[commit->batch[k]];
+        if (SUCCEEDED(object.hr)) {
+            object.hr = hr;
+            session_log(session, L"- [NOT DELETED] %s\n  - %s: %s\n", object.name, error_context, error_string(hr));
+        }
+    }
+}
+
+// Flushes files of the batch and deletes them from device. Files which failed to flush are not deleted.
+static void durable_commit_flush(DeviceSession* session, DurableCommit* commit, DeviceObjectInformation* objects, const RetryPolicy& policy, RetryStats* stats) {
+    if (commit->nbatch == 0) return;
+
+    for (int i = 0; i < commit->ndestinations; ++i) {
+        auto& destination = commit->destinations[i];
+        if (destination.shares_volume) continue;
+
+        if (destination.volume != INVALID_HANDLE_VALUE) {
+            if (!FlushFileBuffers(destination.volume)) {
+                durable_commit_fail_batch(session, commit, objects, HRESULT_FROM_WIN32(GetLastError()), L"Unable to flush destination volume");
+            }
+            continue;
+        }
+
+        StringMap flushed_directories;
+        for (int k = 0; k < commit->nbatch; ++k) {
+            auto& object = objects[commit->batch[k]];
+            int index = commit->batch[k];
+            const wchar_t* path = (commit->suffixed[index] & (1u << i)) ? commit->suffixed_paths[index] : commit->paths[index];
+            if (FAILED(object.hr)) continue;
+
+            HRESULT hr = flush_destination_file(destination.directory, path, false);
+            if (FAILED(hr)) {
+                object.hr = hr;
+                session_log(session, L"- [NOT DELETED] %s\n  - %s: %s\n", object.name, L"Unable to flush destination file", error_string(hr));
+                continue;
+            }
+            hr = flush_destination_directories(&flushed_directories, destination.directory, path);
+            if (FAILED(hr)) {
+                object.hr = hr;
+                session_log(session, L"- [NOT DELETED] %s\n  - %s: %s\n", object.name, L"Unable to flush destination directory", error_string(hr));
+            }
+        }
+        string_map_free(&flushed_directories);
+
+        // Directory entries of new files.
+        if (!FlushFileBuffers(destination.handle)) {
+            durable_commit_fail_batch(session, commit, objects, HRESULT_FROM_WIN32(GetLastError()), L"Unable to flush destination directory");
+        }
+
+        // Destination directory may be new too (subdirectory of device when several devices are copied),
+        // its entry is in parent directory. It's created before copying starts, so flushing it once is enough.
+        if (!destination.parent_flushed) {
+            HRESULT hr = flush_destination_file(destination.directory, L"..", true);
+            if (FAILED(hr)) {
+                durable_commit_fail_batch(session, commit, objects, hr, L"Unable to flush parent of destination directory");
+            } else {
+                destination.parent_flushed = true;
+            }
+        }
+    }
+
+    int delete_count = 0;
+    int deleted = delete_device_objects(session, objects, commit->batch, commit->nbatch, policy, stats, &delete_count);
+    session_log_verbose(session, L"Committed batch of %d files, deleted %d of %d from device.\n", commit->nbatch, deleted, delete_count);
+
+    ++commit->batches;
+    commit->delete_count += delete_count;
+    commit->deleted += deleted;
+    commit->nbatch = 0;
+}
+
+// Copies objects to destination directories. Objects which failed with transient error are put at the end
+// of the queue and retried after backoff delay, so one flaky object doesn't hold up the rest of the batch.
+// Result of every object is stored in DeviceObjectInformation::hr, it succeeds once it's in every destination.
+// Number of objects written into every destination is added to destination_copied.
+// If commit is set, copied objects are flushed and deleted from device in batches.
+// If ledger is set, copied objects are recorded in it, and objects found in it are skipped with skip_ingested.
+static int copy_device_objects(DeviceSession* session, DeviceObjectInformation* objects, int nobjects, const EngineCopyOptions& options, const RetryPolicy& policy, RetryStats* stats, DurableCommit* commit, Ledger* ledger, int* destination_copied) {
+    int success_count = 0;
+    int* pending = new (std::nothrow) int[nobjects];
+    int* next_pending = new (std::nothrow) int[nobjects];
+    DWORD* written = new (std::nothrow) DWORD[nobjects]; // <-- bit N is set when object is in destination N.
+    DWORD* suffixed = new (std::nothrow) DWORD[nobjects]; // <-- bit N is set when object is at suffixed path in destination N.
+    int npending = 0;
+    wchar_t** paths = nullptr;
+    wchar_t** suffixed_paths = nullptr;
+    StringMap created_directories[EngineMaxDestinations];
+
+    HRESULT paths_hr = build_destination_paths(objects, nobjects, options.layout, options.device_name, &paths, &suffixed_paths);
+    if (!pending || !next_pending || !written || !suffixed || FAILED(paths_hr)) {
+        HRESULT hr = FAILED(paths_hr) ? paths_hr : E_OUTOFMEMORY;
+        for (int i = 0; i < nobjects; ++i) {
+            objects[i].hr = hr;
+            session_log(session, L"- [FAILED] %s\n  - %s: %s\n", objects[i].name, L"Unable to create copy queue", error_string(hr));
+        }
+        free_destination_paths(paths, suffixed_paths, nobjects);
+        delete[] pending;
+        delete[] next_pending;
+        delete[] written;
+        delete[] suffixed;
+        return 0;
+    }
+    if (commit) {
+        commit->paths = paths;
+        commit->suffixed_paths = suffixed_paths;
+        commit->suffixed = suffixed;
+    }
+
+    for (int i = 0; i < nobjects; ++i) {
+        objects[i].attempts = 0;
+        written[i] = 0;
+        suffixed[i] = 0;
+        if (options.skip_ingested && ledger && ledger_contains(ledger, session->device_id, objects[i])) {
+            objects[i].hr = ENGINE_S_SKIPPED;
+            session_object_done(session, true);
+            session_log_verbose(session, L"- [SKIPPED] %s\n", objects[i].name);
+            continue;
+        }
+        pending[npending++] = i;
+    }
+
+    while (npending > 0) {
+        int nnext_pending = 0;
+
+        for (int k = 0; k < npending; ++k) {
+            auto& object = objects[pending[k]];
+            const wchar_t* error_context = nullptr;
+
+            if (is_cancelled(session->cancelled)) {
+                object.hr = HRESULT_FROM_WIN32(ERROR_CANCELLED);
+                session_object_done(session, false);
+                continue;
+            }
+
+            // Batch doesn't wait for its deadline longer because of next object or its retry delay.
+            if (commit && durable_commit_is_due(commit)) {
+                durable_commit_flush(session, commit, objects, policy, stats);
+            }
+            ULONGLONG now = GetTickCount64();
+            if (object.retry_not_before > now) {
+                ULONGLONG batch_deadline = commit && commit->nbatch > 0 ? commit->batch_start_tick + commit->max_latency_ms : 0;
+                if (batch_deadline && batch_deadline < object.retry_not_before) {
+                    if (batch_deadline > now) Sleep((DWORD)(batch_deadline - now));
+                    durable_commit_flush(session, commit, objects, policy, stats);
+                    now = GetTickCount64();
+                }
+                if (object.retry_not_before > now) {
+                    Sleep((DWORD)(object.retry_not_before - now));
+                }
+            }
+
+            ++object.attempts;
+            if (object.attempts > 1) {
+                ++stats->retries;
+            }
+
+            const wchar_t* path = paths[pending[k]];
+            CopyDestination destinations[EngineMaxDestinations];
+            int ndestinations = 0;
+            HRESULT hr = S_OK;
+            bool destination_error = false; // <-- hr is of destination file, not of device.
+            if (!path) {
+                hr = E_INVALIDARG;
+                error_context = L"Cannot build destination path from layout";
+            } else {
+                for (int i = 0; i < options.ndestinations; ++i) {
+                    if (written[pending[k]] & (1u << i)) continue;
+                    auto& destination = destinations[ndestinations++];
+                    destination.index = i;
+                    destination.directory = options.destination_directories[i];
+                    HRESULT directory_hr = create_destination_directories(&created_directories[i], destination.directory, path);
+                    if (FAILED(directory_hr)) {
+                        fail_destination(&destination, directory_hr, L"Unable to create destination directory");
+                    }
+                }
+            }
+            if (SUCCEEDED(hr)) {
+                hr = ensure_device_session(session, stats);
+                if (FAILED(hr)) {
+                    error_context = session->error_context;
+                } else {
+                    hr = copy_device_object(session, object, destinations, ndestinations, path, suffixed_paths[pending[k]], options.append, options.read_streams, &error_context);
+                    destination_error = FAILED(hr) && !has_live_destinations(destinations, ndestinations);
+                }
+            }
+
+            // Object is done in destinations which didn't fail, and fails with error of the first one which did.
+            if (SUCCEEDED(hr)) {
+                for (int i = 0; i < ndestinations; ++i) {
+                    if (destinations[i].failed) continue;
+                    written[pending[k]] |= 1u << destinations[i].index;
+                    if (destinations[i].suffixed) suffixed[pending[k]] |= 1u << destinations[i].index;
+                    ++destination_copied[destinations[i].index];
+                }
+                hr = get_destination_error(destinations, ndestinations, &error_context);
+                destination_error = FAILED(hr);
+            }
+
+            if (FAILED(hr)) {
+                ErrorClass error_class = destination_error ? classify_destination_error(hr) : classify_error(hr);
+                if (error_class == ErrorClass_Disconnected) {
+                    close_device_session(session, false);
+                }
+                if (error_class != ErrorClass_Permanent && object.attempts < policy.max_attempts) {
+                    session_log_verbose(session, L"- [RETRY] %s\n  - %s: %s\n", object.name, error_context, error_string(hr));
+                    object.retry_not_before = GetTickCount64() + retry_delay_ms(policy, object.attempts);
+                    next_pending[nnext_pending++] = pending[k];
+                    continue;
+                }
+            }
+
+            object.hr = hr;
+            session_object_done(session, SUCCEEDED(hr));
+            if (SUCCEEDED(hr)) {
+                if (object.attempts > 1) ++stats->recovered;
+                const wchar_t* written_path = suffixed[pending[k]] ? suffixed_paths[pending[k]] : path;
+                if (0 == wcscmp(written_path, object.name)) {
+                    session_log_verbose(session, L"- [OK] %s\n", object.name);
+                } else {
+                    session_log_verbose(session, L"- [OK] %s -> %s\n", object.name, written_path);
+                }
+                ++success_count;
+
+                if (ledger) {
+                    HRESULT ledger_hr = ledger_add(ledger, session->device_id, object);
+                    if (FAILED(ledger_hr)) {
+                        session_log(session, L"- [NOT RECORDED] %s\n  - %s: %s\n", object.name, L"Unable to add file to transfer ledger", error_string(ledger_hr));
+                    }
+                }
+
+                if (commit) {
+                    if (commit->nbatch == 0) commit->batch_start_tick = GetTickCount64();
+                    commit->batch[commit->nbatch++] = pending[k];
+                }
+            } else if (object.attempts > 1) {
+                session_log(session, L"- [FAILED] %s\n  - %s: %s (after %d attempts)\n", object.name, error_context, error_string(hr), object.attempts);
+            } else {
+                session_log(session, L"- [FAILED] %s\n  - %s: %s\n", object.name, error_context, error_string(hr));
+            }
+            if (FAILED(hr) && options.ndestinations > 1) {
+                for (int i = 0; i < options.ndestinations; ++i) {
+                    if (!(written[pending[k]] & (1u << i))) {
+                        session_log(session, L"  - Missing from \"%s\"\n", options.destination_directories[i]);
+                    }
+                }
+            }
+
+            if (commit && durable_commit_is_due(commit)) {
+                durable_commit_flush(session, commit, objects, policy, stats);
+            }
+        }
+
+        int* swap = pending;
+        pending = next_pending;
+        next_pending = swap;
+        npending = nnext_pending;
+    }
+
+    if (commit) {
+        durable_commit_flush(session, commit, objects, policy, stats);
+        commit->paths = nullptr;
+        commit->suffixed_paths = nullptr;
+        commit->suffixed = nullptr;
+    }
+
+    free_destination_paths(paths, suffixed_paths, nobjects);
+    for (int i = 0; i < options.ndestinations; ++i) string_map_free(&created_directories[i]);
+    delete[] pending;
+    delete[] next_pending;
+    delete[] written;
+    delete[] suffixed;
+    return success_count;
+}
+
+// --- Engine API ---
+
+struct Engine {
+    RetryPolicy retry_policy;
+    DiskScheduler disk_scheduler;
+    bool limit_disk_writers = false;
+    wchar_t* catalog_directory = nullptr;
+    CO_MTA_USAGE_COOKIE mta_usage = nullptr;
+    DWORD call_timeouts_ms[DeviceCall_Count] = {};
+    LONG volatile simulate_hang = -1;
+
+    SRWLOCK devices_lock = SRWLOCK_INIT; // <-- protects device list, which is walked by watchdog.
+    EngineDevice* devices = nullptr;
+    HANDLE watchdog_thread = nullptr;
+    HANDLE watchdog_stop = nullptr;
+
+    wchar_t* ledger_path = nullptr; // <-- nullptr = default path.
+    SRWLOCK ledger_lock = SRWLOCK_INIT;
+    bool ledger_opened = false; // <-- ledger is opened by first copy and stays open, failure is not retried.
+    HRESULT ledger_hr = E_FAIL;
+    Ledger ledger;
+};
+
+static Ledger* get_engine_ledger(Engine* engine, HRESULT* out_hr) {
+    AcquireSRWLockExclusive(&engine->ledger_lock);
+    if (!engine->ledger_opened) {
+        engine->ledger_opened = true;
+        wchar_t* default_path = nullptr;
+        engine->ledger_hr = engine->ledger_path ? S_OK : get_tool_data_path(L"ledger.dat", &default_path);
+        if (SUCCEEDED(engine->ledger_hr)) {
+            engine->ledger_hr = ledger_open(engine->ledger_path ? engine->ledger_path : default_path, &engine->ledger);
+        }
+        delete[] default_path;
+    }
+    ReleaseSRWLockExclusive(&engine->ledger_lock);
+
+    *out_hr = engine->ledger_hr;
+    return SUCCEEDED(engine->ledger_hr) ? &engine->ledger : nullptr;
+}
+
+// Directory resolved by path. Resolving walks device folders one level at a time, which is slow
+// on big devices, so device keeps recent results while the session that produced them is open.
+struct ResolvedPath {
+    wchar_t* path = nullptr;
+    wchar_t* object_id = nullptr;
+    int generation = 0;
+};
+
+const int ResolvedPathCacheSize = 16;
+
+struct EngineDevice {
+    Engine* engine = nullptr;
+    SRWLOCK lock = SRWLOCK_INIT; // <-- held by running operation, session is not thread-safe.
+    DeviceSession session;
+    bool connected = false;
+    ResolvedPath resolved_paths[ResolvedPathCacheSize]; // <-- protected by lock.
+    int next_resolved_path = 0;
+    EngineDevice* next = nullptr; // <-- in engine's device list.
+};
+
+static void free_resolved_path(ResolvedPath* entry) {
+    delete[] entry->path;
+    delete[] entry->object_id;
+    *entry = ResolvedPath();
+}
+
+// Returns cached object id of directory, it's owned by cache. Returns nullptr if path is not cached.
+static const wchar_t* find_resolved_path(EngineDevice* device, const wchar_t* path) {
+    for (int i = 0; i < ResolvedPathCacheSize; ++i) {
+        ResolvedPath* entry = &device->resolved_paths[i];
+        if (!entry->path) continue;
+        if (entry->generation != device->session.generation) {
+            free_resolved_path(entry);
+            continue;
+        }
+        if (0 == _wcsicmp(entry->path, path)) {
+            return entry->object_id;
+        }
+    }
+    return nullptr;
+}
+
+static void forget_resolved_path(EngineDevice* device, const wchar_t* path) {
+    for (int i = 0; i < ResolvedPathCacheSize; ++i) {
+        ResolvedPath* entry = &device->resolved_paths[i];
+        if (entry->path && 0 == _wcsicmp(entry->path, path)) {
+            free_resolved_path(entry);
+        }
+    }
+}
+
+// Oldest entry is replaced when cache is full. Failing to allocate only means path is not cached.
+static void cache_resolved_path(EngineDevice* device, const wchar_t* path, const wchar_t* object_id) {
+    forget_resolved_path(device, path);
+    ResolvedPath* entry = &device->resolved_paths[device->next_resolved_path];
+    device->next_resolved_path = (device->next_resolved_path + 1) % ResolvedPathCacheSize;
+    free_resolved_path(entry);
+
+    entry->path = string_clone(path);
+    entry->object_id = string_clone(object_id);
+    entry->generation = device->session.generation;
+    if (!entry->path || !entry->object_id) {
+        free_resolved_path(entry);
+    }
+}
+
+enum EngineOperationType {
+    EngineOperation_Resolve,
+    EngineOperation_List,
+    EngineOperation_Copy,
+    EngineOperation_Delete,
+    EngineOperation_RefreshCatalog,
+    EngineOperation_Usage,
+};
+
+struct EngineOperation {
+    EngineDevice* device = nullptr;
+    EngineOperationType type = EngineOperation_Resolve;
+    EngineCallbacks callbacks;
+    LONG volatile cancelled = 0;
+    HANDLE thread = nullptr;
+
+    wchar_t* path = nullptr;  // Resolve, list.
+    ObjectFilter filter;      // List, match string is owned.
+    DeviceObjectInformation* objects = nullptr; // Copy, delete: not owned.
+    int nobjects = 0;
+    EngineCopyOptions copy_options; // Copy, strings are owned.
+    EngineUsageOptions usage_options; // Usage.
+
+    EngineResult result;
+};
+
+static DWORD WINAPI watchdog_thread_proc(void* userdata) {
+    auto engine = (Engine*)userdata;
+    while (WaitForSingleObject(engine->watchdog_stop, WatchdogIntervalMs) == WAIT_TIMEOUT) {
+        ULONGLONG now = GetTickCount64();
+        AcquireSRWLockShared(&engine->devices_lock);
+        for (EngineDevice* device = engine->devices; device; device = device->next) {
+            watchdog_check_session(&device->session, now);
+        }
+        ReleaseSRWLockShared(&engine->devices_lock);
+    }
+    return 0;
+}
+
+HRESULT engine_create(const EngineSettings& settings, Engine** out_engine) {
+    *out_engine = nullptr;
+
+    Engine* engine = new (std::nothrow) Engine();
+    if (!engine) return E_OUTOFMEMORY;
+
+    // Device sessions outlive operation threads, multithreaded apartment must stay alive between operations.
+    HRESULT hr = CoIncrementMTAUsage(&engine->mta_usage);
+    if (FAILED(hr)) {
+        delete engine;
+        return hr;
+    }
+
+    engine->retry_policy.max_attempts = 1 + (settings.retries < 0 ? 0 : settings.retries < EngineMaxRetries ? settings.retries : EngineMaxRetries);
+    engine->limit_disk_writers = settings.disk_writers > 0;
+    engine->disk_scheduler.max_writers = settings.disk_writers;
+    if (settings.catalog_directory) {
+        engine->catalog_directory = string_clone(settings.catalog_directory);
+        if (!engine->catalog_directory) {
+            engine_destroy(engine);
+            return E_OUTOFMEMORY;
+        }
+    }
+    if (settings.ledger_path) {
+        engine->ledger_path = string_clone(settings.ledger_path);
+        if (!engine->ledger_path) {
+            engine_destroy(engine);
+            return E_OUTOFMEMORY;
+        }
+    }
+
+    for (int i = 0; i < DeviceCall_Count; ++i) {
+        engine->call_timeouts_ms[i] = settings.call_timeouts_ms[i];
+    }
+    engine->simulate_hang = settings.simulate_hang;
+    engine->watchdog_stop = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (engine->watchdog_stop) {
+        engine->watchdog_thread = CreateThread(nullptr, 0, watchdog_thread_proc, engine, 0, nullptr);
+    }
+    if (!engine->watchdog_thread) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        engine_destroy(engine);
+        return hr;
+    }
+
+    *out_engine = engine;
+    return S_OK;
+}
+
+void engine_destroy(Engine* engine) {
+    if (!engine) return;
+    assert(!engine->devices);
+    if (engine->watchdog_thread) {
+        SetEvent(engine->watchdog_stop);
+        WaitForSingleObject(engine->watchdog_thread, INFINITE);
+        CloseHandle(engine->watchdog_thread);
+    }
+    if (engine->watchdog_stop) {
+        CloseHandle(engine->watchdog_stop);
+    }
+    if (engine->mta_usage) {
+        CoDecrementMTAUsage(engine->mta_usage);
+    }
+    ledger_close(&engine->ledger);
+    delete[] engine->ledger_path;
+    delete[] engine->catalog_directory;
+    delete engine;
+}
+
+void engine_free_devices(PortableDeviceInformation* devices, int ndevices) {
+    if (!devices) return;
+    for (int i = 0; i < ndevices; ++i) {
+        delete[] devices[i].id;
+        delete[] devices[i].friendly_name;
+        delete[] devices[i].description;
+    }
+    delete[] devices;
+}
+
+void engine_free_objects(DeviceObjectInformation* objects, int nobjects) {
+    if (!objects) return;
+    for (int i = 0; i < nobjects; ++i) {
+        delete[] objects[i].id;
+        delete[] objects[i].name;
+        delete[] objects[i].persistent_id;
+    }
+    delete[] objects;
+}
+
+HRESULT engine_open_device(Engine* engine, const wchar_t* device_id, EngineDevice** out_device) {
+    *out_device = nullptr;
+
+    EngineDevice* device = new (std::nothrow) EngineDevice();
+    if (!device) return E_OUTOFMEMORY;
+
+    device->engine = engine;
+    device->session.device_id = string_clone(device_id);
+    if (!device->session.device_id) {
+        delete device;
+        return E_OUTOFMEMORY;
+    }
+
+    for (int i = 0; i < DeviceCallWatchCount; ++i) {
+        device->session.call_watches[i].event = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+        if (!device->session.call_watches[i].event) {
+            HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+            for (int k = 0; k < i; ++k) {
+                CloseHandle(device->session.call_watches[k].event);
+            }
+            delete[] device->session.device_id;
+            delete device;
+            return hr;
+        }
+    }
+    device->session.call_timeouts_ms = engine->call_timeouts_ms;
+    device->session.simulate_hang = &engine->simulate_hang;
+
+    if (engine->limit_disk_writers) {
+        device->session.disk_client = disk_scheduler_register(&engine->disk_scheduler);
+        if (device->session.disk_client >= 0) {
+            device->session.disk_scheduler = &engine->disk_scheduler;
+        }
+    }
+
+    AcquireSRWLockExclusive(&engine->devices_lock);
+    device->next = engine->devices;
+    engine->devices = device;
+    ReleaseSRWLockExclusive(&engine->devices_lock);
+
+    *out_device = device;
+    return S_OK;
+}
+
+void engine_close_device(EngineDevice* device) {
+    if (!device) return;
+
+    Engine* engine = device->engine;
+    AcquireSRWLockExclusive(&engine->devices_lock);
+    for (EngineDevice** link = &engine->devices; *link; link = &(*link)->next) {
+        if (*link == device) {
+            *link = device->next;
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&engine->devices_lock);
+
+    // Interfaces are released on helper thread in multithreaded apartment, caller may be in single-threaded one.
+    close_device_session(&device->session, false);
+
+    for (int i = 0; i < ResolvedPathCacheSize; ++i) {
+        free_resolved_path(&device->resolved_paths[i]);
+    }
+    for (int i = 0; i < DeviceCallWatchCount; ++i) {
+        CloseHandle(device->session.call_watches[i].event);
+    }
+    delete[] device->session.device_id;
+    delete device;
+}
+
+static void engine_operation_log(EngineOperation* operation, const wchar_t* format, ...) {
+    if (!operation->callbacks.message) return;
+    wchar_t text[1024];
+    va_list args;
+    va_start(args, format);
+    if (_vsnwprintf_s(text, _countof(text), _TRUNCATE, format, args) < 0) {
+        text[_countof(text) - 2] = L'\n';
+    }
+    va_end(args);
+    operation->callbacks.message(operation->callbacks.userdata, text);
+}
+
+static HRESULT run_engine_operation(EngineOperation* operation) {
+    EngineDevice* device = operation->device;
+    DeviceSession* session = &device->session;
+    const RetryPolicy& policy = device->engine->retry_policy;
+    EngineResult* result = &operation->result;
+    wchar_t* directory_object_id = nullptr;
+    wchar_t* catalog_path = nullptr;
+    DurableCommit durable_commit;
+    HRESULT hr = E_FAIL;
+
+    // Connect to device, or reconnect if it was lost between operations.
+    hr = retry_device_operation(session, policy, &result->retry_stats, []() { return S_OK; });
+    if (FAILED(hr)) {
+        if (hr != HRESULT_FROM_WIN32(ERROR_CANCELLED)) {
+            session_log(session, L"%s: %s\n", session->error_context ? session->error_context : L"Unable to connect to device", error_string(hr));
+        }
+        goto quit;
+    }
+    if (!device->connected) {
+        result->retry_stats.reopens = 0; // Don't count initial connection.
+        device->connected = true;
+    }
+
+    switch (operation->type) {
+        case EngineOperation_Resolve:
+        case EngineOperation_List:
+        case EngineOperation_Usage: {
+            auto resolve = [&]() {
+                delete[] directory_object_id;
+                directory_object_id = nullptr;
+                HRESULT hr = retry_device_operation(session, policy, &result->retry_stats, [&]() {
+                    delete[] directory_object_id;
+                    return find_device_object_by_path(session->content, session->properties, operation->path, &directory_object_id);
+                });
+                if (SUCCEEDED(hr)) {
+                    cache_resolved_path(device, operation->path, directory_object_id);
+                }
+                return hr;
+            };
+            auto enumerate = [&]() {
+                return retry_device_operation(session, policy, &result->retry_stats, [&]() {
+                    if (operation->type == EngineOperation_Usage) {
+                        return walk_device_usage(session, policy, directory_object_id, operation->usage_options, &result->retry_stats, result->call_stats, &result->usage);
+                    }
+                    return enumerate_device_objects(session->content, session->properties, directory_object_id, &result->objects, &result->nobjects, &operation->cancelled, &operation->filter, [](const DeviceObjectMetadata& metadata, void* userdata) {
+                        return object_filter_accepts(*(const ObjectFilter*)userdata, metadata);
+                    });
+                });
+            };
+
+            bool cached = false;
+            if (operation->path && operation->path[0]) {
+                const wchar_t* cached_object_id = find_resolved_path(device, operation->path);
+                if (cached_object_id) {
+                    directory_object_id = string_clone(cached_object_id);
+                    hr = directory_object_id ? S_OK : E_OUTOFMEMORY;
+                    cached = true;
+                } else {
+                    hr = resolve();
+                }
+            } else {
+                directory_object_id = string_clone(WPD_DEVICE_OBJECT_ID);
+                hr = directory_object_id ? S_OK : E_OUTOFMEMORY;
+            }
+            if (FAILED(hr)) {
+                session_log(session, L"Unable to get source directory on the device: %s\n", error_string(hr));
+                goto quit;
+            }
+
+            if (operation->type == EngineOperation_Resolve) {
+                result->object_id = directory_object_id;
+                directory_object_id = nullptr;
+                break;
+            }
+
+            hr = enumerate();
+            if (FAILED(hr) && cached && hr != HRESULT_FROM_WIN32(ERROR_CANCELLED)) {
+                // Cached directory may be gone since it was resolved.
+                forget_resolved_path(device, operation->path);
+                hr = resolve();
+                if (SUCCEEDED(hr)) {
+                    hr = enumerate();
+                }
+            }
+            if (FAILED(hr)) {
+                session_log(session, L"Unable to enumerate device objects: %s\n", error_string(hr));
+                goto quit;
+            }
+        } break;
+
+        case EngineOperation_Copy: {
+            const EngineCopyOptions& options = operation->copy_options;
+            bool durable = options.durable_move;
+
+            HRESULT ledger_hr = S_OK;
+            Ledger* ledger = get_engine_ledger(device->engine, &ledger_hr);
+            if (!ledger) {
+                // Without ledger every object would be copied again, which is not what skip_ingested asks for.
+                if (options.skip_ingested) {
+                    hr = ledger_hr;
+                    session_log(session, L"Unable to open transfer ledger: %s\n", error_string(hr));
+                    goto quit;
+                }
+                session_log(session, L"Unable to open transfer ledger, copied files are not recorded: %s\n", error_string(ledger_hr));
+            }
+            if (durable) {
+                hr = durable_commit_init(&durable_commit, options.destination_directories, options.ndestinations, options.commit_batch_files, options.commit_batch_seconds);
+                if (FAILED(hr)) {
+                    session_log(session, L"Unable to prepare destination directory for durable move: %s\n", error_string(hr));
+                    goto quit;
+                }
+            }
+
+            LONG64 bytes_before = session->bytes_copied;
+            LONG64 reused_before = session->bytes_reused;
+            int appended_before = session->files_appended;
+            result->succeeded = copy_device_objects(session, operation->objects, operation->nobjects, options, policy, &result->retry_stats, durable ? &durable_commit : nullptr, ledger, result->destination_copied);
+            for (int i = 0; i < operation->nobjects; ++i) {
+                if (operation->objects[i].hr == ENGINE_S_SKIPPED) ++result->skipped;
+            }
+            if (ledger) {
+                ledger_hr = ledger_flush(ledger);
+                if (FAILED(ledger_hr)) {
+                    session_log(session, L"Unable to flush transfer ledger: %s\n", error_string(ledger_hr));
+                }
+            }
+            result->bytes_copied = session->bytes_copied - bytes_before;
+            result->bytes_reused = session->bytes_reused - reused_before;
+            result->files_appended = session->files_appended - appended_before;
+            result->durable_batches = durable_commit.batches;
+            result->durable_deleted = durable_commit.deleted;
+            result->durable_attempted = durable_commit.delete_count;
+            hr = is_cancelled(&operation->cancelled) ? HRESULT_FROM_WIN32(ERROR_CANCELLED) : S_OK;
+        } break;
+
+        case EngineOperation_Delete: {
+            result->succeeded = delete_device_objects(session, operation->objects, nullptr, operation->nobjects, policy, &result->retry_stats, &result->attempted);
+            hr = is_cancelled(&operation->cancelled) ? HRESULT_FROM_WIN32(ERROR_CANCELLED) : S_OK;
+        } break;
+
+        case EngineOperation_RefreshCatalog: {
+            hr = get_catalog_path(device->engine->catalog_directory, session->device_id, &catalog_path);
+            if (FAILED(hr)) {
+                session_log(session, L"Unable to get catalog path: %s\n", error_string(hr));
+                goto quit;
+            }
+
+            hr = retry_device_operation(session, policy, &result->retry_stats, [&]() {
+                return refresh_device_catalog(session->content, session->properties, session->device_id, catalog_path, &operation->cancelled, &result->catalog_stats);
+            });
+            if (FAILED(hr)) {
+                session_log(session, L"Unable to refresh catalog \"%s\": %s\n", catalog_path, error_string(hr));
+                goto quit;
+            }
+        } break;
+    }
+
+    quit:
+    delete[] directory_object_id;
+    delete[] catalog_path;
+    durable_commit_free(&durable_commit);
+    return hr;
+}
+
+static DWORD WINAPI engine_operation_thread_proc(void* userdata) {
+    auto operation = (EngineOperation*)userdata;
+    EngineDevice* device = operation->device;
+
+    HRESULT hr = CoInitializeEx(0, COINIT_MULTITHREADED | COINIT_SPEED_OVER_MEMORY | COINIT_DISABLE_OLE1DDE);
+    if (FAILED(hr)) {
+        engine_operation_log(operation, L"CoInitializeEx failed: %s\n", error_string(hr));
+    } else {
+        AcquireSRWLockExclusive(&device->lock);
+        device->session.callbacks = &operation->callbacks;
+        device->session.cancelled = &operation->cancelled;
+        watch_device_calls(&device->session, 0, operation->result.call_stats);
+
+        hr = run_engine_operation(operation);
+
+        unwatch_device_calls();
+        device->session.callbacks = nullptr;
+        device->session.cancelled = nullptr;
+        ReleaseSRWLockExclusive(&device->lock);
+        CoUninitialize();
+    }
+
+    operation->result.hr = hr;
+    if (operation->callbacks.completed) {
+        operation->callbacks.completed(operation->callbacks.userdata, operation);
+    }
+    return 0;
+}
+
+static void free_engine_operation(EngineOperation* operation) {
+    if (operation->thread) CloseHandle(operation->thread);
+    delete[] operation->path;
+    delete[] (wchar_t*)operation->filter.match;
+    for (int i = 0; i < operation->copy_options.ndestinations; ++i) {
+        delete[] (wchar_t*)operation->copy_options.destination_directories[i];
+    }
+    delete[] (wchar_t*)operation->copy_options.layout;
+    delete[] (wchar_t*)operation->copy_options.device_name;
+    delete[] operation->result.object_id;
+    engine_free_objects(operation->result.objects, operation->result.nobjects);
+    free_usage_report(&operation->result.usage);
+    delete operation;
+}
+
+static HRESULT start_engine_operation(EngineOperation* operation, EngineOperation** out_operation) {
+    operation->thread = CreateThread(nullptr, 0, engine_operation_thread_proc, operation, 0, nullptr);
+    if (!operation->thread) {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+        free_engine_operation(operation);
+        *out_operation = nullptr;
+        return hr;
+    }
+    *out_operation = operation;
+    return S_OK;
+}
+
+static EngineOperation* create_engine_operation(EngineDevice* device, EngineOperationType type, const EngineCallbacks& callbacks) {
+    EngineOperation* operation = new (std::nothrow) EngineOperation();
+    if (operation) {
+        operation->device = device;
+        operation->type = type;
+        operation->callbacks = callbacks;
+    }
+    return operation;
+}
+
+HRESULT engine_resolve(EngineDevice* device, const wchar_t* path, const EngineCallbacks& callbacks, EngineOperation** out_operation) {
+    *out_operation = nullptr;
+    EngineOperation* operation = create_engine_operation(device, EngineOperation_Resolve, callbacks);
+    if (!operation) return E_OUTOFMEMORY;
+
+    if (path) {
+        operation->path = string_clone(path);
+        if (!operation->path) {
+            free_engine_operation(operation);
+            return E_OUTOFMEMORY;
+        }
+    }
+    return start_engine_operation(operation, out_operation);
+}
+
+HRESULT engine_list(EngineDevice* device, const wchar_t* directory, const ObjectFilter& filter, const EngineCallbacks& callbacks, EngineOperation** out_operation) {
+    *out_operation = nullptr;
+    EngineOperation* operation = create_engine_operation(device, EngineOperation_List, callbacks);
+    if (!operation) return E_OUTOFMEMORY;
+
+    operation->filter = filter;
+    operation->filter.match = string_clone(filter.match);
+    operation->path = string_clone(directory);
+    if ((filter.match && !operation->filter.match) || (directory && !operation->path)) {
+        free_engine_operation(operation);
+        return E_OUTOFMEMORY;
+    }
+    return start_engine_operation(operation, out_operation);
+}
+
+HRESULT engine_copy(EngineDevice* device, DeviceObjectInformation* objects, int nobjects, const EngineCopyOptions& options, const EngineCallbacks& callbacks, EngineOperation** out_operation) {
+    *out_operation = nullptr;
+    if (options.ndestinations < 1 || options.ndestinations > EngineMaxDestinations ||
+        (options.durable_move && options.commit_batch_files < 1) ||
+        (options.layout && FAILED(engine_validate_layout(options.layout))))
+    {
+        return E_INVALIDARG;
+    }
+    for (int i = 0; i < options.ndestinations; ++i) {
+        if (!options.destination_directories[i]) return E_INVALIDARG;
+    }
+
+    EngineOperation* operation = create_engine_operation(device, EngineOperation_Copy, callbacks);
+    if (!operation) return E_OUTOFMEMORY;
+
+    operation->objects = objects;
+    operation->nobjects = nobjects;
+    operation->copy_options = options;
+    bool destinations_cloned = true;
+    for (int i = 0; i < options.ndestinations; ++i) {
+        operation->copy_options.destination_directories[i] = string_clone(options.destination_directories[i]);
+        if (!operation->copy_options.destination_directories[i]) destinations_cloned = false;
+    }
+    operation->copy_options.layout = options.layout ? string_clone(options.layout) : nullptr;
+    operation->copy_options.device_name = options.device_name ? string_clone(options.device_name) : nullptr;
+    if (!destinations_cloned ||
+        (options.layout && !operation->copy_options.layout) ||
+        (options.device_name && !operation->copy_options.device_name))
+    {
+        free_engine_operation(operation);
+        return E_OUTOFMEMORY;
+    }
+    return start_engine_operation(operation, out_operation);
+}
+
+HRESULT engine_delete(EngineDevice* device, DeviceObjectInformation* objects, int nobjects, const EngineCallbacks& callbacks, EngineOperation** out_operation) {
+    *out_operation = nullptr;
+    EngineOperation* operation = create_engine_operation(device, EngineOperation_Delete, callbacks);
+    if (!operation) return E_OUTOFMEMORY;
+
+    operation->objects = objects;
+    operation->nobjects = nobjects;
+    return start_engine_operation(operation, out_operation);
+}
+
+HRESULT engine_refresh_catalog(EngineDevice* device, const EngineCallbacks& callbacks, EngineOperation** out_operation) {
+    *out_operation = nullptr;
+    EngineOperation* operation = create_engine_operation(device, EngineOperation_RefreshCatalog, callbacks);
+    if (!operation) return E_OUTOFMEMORY;
+    return start_engine_operation(operation, out_operation);
+}
+
+HRESULT engine_usage(EngineDevice* device, const wchar_t* directory, const EngineUsageOptions& options, const EngineCallbacks& callbacks, EngineOperation** out_operation) {
+    *out_operation = nullptr;
+    EngineOperation* operation = create_engine_operation(device, EngineOperation_Usage, callbacks);
+    if (!operation) return E_OUTOFMEMORY;
+
+    operation->usage_options = options;
+    operation->path = string_clone(directory);
+    if (directory && !operation->path) {
+        free_engine_operation(operation);
+        return E_OUTOFMEMORY;
+    }
+    return start_engine_operation(operation, out_operation);
+}
+
+HRESULT engine_enumerate_catalogs(const wchar_t* catalog_directory, PortableDeviceInformation** out_devices, int* out_ndevices) {
+    wchar_t* directory = nullptr;
+    wchar_t* pattern = nullptr;
+    WIN32_FIND_DATAW find_data;
+    HANDLE find = INVALID_HANDLE_VALUE;
+    PortableDeviceInformation* devices = nullptr;
+    int ndevices = 0;
+    int capacity = 0;
+    *out_devices = nullptr;
+    *out_ndevices = 0;
+
+    HRESULT hr = get_catalog_directory(catalog_directory, &directory);
+    if (FAILED(hr)) goto quit;
+
+    pattern = string_format(L"%s\\*.catalog", directory);
+    if (!pattern) {
+        hr = E_OUTOFMEMORY;
+        goto quit;
+    }
+
+    find = FindFirstFileW(pattern, &find_data);
+    if (find == INVALID_HANDLE_VALUE) {
+        hr = GetLastError() == ERROR_FILE_NOT_FOUND ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+        goto quit;
+    }
+
+    do {
+        if (ndevices == capacity) {
+            int new_capacity = capacity == 0 ? 8 : capacity * 2;
+            PortableDeviceInformation* new_devices = new (std::nothrow) PortableDeviceInformation[new_capacity];
+            if (!new_devices) {
+                hr = E_OUTOFMEMORY;
+                goto quit;
+            }
+            for (int i = 0; i < ndevices; ++i) new_devices[i] = devices[i];
+            delete[] devices;
+            devices = new_devices;
+            capacity = new_capacity;
+        }
+
+        // Files which are not valid catalogs, or were written by older versions, are skipped.
+        Catalog catalog;
+        wchar_t* path = string_format(L"%s\\%s", directory, find_data.cFileName);
+        if (path && SUCCEEDED(catalog_open(path, &catalog)) && catalog_string(&catalog, catalog.header->device_id)[0]) {
+            const CatalogHeader* header = catalog.header;
+            auto& device = devices[ndevices++];
+            device.id = string_clone(catalog_string(&catalog, header->device_id));
+            device.friendly_name = header->device_friendly_name != CatalogNone ? string_clone(catalog_string(&catalog, header->device_friendly_name)) : nullptr;
+            device.description = header->device_description != CatalogNone ? string_clone(catalog_string(&catalog, header->device_description)) : nullptr;
+            if (!device.id || (header->device_friendly_name != CatalogNone && !device.friendly_name) || (header->device_description != CatalogNone && !device.description)) {
+                hr = E_OUTOFMEMORY;
+            }
+        } else if (!path) {
+            hr = E_OUTOFMEMORY;
+        }
+        catalog_close(&catalog);
+        delete[] path;
+        if (FAILED(hr)) goto quit;
+    } while (FindNextFileW(find, &find_data));
+
+    if (GetLastError() != ERROR_NO_MORE_FILES) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    quit:
+    if (find != INVALID_HANDLE_VALUE) FindClose(find);
+    delete[] directory;
+    delete[] pattern;
+    if (FAILED(hr)) {
+        engine_free_devices(devices, ndevices);
+        devices = nullptr;
+        ndevices = 0;
+    }
+    *out_devices = devices;
+    *out_ndevices = ndevices;
+    return hr;
+}
+
+HRESULT engine_list_catalog(Engine* engine, const wchar_t* device_id, const wchar_t* directory, const ObjectFilter& filter, DeviceObjectInformation** out_objects, int* out_nobjects, FILETIME* out_updated) {
+    wchar_t* catalog_path = nullptr;
+    *out_objects = nullptr;
+    *out_nobjects = 0;
+
+    HRESULT hr = get_catalog_path(engine->catalog_directory, device_id, &catalog_path);
+    if (SUCCEEDED(hr)) {
+        hr = load_catalog_objects(catalog_path, directory, filter, out_objects, out_nobjects, out_updated);
+    }
+    delete[] catalog_path;
+    return hr;
+}
+
+HRESULT engine_wait(EngineOperation* operation, DWORD timeout_ms) {
+    DWORD result = WaitForSingleObject(operation->thread, timeout_ms);
+    if (result == WAIT_OBJECT_0) return S_OK;
+    if (result == WAIT_TIMEOUT) return HRESULT_FROM_WIN32(WAIT_TIMEOUT);
+    return HRESULT_FROM_WIN32(GetLastError());
+}
+
+void engine_cancel(EngineOperation* operation) {
+    InterlockedExchange(&operation->cancelled, 1);
+}
+
+const EngineResult& engine_result(const EngineOperation* operation) {
+    return operation->result;
+}
+
+void engine_take_objects(EngineOperation* operation, DeviceObjectInformation** out_objects, int* out_nobjects) {
+    *out_objects = operation->result.objects;
+    *out_nobjects = operation->result.nobjects;
+    operation->result.objects = nullptr;
+    operation->result.nobjects = 0;
+}
+
+void engine_release(EngineOperation* operation) {
+    if (!operation) return;
+    WaitForSingleObject(operation->thread, INFINITE);
+    free_engine_operation(operation);
+}
@@ -0,0 +1,262 @@
+#pragma once
+// Device data engine: finds portable devices, lists, copies and deletes their objects through WPD.
+// Used by device_data_tool.exe and may be embedded into long-running programs.
+//
+// Device operations run asynchronously on background threads. Every operation is represented by
+// EngineOperation: wait for it with engine_wait (or get notified with EngineCallbacks::completed),
+// cancel it with engine_cancel and free it with engine_release. Device connection is kept open
+// between operations, operations on same device run one after another, operations on different
+// devices run concurrently.
+//
+// Strings are wchar_t arrays allocated with new[], unless stated otherwise.
+
+#include <combaseapi.h>
+
+// DeviceObjectInformation::hr of object skipped by EngineCopyOptions::skip_ingested. It's a success code,
+// but such objects are not deleted: their destination files were not checked.
+const HRESULT ENGINE_S_SKIPPED = MAKE_HRESULT(SEVERITY_SUCCESS, FACILITY_ITF, 0x0201);
+
+struct PortableDeviceInformation {
+    wchar_t* id = nullptr;
+    wchar_t* friendly_name = nullptr;
+    wchar_t* description = nullptr;
+};
+
+struct DeviceObjectInformation {
+    wchar_t* id = nullptr;
+    wchar_t* name = nullptr;
+    wchar_t* persistent_id = nullptr; // <-- may be not set.
+    HRESULT hr = E_FAIL;
+    bool has_size = false; // <-- device reported size, otherwise size is 0.
+    ULONGLONG size = 0;
+    DATE date_modified = 0;
+    int attempts = 0;
+    ULONGLONG retry_not_before = 0;
+};
+
+enum ContentType {
+    ContentType_Image    = 1 << 0,
+    ContentType_Video    = 1 << 1,
+    ContentType_Audio    = 1 << 2,
+    ContentType_Document = 1 << 3,
+    ContentType_Folder   = 1 << 4,
+    ContentType_Other    = 1 << 5,
+};
+
+// Object filters. All of them are evaluated on metadata fetched during enumeration,
+// so rejected objects are never opened. Properties not reported by device don't reject objects.
+struct ObjectFilter {
+    const wchar_t* match = nullptr;
+    ULONGLONG min_size = 0;
+    ULONGLONG max_size = (ULONGLONG)-1;
+    bool has_modified_after = false;
+    DATE modified_after = 0;
+    bool has_modified_before = false;
+    DATE modified_before = 0;
+    DWORD content_types = 0; // <-- 0 means any.
+    bool exclude_hidden = false;
+};
+
+struct RetryStats {
+    int retries = 0;   // Number of repeated attempts.
+    int recovered = 0; // Number of items which succeeded after failed attempt.
+    int reopens = 0;   // Number of times device session was reopened.
+};
+
+struct CatalogRefreshStats {
+    DWORD folders = 0;
+    DWORD changed_folders = 0;
+    DWORD fetched_objects = 0;
+};
+
+// Classes of blocking device calls, every class has its own deadline.
+enum DeviceCall {
+    DeviceCall_Open,      // Connecting to device.
+    DeviceCall_Enumerate, // Listing children of folder and reading object properties.
+    DeviceCall_Read,      // Opening object data stream and reading from it.
+    DeviceCall_Delete,    // Deleting batch of objects.
+    DeviceCall_Count,
+};
+
+// Latency histogram of device calls: bucket N counts calls which took [2^N, 2^(N+1)) microseconds.
+struct DeviceCallStats {
+    DWORD count = 0;
+    DWORD timeouts = 0; // Calls which missed deadline, they failed with E_WPD_DEVICE_IS_HUNG.
+    ULONGLONG max_us = 0;
+    DWORD buckets[40] = {};
+};
+
+// Index of content type in usage totals is number of its ContentType bit.
+const int UsageContentTypes = 6;
+
+struct UsageEntry {
+    wchar_t* path = nullptr; // <-- relative to walked directory.
+    ULONGLONG size = 0;      // <-- folder: total size of files in its subtree.
+    DWORD files = 0;         // <-- folder: number of files in its subtree.
+};
+
+struct UsageReport {
+    ULONGLONG size = 0;
+    DWORD files = 0;
+    DWORD folders = 0;
+    DWORD errors = 0; // <-- folders and objects which couldn't be read, they are not counted.
+    ULONGLONG type_sizes[UsageContentTypes] = {};
+    DWORD type_files[UsageContentTypes] = {};
+    UsageEntry* top_folders = nullptr; // <-- largest first, walked directory itself is not included.
+    int ntop_folders = 0;
+    UsageEntry* top_files = nullptr;   // <-- largest first.
+    int ntop_files = 0;
+};
+
+struct Engine;
+struct EngineDevice;
+struct EngineOperation;
+
+const int EngineMaxRetries = 100;
+
+struct EngineSettings {
+    int retries = 3;                            // <-- transient errors are retried this many times, at most EngineMaxRetries.
+    int disk_writers = 0;                       // <-- max concurrent destination writes of all devices, 0 = not limited.
+    const wchar_t* catalog_directory = nullptr; // <-- nullptr = "%LOCALAPPDATA%\device_data_tool\catalogs".
+    // History of copied objects, every successful copy is recorded in it.
+    const wchar_t* ledger_path = nullptr;       // <-- nullptr = "%LOCALAPPDATA%\device_data_tool\ledger.dat".
+    // Deadline of every device call by DeviceCall, 0 = no deadline. Watchdog cancels I/O of calls which
+    // miss it, connection attempts are abandoned.
+    DWORD call_timeouts_ms[DeviceCall_Count] = { 30000, 60000, 30000, 60000 };
+    // For testing: first call of this DeviceCall hangs until watchdog fires, -1 = off.
+    int simulate_hang = -1;
+};
+
+// All callbacks are optional and are called on operation's thread.
+struct EngineCallbacks {
+    void* userdata = nullptr;
+    bool verbose = false; // <-- whether to report result of every object and reconnects.
+
+    // Errors and per-object results. Text ends with newline. Usage operation calls it from its worker threads too.
+    void (*message)(void* userdata, const wchar_t* text) = nullptr;
+    // Object was copied or deleted, or failed to.
+    void (*object_done)(void* userdata, bool ok) = nullptr;
+    // Copy with read_streams calls it from its range threads too.
+    void (*bytes_copied)(void* userdata, DWORD nbytes) = nullptr;
+    // Operation finished, called after result is set. Don't release operation from here.
+    void (*completed)(void* userdata, EngineOperation* operation) = nullptr;
+};
+
+const int EngineMaxDestinations = 8;
+
+struct EngineCopyOptions {
+    // Every object is read from device once and written into all destination directories. Object succeeds
+    // only if it's in all of them; when retried, it's written only into destinations it's missing from.
+    const wchar_t* destination_directories[EngineMaxDestinations] = {};
+    int ndestinations = 0;
+    // Path of copied file relative to destination directory, see engine_validate_layout.
+    // nullptr is the same as "{name}".
+    const wchar_t* layout = nullptr;
+    const wchar_t* device_name = nullptr; // <-- value of {device} in layout.
+    // Continue existing destination files which are verified prefix of device object,
+    // only the rest is read from device. Used for files which only grow.
+    bool append = false;
+    // Skip objects which are recorded in transfer ledger as copied, whether or not they are still in destination.
+    // Objects without persistent ID are always copied.
+    bool skip_ingested = false;
+    // Files of at least 128 MiB are read through up to this many device streams at once, each from its own offset.
+    // 1 reads every file with single stream. Ignored with append and by devices which can't seek in their streams.
+    int read_streams = 4;
+    // Flush copied files in batches and delete them from device after every flush.
+    bool durable_move = false;
+    int commit_batch_files = 64;
+    int commit_batch_seconds = 10;
+};
+
+struct EngineUsageOptions {
+    int top_count = 10; // <-- largest folders and files to report.
+    int walkers = 4;    // <-- folders listed at once, 1-8.
+};
+
+struct EngineResult {
+    HRESULT hr = E_PENDING;
+    wchar_t* object_id = nullptr;                // Resolve: found object.
+    DeviceObjectInformation* objects = nullptr;  // List: matched objects, see engine_take_objects.
+    int nobjects = 0;
+    int succeeded = 0;                           // Copy, delete: objects which succeeded.
+    int attempted = 0;                           // Delete: objects which were attempted.
+    LONG64 bytes_copied = 0;
+    LONG64 bytes_reused = 0;                     // Copy with append: bytes which were not read again.
+    int files_appended = 0;
+    int skipped = 0;                             // Copy with skip_ingested: objects found in ledger.
+    int destination_copied[EngineMaxDestinations] = {}; // Copy: objects written into every destination.
+    int durable_batches = 0;                     // Copy with durable move.
+    int durable_deleted = 0;
+    int durable_attempted = 0;
+    RetryStats retry_stats;
+    CatalogRefreshStats catalog_stats;
+    UsageReport usage;                           // Usage: owned by operation.
+    DeviceCallStats call_stats[DeviceCall_Count];
+};
+
+wchar_t* string_clone(const wchar_t* src, int length = -1);
+wchar_t* string_format(const wchar_t* format, ...);
+// Returned string is cached for lifetime of the process, don't free it.
+const wchar_t* error_string(HRESULT hr);
+
+// Adds latency histogram of source to destination.
+void device_call_stats_add(DeviceCallStats* dest, const DeviceCallStats& source);
+// Returns latency in microseconds which given fraction (0..1) of calls didn't exceed, rounded up to histogram bucket.
+ULONGLONG device_call_percentile_us(const DeviceCallStats& stats, double fraction);
+
+// Checks destination layout template. Returns E_INVALIDARG if it's malformed. Tokens:
+//   {name}, {stem}, {ext}  file name, name without extension, extension with dot (one of {name}, {stem} is required);
+//   {yyyy}, {mm}, {dd}     modification date reported by device, zeroes if not reported;
+//   {device}               device name set in copy options;
+//   {hash:N}               first N (1-8) hex digits of hash of object's persistent ID, spreads files evenly
+//                          over 16^N directories and stays the same between copies.
+// "/" and "\" separate directories, which are created as needed. Path belongs to the object whose file
+// is there; other objects which land on it, or its object after file changed on device, get
+// "~<hash of persistent ID>" suffix before extension.
+HRESULT engine_validate_layout(const wchar_t* layout);
+
+HRESULT engine_create(const EngineSettings& settings, Engine** out_engine);
+// All devices must be closed before.
+void engine_destroy(Engine* engine);
+
+// Lists connected devices. Free result with engine_free_devices.
+HRESULT engine_enumerate_devices(PortableDeviceInformation** out_devices, int* out_ndevices);
+void engine_free_devices(PortableDeviceInformation* devices, int ndevices);
+
+// Device is connected by its first operation. All operations must be released before closing device.
+HRESULT engine_open_device(Engine* engine, const wchar_t* device_id, EngineDevice** out_device);
+void engine_close_device(EngineDevice* device);
+
+// Finds object by path like "Internal shared storage\DCIM", nullptr or empty path is device object.
+HRESULT engine_resolve(EngineDevice* device, const wchar_t* path, const EngineCallbacks& callbacks, EngineOperation** out_operation);
+// Lists children of directory which pass filter.
+HRESULT engine_list(EngineDevice* device, const wchar_t* directory, const ObjectFilter& filter, const EngineCallbacks& callbacks, EngineOperation** out_operation);
+// Copies objects, result of every object is stored in DeviceObjectInformation::hr.
+// Objects must stay valid until operation is finished.
+HRESULT engine_copy(EngineDevice* device, DeviceObjectInformation* objects, int nobjects, const EngineCopyOptions& options, const EngineCallbacks& callbacks, EngineOperation** out_operation);
+// Deletes objects which have succeeded status, except ENGINE_S_SKIPPED. Objects must stay valid until operation is finished.
+HRESULT engine_delete(EngineDevice* device, DeviceObjectInformation* objects, int nobjects, const EngineCallbacks& callbacks, EngineOperation** out_operation);
+// Sums sizes of files under directory per folder and content type, listing several folders at once.
+// Memory doesn't grow with number of objects, only with depth and width of the tree.
+HRESULT engine_usage(EngineDevice* device, const wchar_t* directory, const EngineUsageOptions& options, const EngineCallbacks& callbacks, EngineOperation** out_operation);
+// Saves all device objects into device catalog.
+HRESULT engine_refresh_catalog(EngineDevice* device, const EngineCallbacks& callbacks, EngineOperation** out_operation);
+
+// Lists devices which have catalogs, with ID and names they had at last refresh, doesn't connect to them.
+// catalog_directory nullptr = default directory. Free result with engine_free_devices.
+HRESULT engine_enumerate_catalogs(const wchar_t* catalog_directory, PortableDeviceInformation** out_devices, int* out_ndevices);
+// Lists children of directory which pass filter from device catalog, doesn't connect to device.
+// Free result with engine_free_objects.
+HRESULT engine_list_catalog(Engine* engine, const wchar_t* device_id, const wchar_t* directory, const ObjectFilter& filter, DeviceObjectInformation** out_objects, int* out_nobjects, FILETIME* out_updated);
+
+// Returns S_OK when operation is finished or HRESULT_FROM_WIN32(WAIT_TIMEOUT).
+HRESULT engine_wait(EngineOperation* operation, DWORD timeout_ms);
+// Operation stops as soon as possible and fails with HRESULT_FROM_WIN32(ERROR_CANCELLED).
+void engine_cancel(EngineOperation* operation);
+// Valid after operation is finished.
+const EngineResult& engine_result(const EngineOperation* operation);
+// Moves listed objects out of result, free them with engine_free_objects.
+void engine_take_objects(EngineOperation* operation, DeviceObjectInformation** out_objects, int* out_nobjects);
+void engine_free_objects(DeviceObjectInformation* objects, int nobjects);
+// Waits for operation to finish and frees it.
+void engine_release(EngineOperation* operation);
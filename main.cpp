@@ -1,9 +1,7 @@
 #define NOMINMAX
 #define WIN32_LEAN_AND_MEAN
-#define COM_NO_WINDOWS_H
-#include <combaseapi.h>
-#include <PortableDeviceApi.h>
-#include <PortableDevice.h>
+#include <windows.h>
+#include "engine.h"
 #include <PathCch.h>
 #include <Shlwapi.h>
 #include <new>
@@ -12,7 +10,6 @@
 #include <wchar.h>
 #include <stdarg.h>
 
-#pragma comment(lib, "PortableDeviceGUIDs.lib")
 #pragma comment(lib, "PathCch.lib")
 #pragma comment(lib, "Shlwapi.lib")
 
@@ -22,97 +19,553 @@ struct Args {
     wchar_t* device_description = nullptr;
     wchar_t* match = nullptr;
     wchar_t* source_directory = nullptr;
-    wchar_t* destination_directory = nullptr;
+    wchar_t* destination_directories[EngineMaxDestinations] = {};
+    int ndestinations = 0;
+    wchar_t* content_type = nullptr;
+    wchar_t* catalog_directory = nullptr;
+    wchar_t* layout = nullptr;
+    wchar_t* ledger_path = nullptr;
+    wchar_t* simulate_hang = nullptr;
+    int simulate_hang_call = -1;
+    ULONGLONG min_size = 0;
+    ULONGLONG max_size = (ULONGLONG)-1;
+    bool has_modified_after = false;
+    DATE modified_after = 0;
+    bool has_modified_before = false;
+    DATE modified_before = 0;
+    DWORD content_types = 0;
+    bool exclude_hidden = false;
     bool list_devices = false;
     bool copy_files = false;
     bool delete_files = false;
     bool list_files = false;
+    bool verbose = false;
+    bool all_devices = false;
+    bool refresh_catalog = false;
+    bool from_catalog = false;
+    bool durable_move = false;
+    bool append = false;
+    bool skip_ingested = false;
+    bool usage = false;
+    bool broker = false;
+    bool no_broker = false;
+    bool timing = false;
+    int retries = 3;
+    int disk_writers = 4;
+    int commit_batch_files = 64;
+    int commit_batch_seconds = 10;
+    int open_timeout = 30;
+    int enumerate_timeout = 60;
+    int read_timeout = 30;
+    int delete_timeout = 60;
+    int top = 10;
+    int walkers = 4;
+    int read_streams = 4;
 };
 
-struct PortableDeviceInformation {
-    wchar_t* id = nullptr;
-    wchar_t* friendly_name = nullptr;
-    wchar_t* description = nullptr;
+// --- Broker protocol ---
+// Messages sent through broker pipe: header followed by payload.
+// Client sends request: client's current directory and arguments, every string ends with NUL.
+// Broker answers with output messages (text without NUL) and exit code message (int), or with rejected
+// message (name of option, with NUL) when command must run in client. While command runs, client sends
+// nothing but cancel message (no payload) on Ctrl+C.
+
+enum BrokerMessageType : DWORD {
+    BrokerMessage_Request = 1,
+    BrokerMessage_Output = 2,
+    BrokerMessage_ExitCode = 3,
+    BrokerMessage_Cancel = 4,
+    BrokerMessage_Rejected = 5,
 };
 
-struct DeviceObjectInformation {
-    wchar_t* id = nullptr;
-    wchar_t* name = nullptr;
-    HRESULT hr = E_FAIL;
+struct BrokerMessageHeader {
+    DWORD type;
+    DWORD size; // <-- in bytes.
+};
+
+const DWORD BrokerMaxMessageSize = 256 * 1024;
+const DWORD BrokerPipeBufferSize = 64 * 1024;
+
+static HRESULT pipe_write(HANDLE pipe, const void* data, DWORD size) {
+    while (size > 0) {
+        DWORD nwritten = 0;
+        if (!WriteFile(pipe, data, size, &nwritten, nullptr)) {
+            // Interrupted by Ctrl+C handler of client, see forward_to_broker.
+            if (GetLastError() == ERROR_OPERATION_ABORTED) continue;
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+        data = (const BYTE*)data + nwritten;
+        size -= nwritten;
+    }
+    return S_OK;
+}
+
+// Fails with ERROR_OPERATION_ABORTED only when interrupted before anything was read, so messages are not split.
+static HRESULT pipe_read(HANDLE pipe, void* data, DWORD size) {
+    DWORD total_size = size;
+    while (size > 0) {
+        DWORD nread = 0;
+        if (!ReadFile(pipe, data, size, &nread, nullptr)) {
+            DWORD error = GetLastError();
+            if (error == ERROR_OPERATION_ABORTED && size < total_size) continue;
+            return HRESULT_FROM_WIN32(error);
+        }
+        if (nread == 0) {
+            return HRESULT_FROM_WIN32(ERROR_BROKEN_PIPE);
+        }
+        data = (BYTE*)data + nread;
+        size -= nread;
+    }
+    return S_OK;
+}
+
+static HRESULT broker_send(HANDLE pipe, BrokerMessageType type, const void* data, DWORD size) {
+    BrokerMessageHeader header = { (DWORD)type, size };
+    HRESULT hr = pipe_write(pipe, &header, sizeof(header));
+    if (SUCCEEDED(hr) && size > 0) {
+        hr = pipe_write(pipe, data, size);
+    }
+    return hr;
+}
+
+// Reads message with payload allocated with new[] and terminated with NUL characters.
+static HRESULT broker_receive(HANDLE pipe, BrokerMessageHeader* out_header, BYTE** out_data) {
+    *out_data = nullptr;
+    HRESULT hr = pipe_read(pipe, out_header, sizeof(*out_header));
+    if (FAILED(hr)) return hr;
+    if (out_header->size > BrokerMaxMessageSize) return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+    BYTE* data = new (std::nothrow) BYTE[out_header->size + sizeof(wchar_t)];
+    if (!data) return E_OUTOFMEMORY;
+    do {
+        hr = pipe_read(pipe, data, out_header->size);
+    } while (hr == HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED) && out_header->size > 0);
+    if (FAILED(hr)) {
+        delete[] data;
+        return hr;
+    }
+    memset(&data[out_header->size], 0, sizeof(wchar_t));
+
+    *out_data = data;
+    return S_OK;
+}
+
+// Pipe is per logon session, so brokers of different users on terminal server don't collide.
+static wchar_t* get_broker_pipe_name() {
+    DWORD session_id = 0;
+    ProcessIdToSessionId(GetCurrentProcessId(), &session_id);
+    return string_format(L"\\\\.\\pipe\\device_data_tool_broker_%lu", session_id);
+}
+
+// --- Logging ---
+// Messages are formatted on the calling thread and pushed into a bounded lock-free ring buffer
+// (multiple producers, single consumer), which is written to the console by a background thread.
+// Progress is kept in counters and rendered by the same thread at most every LogProgressIntervalMs,
+// so transfer code never waits on console I/O.
+
+const int LogMessageMaxLength = 1024;
+const int LogRingCapacity = 1024; // Must be power of two.
+const DWORD LogProgressIntervalMs = 100;
+
+struct LogSlot {
+    LONG volatile sequence;
+    wchar_t text[LogMessageMaxLength];
+};
+
+struct Logger {
+    LogSlot* slots = nullptr;
+    LONG volatile enqueue_pos = 0;
+    LONG dequeue_pos = 0; // <-- background thread only.
+    HANDLE thread = nullptr;
+    HANDLE wake_event = nullptr;
+    LONG volatile stop = 0;
+    HANDLE output = nullptr;
+    bool is_console = false;
+    bool verbose = false;
+    HANDLE volatile pipe = nullptr; // <-- when set, output is sent to broker client instead, see log_redirect.
+    LONG volatile written_pos = 0;  // <-- messages before this position are written.
+
+    LONG volatile progress_active = 0;
+    const wchar_t* progress_label = nullptr;
+    LONG volatile progress_total = 0;
+    LONG volatile progress_done = 0;
+    LONG volatile progress_failed = 0;
+    LONG64 volatile progress_bytes = 0;
+    ULONGLONG progress_start_tick = 0;
+    int progress_line_length = 0; // <-- background thread only.
 };
 
-template<typename T>
-static void safe_release(T** ptr) {
-    if (*ptr) {
-        (*ptr)->Release();
-        *ptr = nullptr;
+static Logger logger;
+
+// Set when broker client is gone or asked to cancel command, see is_command_cancelled.
+static LONG volatile command_cancelled = 0;
+
+static void format_size(wchar_t* buffer, size_t buffer_count, double bytes) {
+    const wchar_t* units[] = { L"B", L"KiB", L"MiB", L"GiB", L"TiB" };
+    int unit = 0;
+    while (bytes >= 1024.0 && unit + 1 < _countof(units)) {
+        bytes /= 1024.0;
+        ++unit;
+    }
+    _snwprintf_s(buffer, buffer_count, _TRUNCATE, unit == 0 ? L"%.0f %s" : L"%.1f %s", bytes, units[unit]);
+}
+
+static void log_write(const wchar_t* text, int length) {
+    if (length <= 0) return;
+    if (logger.pipe) {
+        // Client is gone, there is nobody to run command for.
+        if (FAILED(broker_send(logger.pipe, BrokerMessage_Output, text, (DWORD)length * sizeof(wchar_t)))) {
+            InterlockedExchange(&command_cancelled, 1);
+        }
+    } else if (logger.is_console) {
+        DWORD nwritten = 0;
+        WriteConsoleW(logger.output, text, (DWORD)length, &nwritten, nullptr);
+    } else {
+        fputws(text, stdout);
+    }
+}
+
+static void log_clear_progress_line() {
+    if (logger.progress_line_length == 0) return;
+    wchar_t line[LogMessageMaxLength];
+    int length = logger.progress_line_length < LogMessageMaxLength - 3 ? logger.progress_line_length : LogMessageMaxLength - 3;
+    line[0] = L'\r';
+    wmemset(&line[1], L' ', length);
+    line[length + 1] = L'\r';
+    line[length + 2] = L'\0';
+    log_write(line, length + 2);
+    logger.progress_line_length = 0;
+}
+
+static void log_render_progress() {
+    ULONGLONG elapsed_ms = GetTickCount64() - logger.progress_start_tick;
+    double bytes = (double)logger.progress_bytes;
+    double speed = elapsed_ms > 0 ? bytes * 1000.0 / (double)elapsed_ms : 0.0;
+
+    wchar_t size_text[32];
+    wchar_t speed_text[32];
+    format_size(size_text, _countof(size_text), bytes);
+    format_size(speed_text, _countof(speed_text), speed);
+
+    wchar_t line[LogMessageMaxLength];
+    int length = _snwprintf_s(line, _countof(line), _TRUNCATE, L"\r%s %ld/%ld files, %s, %s/s, %ld failed",
+        logger.progress_label, logger.progress_done, logger.progress_total, size_text, speed_text, logger.progress_failed);
+    if (length < 0) return;
+
+    // Pad with spaces to erase leftovers of longer previous line.
+    int visible_length = length - 1;
+    while (visible_length < logger.progress_line_length && length + 1 < _countof(line)) {
+        line[length++] = L' ';
+        line[length] = L'\0';
+        ++visible_length;
+    }
+
+    log_write(line, length);
+    logger.progress_line_length = visible_length;
+}
+
+static bool log_drain() {
+    const LONG mask = LogRingCapacity - 1;
+    bool drained_any = false;
+
+    while (1) {
+        LogSlot* slot = &logger.slots[logger.dequeue_pos & mask];
+        LONG diff = slot->sequence - (logger.dequeue_pos + 1);
+        if (diff < 0) {
+            break;
+        }
+
+        if (!drained_any) {
+            log_clear_progress_line();
+            drained_any = true;
+        }
+        log_write(slot->text, (int)wcslen(slot->text));
+
+        InterlockedExchange(&slot->sequence, logger.dequeue_pos + LogRingCapacity);
+        ++logger.dequeue_pos;
+        InterlockedExchange(&logger.written_pos, logger.dequeue_pos);
+    }
+
+    if (drained_any && !logger.is_console) {
+        fflush(stdout);
+    }
+    return drained_any;
+}
+
+static DWORD WINAPI log_thread_proc(void*) {
+    ULONGLONG last_progress_tick = 0;
+
+    while (1) {
+        WaitForSingleObject(logger.wake_event, LogProgressIntervalMs);
+        bool stopping = logger.stop != 0;
+
+        bool drained = log_drain();
+
+        if (logger.progress_active && logger.is_console && !logger.pipe && !logger.verbose) {
+            ULONGLONG now = GetTickCount64();
+            if (drained || now - last_progress_tick >= LogProgressIntervalMs) {
+                log_render_progress();
+                last_progress_tick = now;
+            }
+        } else {
+            log_clear_progress_line();
+        }
+
+        if (stopping) {
+            // Producers are done at this point, pick up anything pushed before stop was set.
+            log_drain();
+            log_clear_progress_line();
+            break;
+        }
     }
+
+    return 0;
 }
 
-static wchar_t* string_clone(const wchar_t* src, int length = -1) {
-    if (!src) return nullptr;
-    if (length < 0) {
-        length = (int)wcslen(src);
+static void log_vprint(const wchar_t* format, va_list args) {
+    if (!logger.thread) {
+        vwprintf(format, args);
+        return;
+    }
+
+    const LONG mask = LogRingCapacity - 1;
+    LONG pos = logger.enqueue_pos;
+    LogSlot* slot = nullptr;
+
+    while (1) {
+        slot = &logger.slots[pos & mask];
+        LONG diff = slot->sequence - pos;
+        if (diff == 0) {
+            if (InterlockedCompareExchange(&logger.enqueue_pos, pos + 1, pos) == pos) {
+                break;
+            }
+            pos = logger.enqueue_pos;
+        } else if (diff < 0) {
+            // Ring is full, let background thread catch up. Only happens when
+            // output is flooded with messages (verbose mode or mass failures).
+            SetEvent(logger.wake_event);
+            SwitchToThread();
+            pos = logger.enqueue_pos;
+        } else {
+            pos = logger.enqueue_pos;
+        }
     }
-    wchar_t* dst = new (std::nothrow) wchar_t[length + 1];
-    if (dst) {
-        memcpy(dst, src, sizeof(wchar_t) * length);
-        dst[length] = L'\0';
+
+    if (_vsnwprintf_s(slot->text, LogMessageMaxLength, _TRUNCATE, format, args) < 0) {
+        // Truncated: make sure line still ends with newline.
+        size_t length = wcslen(slot->text);
+        if (length > 0) {
+            slot->text[length - 1] = L'\n';
+        }
     }
-    return dst;
+
+    InterlockedExchange(&slot->sequence, pos + 1);
+    SetEvent(logger.wake_event);
+}
+
+static void log_print(const wchar_t* format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_vprint(format, args);
+    va_end(args);
 }
 
-static wchar_t* string_format(const wchar_t* format, ...) {
+// Same as log_print, but message is shown only with --verbose.
+static void log_verbose(const wchar_t* format, ...) {
+    if (!logger.verbose) return;
     va_list args;
     va_start(args, format);
-    int buffer_count = _vscwprintf(format, args);
+    log_vprint(format, args);
     va_end(args);
-    if (buffer_count < 0) {
-        return nullptr;
+}
+
+static void log_progress_begin(const wchar_t* label, int total) {
+    logger.progress_label = label;
+    logger.progress_total = total;
+    logger.progress_done = 0;
+    logger.progress_failed = 0;
+    logger.progress_bytes = 0;
+    logger.progress_start_tick = GetTickCount64();
+    InterlockedExchange(&logger.progress_active, 1);
+}
+
+// Increases number of items in progress, used when total is not known upfront.
+static void log_progress_add_total(int count) {
+    InterlockedExchangeAdd(&logger.progress_total, count);
+}
+
+static void log_progress_bytes(DWORD nbytes) {
+    InterlockedExchangeAdd64(&logger.progress_bytes, (LONG64)nbytes);
+}
+
+static void log_progress_step(bool ok) {
+    InterlockedIncrement(&logger.progress_done);
+    if (!ok) {
+        InterlockedIncrement(&logger.progress_failed);
+    }
+}
+
+// Stops progress display and prints summary line.
+static void log_progress_end(const wchar_t* done_label) {
+    InterlockedExchange(&logger.progress_active, 0);
+
+    ULONGLONG elapsed_ms = GetTickCount64() - logger.progress_start_tick;
+    double bytes = (double)logger.progress_bytes;
+    wchar_t size_text[32];
+    wchar_t speed_text[32];
+    format_size(size_text, _countof(size_text), bytes);
+    format_size(speed_text, _countof(speed_text), elapsed_ms > 0 ? bytes * 1000.0 / (double)elapsed_ms : 0.0);
+
+    log_print(L"%s %ld of %ld files (%s in %.1f s, %s/s), %ld failed.\n",
+        done_label, logger.progress_done - logger.progress_failed, logger.progress_total,
+        size_text, (double)elapsed_ms / 1000.0, speed_text, logger.progress_failed);
+}
+
+static bool log_start() {
+    logger.output = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD console_mode = 0;
+    logger.is_console = logger.output && logger.output != INVALID_HANDLE_VALUE && GetConsoleMode(logger.output, &console_mode);
+
+    logger.slots = new (std::nothrow) LogSlot[LogRingCapacity];
+    if (!logger.slots) {
+        return false;
+    }
+    for (LONG i = 0; i < LogRingCapacity; ++i) {
+        logger.slots[i].sequence = i;
     }
 
-    wchar_t* buffer = new (std::nothrow) wchar_t[buffer_count + 1];
-    if (!buffer) {
-        return nullptr;
+    logger.wake_event = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+    if (!logger.wake_event) {
+        delete[] logger.slots;
+        logger.slots = nullptr;
+        return false;
     }
 
-    va_start(args, format);
-    int count = _vsnwprintf_s(buffer, buffer_count + 1, buffer_count, format, args);
-    va_end(args);
-    if (count < 0) {
-        delete[] buffer;
-        return nullptr;
+    logger.thread = CreateThread(nullptr, 0, log_thread_proc, nullptr, 0, nullptr);
+    if (!logger.thread) {
+        CloseHandle(logger.wake_event);
+        logger.wake_event = nullptr;
+        delete[] logger.slots;
+        logger.slots = nullptr;
+        return false;
     }
 
-    buffer[buffer_count] = L'\0';
-    return buffer;
+    return true;
 }
 
-static wchar_t* hresult_to_string(HRESULT hr) {
-    wchar_t* error = nullptr;
-    DWORD length = FormatMessageW(
-        FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-        nullptr,
-        hr,
-        MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-        (wchar_t*)&error,
-        0,
-        nullptr);
+// Flushes all pending messages and stops background thread.
+static void log_stop() {
+    if (!logger.thread) return;
+
+    InterlockedExchange(&logger.stop, 1);
+    SetEvent(logger.wake_event);
+    WaitForSingleObject(logger.thread, INFINITE);
+    CloseHandle(logger.thread);
+    CloseHandle(logger.wake_event);
+    logger.thread = nullptr;
+    logger.wake_event = nullptr;
+    delete[] logger.slots;
+    logger.slots = nullptr;
+    fflush(stdout);
+}
 
-    wchar_t* result;
-    if (error) {
-        if (length >= 2 && error[length - 2] == '\r' && error[length - 1] == '\n') {
-            length -= 2;
+// Waits until all messages printed so far are written.
+static void log_flush() {
+    if (!logger.thread) return;
+    LONG target = logger.enqueue_pos;
+    while (logger.written_pos - target < 0) {
+        SetEvent(logger.wake_event);
+        Sleep(1);
+    }
+}
+
+// Sends following messages to broker client, or back to console if pipe is nullptr.
+// Progress line is not rendered while output is redirected.
+static void log_redirect(HANDLE pipe) {
+    log_flush();
+    InterlockedExchangePointer((void* volatile*)&logger.pipe, pipe);
+}
+
+// Parses byte count with optional K, M, G or T suffix (powers of 1024).
+static bool parse_size(const wchar_t* text, ULONGLONG* out_size) {
+    wchar_t* end = nullptr;
+    if (!iswdigit(text[0])) return false;
+    ULONGLONG size = _wcstoui64(text, &end, 10);
+
+    int shift = 0;
+    switch (towupper(*end)) {
+        case L'\0': break;
+        case L'K': shift = 10; break;
+        case L'M': shift = 20; break;
+        case L'G': shift = 30; break;
+        case L'T': shift = 40; break;
+        default: return false;
+    }
+    if (*end && end[1] != L'\0' && !(towupper(end[1]) == L'B' && end[2] == L'\0')) {
+        return false;
+    }
+    if (shift && size > ((ULONGLONG)-1 >> shift)) {
+        return false;
+    }
+
+    *out_size = size << shift;
+    return true;
+}
+
+// Parses "YYYY-MM-DD", "YYYY-MM-DD HH:MM" or "YYYY-MM-DD HH:MM:SS" ("T" can be used instead of space).
+// Time is compared with device-reported modification time, which is device local time.
+// Text must end right after the matched form, so "2024-01-05 10:30xyz" is rejected.
+static bool parse_date(const wchar_t* text, DATE* out_date) {
+    SYSTEMTIME time = { 0 };
+    wchar_t separator = 0;
+    int end = -1;
+    int length = (int)wcslen(text);
+    int count = swscanf_s(text, L"%4hu-%2hu-%2hu%n", &time.wYear, &time.wMonth, &time.wDay, &end);
+    if (count != 3 || end != length) {
+        end = -1;
+        count = swscanf_s(text, L"%4hu-%2hu-%2hu%c%2hu:%2hu%n",
+            &time.wYear, &time.wMonth, &time.wDay, &separator, 1, &time.wHour, &time.wMinute, &end);
+        if (count != 6 || end != length) {
+            end = -1;
+            count = swscanf_s(text, L"%4hu-%2hu-%2hu%c%2hu:%2hu:%2hu%n",
+                &time.wYear, &time.wMonth, &time.wDay, &separator, 1, &time.wHour, &time.wMinute, &time.wSecond, &end);
+            if (count != 7 || end != length) return false;
         }
-        result = string_clone(error, (int)length);
-        LocalFree(error);
-    } else {
-        result = string_format(L"Unknown error 0x%0lX", hr);
-        if (!result) {
-            result = string_clone(L"Unknown error");
+    }
+    if (count > 3 && separator != L' ' && separator != L'T') return false;
+    return SystemTimeToVariantTime(&time, out_date) != FALSE;
+}
+
+static bool parse_content_types(const wchar_t* text, DWORD* out_content_types) {
+    DWORD content_types = 0;
+    const wchar_t* item = text;
+    while (*item) {
+        const wchar_t* item_end = wcschr(item, L',');
+        size_t length = item_end ? (size_t)(item_end - item) : wcslen(item);
+
+        struct { const wchar_t* name; DWORD type; } names[] = {
+            { L"image", ContentType_Image },
+            { L"video", ContentType_Video },
+            { L"audio", ContentType_Audio },
+            { L"document", ContentType_Document },
+            { L"folder", ContentType_Folder },
+            { L"other", ContentType_Other },
+        };
+        bool found = false;
+        for (auto& name : names) {
+            if (wcslen(name.name) == length && 0 == _wcsnicmp(name.name, item, length)) {
+                content_types |= name.type;
+                found = true;
+                break;
+            }
         }
+        if (!found) return false;
+
+        item = item_end ? item_end + 1 : item + length;
     }
-    return result;
+
+    *out_content_types = content_types;
+    return content_types != 0;
 }
 
 static Args parse_args(int argc, wchar_t** argv) {
@@ -138,6 +591,30 @@ static Args parse_args(int argc, wchar_t** argv) {
                 field = &args.delete_files;
             } else if (0 == wcscmp(name, L"list_files")) {
                 field = &args.list_files;
+            } else if (0 == wcscmp(name, L"verbose")) {
+                field = &args.verbose;
+            } else if (0 == wcscmp(name, L"all_devices")) {
+                field = &args.all_devices;
+            } else if (0 == wcscmp(name, L"exclude_hidden")) {
+                field = &args.exclude_hidden;
+            } else if (0 == wcscmp(name, L"refresh_catalog")) {
+                field = &args.refresh_catalog;
+            } else if (0 == wcscmp(name, L"from_catalog")) {
+                field = &args.from_catalog;
+            } else if (0 == wcscmp(name, L"durable_move")) {
+                field = &args.durable_move;
+            } else if (0 == wcscmp(name, L"append")) {
+                field = &args.append;
+            } else if (0 == wcscmp(name, L"skip_ingested")) {
+                field = &args.skip_ingested;
+            } else if (0 == wcscmp(name, L"usage")) {
+                field = &args.usage;
+            } else if (0 == wcscmp(name, L"broker")) {
+                field = &args.broker;
+            } else if (0 == wcscmp(name, L"no_broker")) {
+                field = &args.no_broker;
+            } else if (0 == wcscmp(name, L"timing")) {
+                field = &args.timing;
             }
 
             if (field) {
@@ -146,17 +623,120 @@ static Args parse_args(int argc, wchar_t** argv) {
             }
         }
 
+        {
+            int* field = nullptr;
+
+            if (0 == wcscmp(name, L"retries")) {
+                field = &args.retries;
+            } else if (0 == wcscmp(name, L"disk_writers")) {
+                field = &args.disk_writers;
+            } else if (0 == wcscmp(name, L"commit_batch_files")) {
+                field = &args.commit_batch_files;
+            } else if (0 == wcscmp(name, L"commit_batch_seconds")) {
+                field = &args.commit_batch_seconds;
+            } else if (0 == wcscmp(name, L"top")) {
+                field = &args.top;
+            } else if (0 == wcscmp(name, L"walkers")) {
+                field = &args.walkers;
+            } else if (0 == wcscmp(name, L"read_streams")) {
+                field = &args.read_streams;
+            } else if (0 == wcscmp(name, L"open_timeout")) {
+                field = &args.open_timeout;
+            } else if (0 == wcscmp(name, L"enumerate_timeout")) {
+                field = &args.enumerate_timeout;
+            } else if (0 == wcscmp(name, L"read_timeout")) {
+                field = &args.read_timeout;
+            } else if (0 == wcscmp(name, L"delete_timeout")) {
+                field = &args.delete_timeout;
+            }
+
+            if (field) {
+                if (i + 1 >= argc) {
+                    error = string_format(L"Value of argument \"--%s\" is not set", name);
+                    goto on_error;
+                }
+                wchar_t* value = argv[i + 1];
+                ++i;
+
+                wchar_t* value_end = nullptr;
+                long number = wcstol(value, &value_end, 10);
+                if (value_end == value || *value_end != L'\0' || number < 0) {
+                    error = string_format(L"Value of argument \"--%s\" must be a non-negative integer", name);
+                    goto on_error;
+                }
+                *field = (int)number;
+                continue;
+            }
+        }
+
+        {
+            ULONGLONG* size_field = nullptr;
+            DATE* date_field = nullptr;
+            bool* date_is_set = nullptr;
+
+            if (0 == wcscmp(name, L"min_size")) {
+                size_field = &args.min_size;
+            } else if (0 == wcscmp(name, L"max_size")) {
+                size_field = &args.max_size;
+            } else if (0 == wcscmp(name, L"modified_after")) {
+                date_field = &args.modified_after;
+                date_is_set = &args.has_modified_after;
+            } else if (0 == wcscmp(name, L"modified_before")) {
+                date_field = &args.modified_before;
+                date_is_set = &args.has_modified_before;
+            }
+
+            if (size_field || date_field) {
+                if (i + 1 >= argc) {
+                    error = string_format(L"Value of argument \"--%s\" is not set", name);
+                    goto on_error;
+                }
+                wchar_t* value = argv[i + 1];
+                ++i;
+
+                if (size_field && !parse_size(value, size_field)) {
+                    error = string_format(L"Value of argument \"--%s\" must be a size in bytes, optionally with K, M, G or T suffix", name);
+                    goto on_error;
+                }
+                if (date_field) {
+                    if (!parse_date(value, date_field)) {
+                        error = string_format(L"Value of argument \"--%s\" must be a date in format YYYY-MM-DD[ HH:MM[:SS]]", name);
+                        goto on_error;
+                    }
+                    *date_is_set = true;
+                }
+                continue;
+            }
+        }
+
         {
             wchar_t** field = nullptr;
 
             if (0 == wcscmp(name, L"device_description")) {
                 field = &args.device_description;
+            } else if (0 == wcscmp(name, L"device_friendly_name")) {
+                field = &args.device_friendly_name;
             } else if (0 == wcscmp(name, L"source_directory")) {
                 field = &args.source_directory;
             } else if (0 == wcscmp(name, L"destination_directory")) {
-                field = &args.destination_directory;
+                // Repeatable: every copied file is written into all destinations.
+                if (args.ndestinations == EngineMaxDestinations) {
+                    error = string_format(L"--destination_directory can be set at most %d times", EngineMaxDestinations);
+                    goto on_error;
+                }
+                field = &args.destination_directories[args.ndestinations++];
             } else if (0 == wcscmp(name, L"match")) {
                 field = &args.match;
+            } else if (0 == wcscmp(name, L"content_type")) {
+                field = &args.content_type;
+            } else if (0 == wcscmp(name, L"catalog_directory")) {
+                field = &args.catalog_directory;
+            } else if (0 == wcscmp(name, L"layout")) {
+                field = &args.layout;
+            } else if (0 == wcscmp(name, L"ledger_path")) {
+                field = &args.ledger_path;
+            } else if (0 == wcscmp(name, L"simulate_hang")) {
+                field = &args.simulate_hang;
             }
 
             if (field == nullptr) {
@@ -180,9 +760,47 @@ static Args parse_args(int argc, wchar_t** argv) {
         }
     }
 
-    if (!args.list_devices) {
-        if (!args.device_friendly_name && !args.device_description) {
-            error = L"Neither device friendly name nor description is not set.\n";
+    if (args.simulate_hang) {
+        const wchar_t* calls[DeviceCall_Count] = { L"open", L"enumerate", L"read", L"delete" };
+        for (int i = 0; i < DeviceCall_Count; ++i) {
+            if (0 == wcscmp(args.simulate_hang, calls[i])) {
+                args.simulate_hang_call = i;
+            }
+        }
+        if (args.simulate_hang_call < 0) {
+            error = L"--simulate_hang must be one of open, enumerate, read or delete.\n";
+            goto on_error;
+        }
+    }
+
+    if (args.retries > EngineMaxRetries) {
+        error = string_format(L"--retries must be at most %d", EngineMaxRetries);
+        goto on_error;
+    }
+
+    if (args.broker && args.no_broker) {
+        error = L"--broker cannot be used together with --no_broker\n";
+        goto on_error;
+    }
+
+    if (!args.list_devices && !args.broker) {
+        if (!args.device_friendly_name && !args.device_description && !args.all_devices) {
+            error = L"Neither device friendly name nor description is not set (use --all_devices to select all devices).\n";
+            goto on_error;
+        }
+
+        if (args.content_type && !parse_content_types(args.content_type, &args.content_types)) {
+            error = L"--content_type must be a comma-separated list of image, video, audio, document, folder or other.\n";
+            goto on_error;
+        }
+
+        if (args.min_size > args.max_size) {
+            error = L"--min_size is greater than --max_size.\n";
+            goto on_error;
+        }
+
+        if (args.disk_writers < 1) {
+            error = L"--disk_writers must be at least 1.\n";
             goto on_error;
         }
 
@@ -191,13 +809,63 @@ static Args parse_args(int argc, wchar_t** argv) {
             goto on_error;
         }
 
-        if (args.copy_files && !args.destination_directory) {
-            error = L"Source directory is not set.\n";
+        if (args.copy_files && args.ndestinations == 0) {
+            error = L"Destination directory is not set.\n";
+            goto on_error;
+        }
+
+        if (args.layout && !args.copy_files) {
+            error = L"--layout can only be used with --copy_files\n";
+            goto on_error;
+        }
+
+        if (args.layout && FAILED(engine_validate_layout(args.layout))) {
+            error = L"--layout must be a relative path with {name} or {stem} and only {name}, {stem}, {ext}, {yyyy}, {mm}, {dd}, {device} and {hash:1-8} tokens.\n";
+            goto on_error;
+        }
+
+        if (!args.copy_files && !args.delete_files && !args.list_files && !args.refresh_catalog && !args.usage) {
+            error = L"Action is not set (specify --copy_files, --delete_files, --list_files, --refresh_catalog or --usage).\n";
+            goto on_error;
+        }
+
+        if (args.usage && (args.copy_files || args.delete_files || args.list_files)) {
+            error = L"--usage cannot be used together with --copy_files, --delete_files or --list_files\n";
+            goto on_error;
+        }
+
+        if (args.walkers < 1 || args.walkers > 8) {
+            error = L"--walkers must be between 1 and 8.\n";
+            goto on_error;
+        }
+
+        if (args.read_streams < 1 || args.read_streams > 8) {
+            error = L"--read_streams must be between 1 and 8.\n";
+            goto on_error;
+        }
+
+        if (args.durable_move && !(args.copy_files && args.delete_files)) {
+            error = L"--durable_move requires both --copy_files and --delete_files\n";
+            goto on_error;
+        }
+
+        if (args.append && !args.copy_files) {
+            error = L"--append can only be used with --copy_files\n";
+            goto on_error;
+        }
+
+        if (args.skip_ingested && !args.copy_files) {
+            error = L"--skip_ingested can only be used with --copy_files\n";
+            goto on_error;
+        }
+
+        if (args.commit_batch_files < 1) {
+            error = L"--commit_batch_files must be at least 1.\n";
             goto on_error;
         }
 
-        if (!args.copy_files && !args.delete_files && !args.list_files) {
-            error = L"Action is not set (specify --copy_files, --delete_files or --list_files).\n";
+        if (args.from_catalog && !args.list_files) {
+            error = L"--from_catalog can only be used with --list_files\n";
             goto on_error;
         }
 
@@ -210,7 +878,7 @@ static Args parse_args(int argc, wchar_t** argv) {
     if (error) {
         on_error:
         args.ok = false;
-        wprintf(L"Error: %s\n", error ? error : L"<out of memory>");
+        log_print(L"Error: %s\n", error ? error : L"<out of memory>");
     } else {
         args.ok = true;
     }
@@ -218,793 +886,1202 @@ static Args parse_args(int argc, wchar_t** argv) {
     return args;
 }
 
-// --- deallocate with CoTaskMemFree ---
-// ^^^^^^^^^^^^ FIX THIS @TODO
-static HRESULT get_device_object_name(IPortableDeviceProperties* properties, const wchar_t* object_id, wchar_t** out_object_name) {
-    HRESULT hr = E_FAIL;
-    *out_object_name = nullptr;
+static void free_args(Args* args) {
+    delete[] args->device_friendly_name;
+    delete[] args->device_description;
+    delete[] args->match;
+    delete[] args->source_directory;
+    for (int i = 0; i < args->ndestinations; ++i) {
+        delete[] args->destination_directories[i];
+    }
+    delete[] args->content_type;
+    delete[] args->catalog_directory;
+    delete[] args->layout;
+    delete[] args->ledger_path;
+    delete[] args->simulate_hang;
+    *args = Args();
+}
 
-    static IPortableDeviceKeyCollection* original_name_keys = nullptr;
-    if (!original_name_keys) {
-        hr = CoCreateInstance(CLSID_PortableDeviceKeyCollection, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&original_name_keys));
-        if (FAILED(hr)) return hr;
-        hr = original_name_keys->Add(WPD_OBJECT_ORIGINAL_FILE_NAME);
-        if (FAILED(hr)) {
-            safe_release(&original_name_keys);
-            return hr;
-        }
+static void print_deviceinfo(PortableDeviceInformation* deviceinfo) {
+    log_print(L"- Identifier: \"%s\"\n", deviceinfo->id);
+    log_print(L"- Friendly Name: \"%s\"\n", deviceinfo->friendly_name ? deviceinfo->friendly_name : L"<not set>");
+    log_print(L"- Description: \"%s\"\n", deviceinfo->description ? deviceinfo->description : L"<not set>");
+}
+
+// Device friendly name and description arguments are patterns which may contain "*" and "?" wildcards
+// and several patterns separated by ";". When both are set, device must match both.
+static bool match_device(const PortableDeviceInformation& device, const Args& args) {
+    if (args.all_devices) {
+        return true;
+    }
+    if (args.device_description && !(device.description && PathMatchSpecW(device.description, args.device_description))) {
+        return false;
+    }
+    if (args.device_friendly_name && !(device.friendly_name && PathMatchSpecW(device.friendly_name, args.device_friendly_name))) {
+        return false;
     }
+    return args.device_description || args.device_friendly_name;
+}
 
-    static IPortableDeviceKeyCollection* name_keys = nullptr;
-    if (!name_keys) {
-        hr = CoCreateInstance(CLSID_PortableDeviceKeyCollection, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&name_keys));
-        if (FAILED(hr)) return hr;
-        hr = name_keys->Add(WPD_OBJECT_NAME);
-        if (FAILED(hr)) {
-            safe_release(&name_keys);
-            return hr;
-        }
+static void print_retry_stats(const wchar_t* log_prefix, const RetryStats& stats) {
+    if (stats.retries == 0 && stats.reopens == 0) return;
+    log_print(L"%sRetries: %d, recovered after retry: %d, device reconnects: %d.\n", log_prefix, stats.retries, stats.recovered, stats.reopens);
+}
+
+static void format_duration(wchar_t* buffer, size_t buffer_count, ULONGLONG us) {
+    if (us < 1000) {
+        _snwprintf_s(buffer, buffer_count, _TRUNCATE, L"%llu us", us);
+    } else if (us < 1000 * 1000) {
+        _snwprintf_s(buffer, buffer_count, _TRUNCATE, L"%.1f ms", (double)us / 1000.0);
+    } else {
+        _snwprintf_s(buffer, buffer_count, _TRUNCATE, L"%.1f s", (double)us / 1000000.0);
     }
+}
 
-    // ORIGINAL_FILE_NAME = with file extension
-    // NAME = without file extension
+// Percentiles are upper bounds of histogram buckets, so they are at most 2x off.
+static void print_call_stats(const wchar_t* log_prefix, const DeviceCallStats* stats) {
+    const wchar_t* names[DeviceCall_Count] = { L"Open", L"Enumerate", L"Read", L"Delete" };
+    for (int i = 0; i < DeviceCall_Count; ++i) {
+        if (stats[i].count == 0) continue;
+        wchar_t p50[32];
+        wchar_t p95[32];
+        wchar_t p99[32];
+        wchar_t max[32];
+        format_duration(p50, _countof(p50), device_call_percentile_us(stats[i], 0.50));
+        format_duration(p95, _countof(p95), device_call_percentile_us(stats[i], 0.95));
+        format_duration(p99, _countof(p99), device_call_percentile_us(stats[i], 0.99));
+        format_duration(max, _countof(max), stats[i].max_us);
+        log_print(L"%s%s: %lu calls, p50 %s, p95 %s, p99 %s, max %s, %lu timed out.\n", log_prefix, names[i], stats[i].count, p50, p95, p99, max, stats[i].timeouts);
+    }
+}
 
-    IPortableDeviceValues* values = nullptr;
+static void print_usage_report(const wchar_t* log_prefix, const UsageReport& report, ULONGLONG elapsed_ms) {
+    const wchar_t* type_names[UsageContentTypes] = { L"image", L"video", L"audio", L"document", L"folder", L"other" };
+    wchar_t size_text[32];
 
-    // Try get file name with extension.
-    hr = properties->GetValues(object_id, original_name_keys, &values);
-    if (SUCCEEDED(hr)) {
-        wchar_t* original_name = nullptr;
-        hr = values->GetStringValue(WPD_OBJECT_ORIGINAL_FILE_NAME, &original_name);
-        if (SUCCEEDED(hr)) {
-            *out_object_name = string_clone(original_name);
-            if (!out_object_name) {
-                hr = E_OUTOFMEMORY;
-            }
-            CoTaskMemFree(original_name);
+    format_size(size_text, _countof(size_text), (double)report.size);
+    log_print(L"%s%s in %lu files and %lu folders (walked in %.1f s).\n", log_prefix, size_text, report.files, report.folders, (double)elapsed_ms / 1000.0);
+
+    log_print(L"%sBy type:\n", log_prefix);
+    for (int i = 0; i < UsageContentTypes; ++i) {
+        if (report.type_files[i] == 0) continue;
+        format_size(size_text, _countof(size_text), (double)report.type_sizes[i]);
+        log_print(L"%s- %-8s %10s in %lu files\n", log_prefix, type_names[i], size_text, report.type_files[i]);
+    }
+
+    if (report.ntop_folders > 0) {
+        log_print(L"%sLargest folders:\n", log_prefix);
+        for (int i = 0; i < report.ntop_folders; ++i) {
+            format_size(size_text, _countof(size_text), (double)report.top_folders[i].size);
+            log_print(L"%s- %10s %8lu files  %s\n", log_prefix, size_text, report.top_folders[i].files, report.top_folders[i].path);
         }
-    } 
+    }
 
-    // If failed, get normal name.
-    if (FAILED(hr) && hr != E_OUTOFMEMORY) {
-        safe_release(&values);
-        hr = properties->GetValues(object_id, name_keys, &values);
-        if (SUCCEEDED(hr)) {
-            wchar_t* name = nullptr;
-            hr = values->GetStringValue(WPD_OBJECT_NAME, &name);
-            if (SUCCEEDED(hr)) {
-                *out_object_name = string_clone(name);
-                if (!out_object_name) {
-                    hr = E_OUTOFMEMORY;
-                }
-                CoTaskMemFree(name);
-            }
+    if (report.ntop_files > 0) {
+        log_print(L"%sLargest files:\n", log_prefix);
+        for (int i = 0; i < report.ntop_files; ++i) {
+            format_size(size_text, _countof(size_text), (double)report.top_files[i].size);
+            log_print(L"%s- %10s  %s\n", log_prefix, size_text, report.top_files[i].path);
         }
     }
 
-    safe_release(&values);
-    return hr;
+    if (report.errors > 0) {
+        log_print(L"%s%lu folders or objects could not be read and are not counted.\n", log_prefix, report.errors);
+    }
 }
 
-static HRESULT enumerate_devices(PortableDeviceInformation** out_devices, int* out_ndevices) {
-    assert(out_devices);
-    assert(out_ndevices);
+static void apply_engine_settings(const Args& args, EngineSettings* settings) {
+    settings->retries = args.retries;
+    settings->catalog_directory = args.catalog_directory;
+    settings->ledger_path = args.ledger_path;
+    settings->call_timeouts_ms[DeviceCall_Open] = (DWORD)args.open_timeout * 1000;
+    settings->call_timeouts_ms[DeviceCall_Enumerate] = (DWORD)args.enumerate_timeout * 1000;
+    settings->call_timeouts_ms[DeviceCall_Read] = (DWORD)args.read_timeout * 1000;
+    settings->call_timeouts_ms[DeviceCall_Delete] = (DWORD)args.delete_timeout * 1000;
+    settings->simulate_hang = args.simulate_hang_call;
+}
 
-    IPortableDeviceManager* device_manager = nullptr;
-    wchar_t** device_ids = nullptr;
-    DWORD ndevices = 0;
-    PortableDeviceInformation* devices = nullptr;
-    HRESULT hr = E_FAIL;
+// --- Broker ---
+// Long-running process which keeps engine and device connections between commands of other
+// invocations of the tool: connecting to device and resolving source directory take most of the
+// time of small commands. Devices opened by commands stay open until broker exits.
 
-    hr = CoCreateInstance(CLSID_PortableDeviceManager, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&device_manager));
-    if (FAILED(hr)) goto quit;
+struct BrokerDevice {
+    wchar_t* id = nullptr;
+    EngineDevice* device = nullptr;
+};
 
-    hr = device_manager->GetDevices(nullptr, &ndevices);
-    if (FAILED(hr)) goto quit;
+struct Broker {
+    Engine* engine = nullptr;
+    EngineSettings settings; // <-- engine was created with them, commands with other engine options run in client.
+    SRWLOCK lock = SRWLOCK_INIT; // <-- device jobs of one command run concurrently.
+    BrokerDevice* devices = nullptr;
+    int ndevices = 0;
+    int capacity = 0;
+};
 
-    device_ids = new (std::nothrow) wchar_t*[ndevices];
-    if (!device_ids) {
-        hr = E_OUTOFMEMORY;
-        goto quit;
-    }
-    
-    hr = device_manager->GetDevices(device_ids, &ndevices);
-    if (FAILED(hr)) goto quit;
+static bool is_same_option_path(const wchar_t* a, const wchar_t* b) {
+    if (!a || !b) return a == b;
+    return 0 == _wcsicmp(a, b);
+}
 
-    devices = new (std::nothrow) PortableDeviceInformation[ndevices];
-    if (!device_ids) {
-        hr = E_OUTOFMEMORY;
-        goto quit;
+// Returns name of engine option which differs from broker's, or nullptr if command can run in broker.
+// Simulated hang fires once per engine, so such commands always run in client.
+static const wchar_t* find_broker_settings_mismatch(const Broker* broker, const Args& args) {
+    const wchar_t* timeout_options[DeviceCall_Count] = { L"--open_timeout", L"--enumerate_timeout", L"--read_timeout", L"--delete_timeout" };
+    EngineSettings settings;
+    apply_engine_settings(args, &settings);
+
+    if (settings.retries != broker->settings.retries) return L"--retries";
+    if (!is_same_option_path(settings.catalog_directory, broker->settings.catalog_directory)) return L"--catalog_directory";
+    if (!is_same_option_path(settings.ledger_path, broker->settings.ledger_path)) return L"--ledger_path";
+    for (int i = 0; i < DeviceCall_Count; ++i) {
+        if (settings.call_timeouts_ms[i] != broker->settings.call_timeouts_ms[i]) return timeout_options[i];
     }
+    if (settings.simulate_hang >= 0 || broker->settings.simulate_hang >= 0) return L"--simulate_hang";
+    if (args.disk_writers != broker->settings.disk_writers) return L"--disk_writers";
+    return nullptr;
+}
+
+// Returns device opened by previous command or opens new one. Device is owned by broker.
+static HRESULT broker_get_device(Broker* broker, const wchar_t* device_id, EngineDevice** out_device) {
+    *out_device = nullptr;
+    HRESULT hr = S_OK;
+    AcquireSRWLockExclusive(&broker->lock);
 
-    for (DWORD i = 0; i < ndevices; ++i) {
-        auto& device = devices[i];
+    for (int i = 0; i < broker->ndevices; ++i) {
+        if (0 == wcscmp(broker->devices[i].id, device_id)) {
+            *out_device = broker->devices[i].device;
+            goto quit;
+        }
+    }
 
-        // Identifier.
-        device.id = string_clone(device_ids[i]);
-        if (!device.id) {
+    if (broker->ndevices == broker->capacity) {
+        int new_capacity = broker->capacity ? broker->capacity * 2 : 8;
+        BrokerDevice* new_devices = new (std::nothrow) BrokerDevice[new_capacity];
+        if (!new_devices) {
             hr = E_OUTOFMEMORY;
             goto quit;
         }
+        for (int i = 0; i < broker->ndevices; ++i) {
+            new_devices[i] = broker->devices[i];
+        }
+        delete[] broker->devices;
+        broker->devices = new_devices;
+        broker->capacity = new_capacity;
+    }
 
-        // HRESULT_FROM_WIN32(ERROR_INVALID_DATA)
-        // means that device friendly name/description is not set.
+    {
+        BrokerDevice* entry = &broker->devices[broker->ndevices];
+        entry->id = string_clone(device_id);
+        if (!entry->id) {
+            hr = E_OUTOFMEMORY;
+            goto quit;
+        }
+        hr = engine_open_device(broker->engine, device_id, &entry->device);
+        if (FAILED(hr)) {
+            delete[] entry->id;
+            entry->id = nullptr;
+            goto quit;
+        }
+        ++broker->ndevices;
+        *out_device = entry->device;
+    }
 
-        // Friendly name.
-        {
-            DWORD nfriendly_name = 0;
-            hr = device_manager->GetDeviceFriendlyName(device.id, nullptr, &nfriendly_name);
-            if (hr != HRESULT_FROM_WIN32(ERROR_INVALID_DATA)) {
-                if (FAILED(hr)) goto quit;
+    quit:
+    ReleaseSRWLockExclusive(&broker->lock);
+    return hr;
+}
 
-                device.friendly_name = new (std::nothrow) wchar_t[nfriendly_name + 1];
-                if (!device.friendly_name) {
-                    hr = E_OUTOFMEMORY;
-                    goto quit;
-                }
+static void broker_destroy(Broker* broker) {
+    for (int i = 0; i < broker->ndevices; ++i) {
+        engine_close_device(broker->devices[i].device);
+        delete[] broker->devices[i].id;
+    }
+    delete[] broker->devices;
+    broker->devices = nullptr;
+    broker->ndevices = 0;
+    broker->capacity = 0;
+    engine_destroy(broker->engine);
+    broker->engine = nullptr;
+}
 
-                hr = device_manager->GetDeviceFriendlyName(device.id, device.friendly_name, &nfriendly_name);
-                if (FAILED(hr)) goto quit;
-                device.friendly_name[nfriendly_name] = L'\0';
-            }
-        }
-    
-        // Description.
-        {
-            DWORD ndescription = 0;
-            hr = device_manager->GetDeviceDescription(device.id, nullptr, &ndescription);
-            if (hr != HRESULT_FROM_WIN32(ERROR_INVALID_DATA)) {
-                if (FAILED(hr)) goto quit;
+// --- Device jobs ---
 
-                device.description = new (std::nothrow) wchar_t[ndescription + 1];
-                if (!device.description) {
-                    hr = E_OUTOFMEMORY;
-                    goto quit;
-                }
+struct DeviceJob {
+    const Args* args = nullptr;
+    Engine* engine = nullptr;
+    Broker* broker = nullptr; // <-- when set, device is taken from broker and stays open.
+    PortableDeviceInformation* deviceinfo = nullptr; // <-- don't free.
+    bool shared_progress = false; // <-- progress is started by caller when several devices are processed.
+    wchar_t* name = nullptr;
+    wchar_t* log_prefix = nullptr;
+    wchar_t* destination_directories[EngineMaxDestinations] = {};
+    int ndestinations = 0;
+    HANDLE thread = nullptr;
+    HRESULT hr = E_FAIL;
+    DWORD simulated_hang_timeouts = 0; // <-- with --simulate_hang: timed out calls of simulated class.
+};
 
-                hr = device_manager->GetDeviceDescription(device.id, device.description, &ndescription);
-                if (FAILED(hr)) goto quit;
-                device.description[ndescription] = L'\0';
-            }
+static bool is_device_job_name_unique(const wchar_t* name, const DeviceJob* jobs, int njobs) {
+    for (int i = 0; i < njobs; ++i) {
+        if (0 == _wcsicmp(jobs[i].name, name)) {
+            return false;
         }
     }
+    return true;
+}
 
-    hr = S_OK;
+// Name of device used for log prefix and destination subdirectory in multi-device mode.
+static wchar_t* make_device_job_name(const PortableDeviceInformation& device, int index, const DeviceJob* other_jobs, int nother_jobs) {
+    const wchar_t* base = device.friendly_name && device.friendly_name[0] ? device.friendly_name : device.description;
+    wchar_t* base_name = base && base[0] ? string_clone(base) : string_format(L"Device %d", index);
+    if (!base_name) return nullptr;
 
-    quit:
-    if (device_ids) {
-        for (DWORD i = 0; i < ndevices; ++i) {
-            CoTaskMemFree(device_ids[i]);
+    // Make it usable as directory name.
+    for (wchar_t* c = base_name; *c; ++c) {
+        if (*c < 32 || wcschr(L"<>:\"/\\|?*", *c)) {
+            *c = L'_';
         }
-        delete[] device_ids;
     }
-    if (devices && FAILED(hr)) {
-        for (DWORD i = 0; i < ndevices; ++i) {
-            auto device = devices[i];
-            delete[] device.id;
-            delete[] device.friendly_name;
-            delete[] device.description;
-        }
-        delete[] devices;
+
+    // Same model phones usually have same names.
+    wchar_t* name = string_clone(base_name);
+    for (int suffix = 2; name && !is_device_job_name_unique(name, other_jobs, nother_jobs); ++suffix) {
+        delete[] name;
+        name = string_format(L"%s (%d)", base_name, suffix);
     }
-    safe_release(&device_manager);
-    *out_devices = SUCCEEDED(hr) ? devices : nullptr;
-    *out_ndevices = SUCCEEDED(hr) ? (int)ndevices : 0;
-    return hr;
+
+    delete[] base_name;
+    return name;
 }
 
-static PortableDeviceInformation* match_device(PortableDeviceInformation* devices, int ndevices, const Args& args) {
-    assert(devices);
+static void job_message(void* userdata, const wchar_t* text) {
+    auto job = (DeviceJob*)userdata;
+    log_print(L"%s%s", job->log_prefix, text);
+}
+
+static void job_object_done(void*, bool ok) {
+    log_progress_step(ok);
+}
 
-    for (int i = 0; i < ndevices; ++i) {
-        auto& device = devices[i];
+static void job_bytes_copied(void*, DWORD nbytes) {
+    log_progress_bytes(nbytes);
+}
 
-        if (device.description && args.device_description && 0 == _wcsicmp(device.description, args.device_description)) {
-            return &device;
+// Broker client can't be interrupted directly: it sends cancel message on Ctrl+C, and it's gone when
+// its console was closed. Called by threads of devices while command runs.
+static bool is_command_cancelled() {
+    HANDLE pipe = logger.pipe;
+    if (pipe && !command_cancelled) {
+        DWORD available = 0;
+        if (!PeekNamedPipe(pipe, nullptr, 0, nullptr, &available, nullptr) || available > 0) {
+            InterlockedExchange(&command_cancelled, 1);
         }
     }
-
-    return nullptr;
+    return command_cancelled != 0;
 }
 
-static HRESULT find_device_object(IPortableDeviceContent* content, IPortableDeviceProperties* properties, const wchar_t* parent_object_id, const wchar_t* search_object_name, wchar_t** out_object_id) {
-    const int BatchSize = 32;
-    HRESULT hr = E_FAIL;
-    IEnumPortableDeviceObjectIDs* enumerator = nullptr;
-    DWORD nfetched = 0;
-    wchar_t* object_ids[BatchSize] = { 0 };
-    wchar_t* target_object_id = nullptr;
+const DWORD CancelPollIntervalMs = 100;
 
-    hr = content->EnumObjects(0, parent_object_id, nullptr, &enumerator);
-    if (FAILED(hr)) goto quit;
-    if (hr != S_OK) {
-        hr = E_FAIL;
-        goto quit;
+// Waits for started operation and adds its retry counters and call latencies to stats.
+// Errors of operation itself are already reported through callbacks.
+static HRESULT finish_operation(const wchar_t* log_prefix, HRESULT start_hr, EngineOperation* operation, RetryStats* stats, DeviceCallStats* call_stats) {
+    if (FAILED(start_hr)) {
+        log_print(L"%sUnable to start device operation: %s\n", log_prefix, error_string(start_hr));
+        return start_hr;
     }
 
-    do {
-        hr = enumerator->Next(BatchSize, object_ids, &nfetched);
-        if (SUCCEEDED(hr)) {
-            for (DWORD i = 0; i < nfetched; ++i) {
-                wchar_t* object_id = object_ids[i];
-                wchar_t* object_name = nullptr;
+    bool cancelled = false;
+    while (engine_wait(operation, CancelPollIntervalMs) == HRESULT_FROM_WIN32(WAIT_TIMEOUT)) {
+        if (!cancelled && is_command_cancelled()) {
+            engine_cancel(operation);
+            cancelled = true;
+        }
+    }
+    const EngineResult& result = engine_result(operation);
+    stats->retries += result.retry_stats.retries;
+    stats->recovered += result.retry_stats.recovered;
+    stats->reopens += result.retry_stats.reopens;
+    for (int i = 0; i < DeviceCall_Count; ++i) {
+        device_call_stats_add(&call_stats[i], result.call_stats[i]);
+    }
+    return result.hr;
+}
 
-                hr = get_device_object_name(properties, object_id, &object_name);
-                if (FAILED(hr)) goto quit;
+static HRESULT list_catalog_files(DeviceJob* job, const ObjectFilter& filter) {
+    const wchar_t* prefix = job->log_prefix;
+    DeviceObjectInformation* objects = nullptr;
+    int nobjects = 0;
+    FILETIME updated_time = { 0 };
+    SYSTEMTIME updated = { 0 };
 
-                if (0 == _wcsicmp(object_name, search_object_name)) {
-                    target_object_id = string_clone(object_id);
-                    if (!target_object_id) {
-                        hr = E_OUTOFMEMORY;
-                    }
-                }
+    HRESULT hr = engine_list_catalog(job->engine, job->deviceinfo->id, job->args->source_directory, filter, &objects, &nobjects, &updated_time);
+    if (FAILED(hr)) {
+        log_print(L"%sUnable to list files from catalog (run with --refresh_catalog to create it): %s\n", prefix, error_string(hr));
+        return hr;
+    }
 
-                delete[] object_name;
-                CoTaskMemFree(object_id);
-                object_ids[i] = nullptr;
+    FileTimeToSystemTime(&updated_time, &updated);
+    if (nobjects == 0) {
+        log_print(L"%sNo files were matched (catalog updated %04u-%02u-%02u %02u:%02u UTC).\n", prefix,
+            updated.wYear, updated.wMonth, updated.wDay, updated.wHour, updated.wMinute);
+    } else {
+        log_print(L"%sMatched %d files (catalog updated %04u-%02u-%02u %02u:%02u UTC):\n", prefix, nobjects,
+            updated.wYear, updated.wMonth, updated.wDay, updated.wHour, updated.wMinute);
+    }
+    for (int i = 0; i < nobjects; ++i) {
+        log_print(L"%s- %s\n", prefix, objects[i].name);
+    }
 
-                if (FAILED(hr)) {
-                    delete[] target_object_id;
-                    goto quit;
-                }
+    engine_free_objects(objects, nobjects);
+    return S_OK;
+}
 
-                if (target_object_id) {
-                    goto quit;
-                }
-            }
-            nfetched = 0;
-        }
-    } while (hr == S_OK);
+static HRESULT process_device(DeviceJob* job) {
+    const Args& args = *job->args;
+    const wchar_t* prefix = job->log_prefix;
+    EngineDevice* device = nullptr;
+    EngineOperation* operation = nullptr;
+    EngineCallbacks callbacks;
+    RetryStats retry_stats;
+    DeviceCallStats call_stats[DeviceCall_Count];
+    DeviceObjectInformation* src_objects = nullptr;
+    int src_nobjects = 0;
+    ObjectFilter filter;
+    HRESULT hr = E_FAIL;
 
-    quit:
-    safe_release(&enumerator);
-    if (FAILED(hr)) {
-        delete[] target_object_id;
-        target_object_id = nullptr;
+    filter.match = args.match;
+    filter.min_size = args.min_size;
+    filter.max_size = args.max_size;
+    filter.has_modified_after = args.has_modified_after;
+    filter.modified_after = args.modified_after;
+    filter.has_modified_before = args.has_modified_before;
+    filter.modified_before = args.modified_before;
+    filter.content_types = args.content_types;
+    filter.exclude_hidden = args.exclude_hidden;
+    if (args.copy_files && !filter.content_types) {
+        // Folders have no data stream and cannot be copied.
+        filter.content_types = ~(DWORD)ContentType_Folder;
     }
-    for (DWORD i = 0; i < nfetched; ++i) {
-        CoTaskMemFree(object_ids[i]);
+
+    callbacks.userdata = job;
+    callbacks.verbose = logger.verbose;
+    callbacks.message = job_message;
+    callbacks.object_done = job_object_done;
+    callbacks.bytes_copied = job_bytes_copied;
+
+    // List files from catalog without connecting to device.
+    if (args.from_catalog && !args.refresh_catalog) {
+        hr = list_catalog_files(job, filter);
+        goto quit;
     }
-    *out_object_id = SUCCEEDED(hr) ? target_object_id : nullptr;
-    return hr;
-}
 
-static HRESULT enumerate_device_objects(
-    IPortableDeviceContent* content, 
-    IPortableDeviceProperties* properties, 
-    const wchar_t* object_id,
-    DeviceObjectInformation** out_objectinfo, 
-    int* out_nobjectinfo,
-    void* userdata,
-    bool(*filter)(const wchar_t* object_name, void* userdata))
-{
-    const int BatchSize = 32;
-    HRESULT hr = E_FAIL;
-    IEnumPortableDeviceObjectIDs* enumerator = nullptr;
-    DWORD nfetched = 0;
-    wchar_t* object_ids[BatchSize] = { 0 };
-    DeviceObjectInformation* objectinfo = nullptr;
-    int objectinfo_count = 0;
-    int objectinfo_capacity = 0;
-    wchar_t* current_object_name = nullptr;
-
-    hr = content->EnumObjects(0, object_id, nullptr, &enumerator);
-    if (FAILED(hr)) goto quit;
-    if (hr != S_OK) {
-        hr = E_FAIL;
+    if (job->broker) {
+        hr = broker_get_device(job->broker, job->deviceinfo->id, &device);
+    } else {
+        hr = engine_open_device(job->engine, job->deviceinfo->id, &device);
+    }
+    if (FAILED(hr)) {
+        log_print(L"%sUnable to open device: %s\n", prefix, error_string(hr));
         goto quit;
     }
 
-    do {
-        hr = enumerator->Next(BatchSize, object_ids, &nfetched);
-        if (SUCCEEDED(hr)) {
-            for (DWORD i = 0; i < nfetched; ++i) {
-                wchar_t* object_id = object_ids[i];
-
-                hr = get_device_object_name(properties, object_id, &current_object_name);
-                if (FAILED(hr)) goto quit;
-
-                if (filter(current_object_name, userdata)) {
-                    if (objectinfo == nullptr || objectinfo_count + 1 >= objectinfo_capacity) {
-                        int new_capacity = objectinfo_capacity == 0 ? BatchSize : objectinfo_capacity * 2;
-                        DeviceObjectInformation* new_objectinfo = new (std::nothrow) DeviceObjectInformation[new_capacity];
-                        if (!new_objectinfo) {
-                            hr = E_OUTOFMEMORY;
-                            goto quit;
-                        }
-                        memcpy(new_objectinfo, objectinfo, sizeof(objectinfo[0]) * objectinfo_count);
-                        objectinfo = new_objectinfo;
-                        objectinfo_capacity = new_capacity;
-                    }
-                    wchar_t* id_copy = string_clone(object_id);
-                    if (!id_copy) {
-                        hr = E_OUTOFMEMORY;
-                        goto quit;
-                    }
-                    wchar_t* name_copy = string_clone(current_object_name);
-                    if (!name_copy) {
-                        delete[] id_copy;
-                        hr = E_OUTOFMEMORY;
-                        goto quit;
-                    }
-                    objectinfo[objectinfo_count++] = { id_copy, name_copy, S_OK };
-                }
+    // Update catalog.
+    if (args.refresh_catalog) {
+        ULONGLONG start_tick = GetTickCount64();
+        hr = finish_operation(prefix, engine_refresh_catalog(device, callbacks, &operation), operation, &retry_stats, call_stats);
+        if (FAILED(hr)) goto quit;
 
-                delete[] current_object_name;
-                current_object_name = nullptr;
-                CoTaskMemFree(object_id);
-                object_ids[i] = nullptr;
-            }
-            nfetched = 0;
-        }
-    } while (hr == S_OK);
+        const CatalogRefreshStats& refresh_stats = engine_result(operation).catalog_stats;
+        log_print(L"%sCatalog refreshed in %.1f s: %u folders, %u changed, %u objects read from device.\n", prefix,
+            (double)(GetTickCount64() - start_tick) / 1000.0, refresh_stats.folders, refresh_stats.changed_folders, refresh_stats.fetched_objects);
+        engine_release(operation);
+        operation = nullptr;
 
-    quit:
-    safe_release(&enumerator);
-    delete[] current_object_name;
-    if (FAILED(hr) && objectinfo) {
-        for (int i = 0; i < objectinfo_count; ++i) {
-            delete[] objectinfo[i].id;
-            delete[] objectinfo[i].name;
+        if (!args.list_files && !args.copy_files && !args.delete_files && !args.usage) {
+            hr = S_OK;
+            goto quit;
         }
-        delete[] objectinfo;
     }
-    for (DWORD i = 0; i < nfetched; ++i) {
-        CoTaskMemFree(object_ids[i]);
+
+    if (args.from_catalog) {
+        hr = list_catalog_files(job, filter);
+        goto quit;
     }
-    *out_objectinfo = SUCCEEDED(hr) ? objectinfo : nullptr;
-    *out_nobjectinfo = SUCCEEDED(hr) ? objectinfo_count : 0;
-    return hr;
-}
 
-static HRESULT find_device_object_by_path(IPortableDeviceContent* content, IPortableDeviceProperties* properties, const wchar_t* path, wchar_t** out_object_id) {
-    wchar_t full_path[MAX_PATH];
-    wchar_t curr_object_id[MAX_PATH];
-    wchar_t* component = full_path;
-    HRESULT hr;
-    *out_object_id = nullptr;
+    // Report where space goes.
+    if (args.usage) {
+        EngineUsageOptions usage_options;
+        usage_options.top_count = args.top;
+        usage_options.walkers = args.walkers;
 
-    hr = PathCchCanonicalize(full_path, _countof(full_path), path);
+        ULONGLONG start_tick = GetTickCount64();
+        hr = finish_operation(prefix, engine_usage(device, args.source_directory, usage_options, callbacks, &operation), operation, &retry_stats, call_stats);
+        if (FAILED(hr)) goto quit;
+        print_usage_report(prefix, engine_result(operation).usage, GetTickCount64() - start_tick);
+        print_retry_stats(prefix, retry_stats);
+        hr = S_OK;
+        goto quit;
+    }
+
+    // Find source directory and get all its files (filtered).
+    hr = finish_operation(prefix, engine_list(device, args.source_directory, filter, callbacks, &operation), operation, &retry_stats, call_stats);
     if (FAILED(hr)) goto quit;
+    engine_take_objects(operation, &src_objects, &src_nobjects);
+    engine_release(operation);
+    operation = nullptr;
 
-    if (0 != wcscpy_s(curr_object_id, WPD_DEVICE_OBJECT_ID)) {
-        hr = E_FAIL;
+    if (src_nobjects == 0) {
+        log_print(L"%sNo files were matched.\n", prefix);
+        hr = S_OK;
         goto quit;
     }
 
-    do {
-        auto backslash_pos = component ? wcschr(component, L'\\') : nullptr;
-        int component_length = (int)(backslash_pos ? backslash_pos - component : wcslen(component));
-        if (component_length == 0) {
-            break;
+    // List files.
+    if (args.list_files) {
+        log_print(L"%sMatched %d files:\n", prefix, src_nobjects);
+        for (int i = 0; i < src_nobjects; ++i) {
+            log_print(L"%s- %s\n", prefix, src_objects[i].name);
         }
-        wchar_t component_copy[MAX_PATH];
-        if (0 != wcsncpy_s(component_copy, component, (size_t)component_length)) {
-            hr = E_FAIL;
-            goto quit;
+        hr = S_OK;
+        goto quit;
+    }
+
+    // Copy files.
+    if (args.copy_files) {
+        log_print(L"\n%sCopying %d files:\n", prefix, src_nobjects);
+        if (job->shared_progress) {
+            log_progress_add_total(src_nobjects);
+        } else {
+            log_progress_begin(L"Copying", src_nobjects);
         }
 
-        wchar_t* next_object_id = nullptr;
-        hr = find_device_object(content, properties, curr_object_id, component_copy, &next_object_id);
+        EngineCopyOptions options;
+        for (int i = 0; i < job->ndestinations; ++i) {
+            options.destination_directories[i] = job->destination_directories[i];
+        }
+        options.ndestinations = job->ndestinations;
+        options.layout = args.layout;
+        options.device_name = job->name;
+        options.append = args.append;
+        options.skip_ingested = args.skip_ingested;
+        options.read_streams = args.read_streams;
+        options.durable_move = args.durable_move;
+        options.commit_batch_files = args.commit_batch_files;
+        options.commit_batch_seconds = args.commit_batch_seconds;
+
+        ULONGLONG start_tick = GetTickCount64();
+        hr = finish_operation(prefix, engine_copy(device, src_objects, src_nobjects, options, callbacks, &operation), operation, &retry_stats, call_stats);
+        EngineResult result = operation ? engine_result(operation) : EngineResult();
+        engine_release(operation);
+        operation = nullptr;
+
+        if (job->shared_progress) {
+            ULONGLONG elapsed_ms = GetTickCount64() - start_tick;
+            wchar_t size_text[32];
+            wchar_t speed_text[32];
+            format_size(size_text, _countof(size_text), (double)result.bytes_copied);
+            format_size(speed_text, _countof(speed_text), elapsed_ms > 0 ? (double)result.bytes_copied * 1000.0 / (double)elapsed_ms : 0.0);
+            log_print(L"%sCopied %d of %d files (%s in %.1f s, %s/s).\n", prefix, result.succeeded, src_nobjects, size_text, (double)elapsed_ms / 1000.0, speed_text);
+        } else {
+            log_progress_end(L"Copied");
+        }
         if (FAILED(hr)) goto quit;
 
-        if (next_object_id == nullptr) {
-            hr = HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
-            goto quit;
+        // Files count as copied only when they are in every destination, show where the rest went.
+        if (job->ndestinations > 1) {
+            for (int i = 0; i < job->ndestinations; ++i) {
+                log_print(L"%sWrote %d files into \"%s\".\n", prefix, result.destination_copied[i], job->destination_directories[i]);
+            }
         }
 
-        bool copied = 0 == wcscpy_s(curr_object_id, next_object_id);
-        delete[] next_object_id;
+        if (args.skip_ingested) {
+            log_print(L"%sSkipped %d files which were copied before.\n", prefix, result.skipped);
+        }
 
-        if (!copied) {
-            hr = E_FAIL;
-            goto quit;
+        if (args.append) {
+            wchar_t reused_text[32];
+            format_size(reused_text, _countof(reused_text), (double)result.bytes_reused);
+            log_print(L"%sContinued %d existing files, %s were not read again.\n", prefix, result.files_appended, reused_text);
         }
-    } while (component = PathFindNextComponentW(component));
 
-    quit:
-    if (SUCCEEDED(hr)) {
-        auto copy = string_clone(curr_object_id);
-        if (!copy) {
-            hr = E_OUTOFMEMORY;
+        // Copied files were already flushed and deleted in batches.
+        if (args.durable_move) {
+            log_print(L"%sDeleted %d of %d files in %d durable batches.\n", prefix, result.durable_deleted, result.durable_attempted, result.durable_batches);
         }
-        *out_object_id = copy;
     }
+
+    // Delete files.
+    if (args.delete_files && !args.durable_move) {
+        int nobjects_to_delete = 0;
+        for (int i = 0; i < src_nobjects; ++i) {
+            if (SUCCEEDED(src_objects[i].hr) && src_objects[i].hr != ENGINE_S_SKIPPED) ++nobjects_to_delete;
+        }
+        log_print(L"\n%sDeleting %d files:\n", prefix, nobjects_to_delete);
+
+        hr = finish_operation(prefix, engine_delete(device, src_objects, src_nobjects, callbacks, &operation), operation, &retry_stats, call_stats);
+        if (FAILED(hr)) goto quit;
+        log_print(L"%sDeleted %d of %d files.\n", prefix, engine_result(operation).succeeded, engine_result(operation).attempted);
+    }
+
+    print_retry_stats(prefix, retry_stats);
+    hr = S_OK;
+
+    quit:
+    if (args.timing) {
+        print_call_stats(prefix, call_stats);
+    }
+    if (args.simulate_hang_call >= 0) {
+        job->simulated_hang_timeouts = call_stats[args.simulate_hang_call].timeouts;
+    }
+    engine_release(operation);
+    if (!job->broker) {
+        engine_close_device(device);
+    }
+    engine_free_objects(src_objects, src_nobjects);
     return hr;
 }
 
-static void print_deviceinfo(PortableDeviceInformation* deviceinfo) {
-    wprintf(L"- Identifier: \"%s\"\n", deviceinfo->id);
-    wprintf(L"- Friendly Name: \"%s\"\n", deviceinfo->friendly_name ? deviceinfo->friendly_name : L"<not set>");
-    wprintf(L"- Description: \"%s\"\n", deviceinfo->description ? deviceinfo->description : L"<not set>");
-}
+// With --simulate_hang, the hung call must have been cancelled by watchdog and the command must have
+// finished anyway. Returns failure otherwise, so scripts can check the watchdog by exit code.
+static HRESULT check_simulated_hang(const Args& args, const DeviceJob* jobs, int njobs, HRESULT hr) {
+    DWORD timeouts = 0;
+    for (int i = 0; i < njobs; ++i) {
+        timeouts += jobs[i].simulated_hang_timeouts;
+    }
 
-int wmain(int argc, wchar_t** argv) {
-    if (argc == 1) {
-        wprintf(
-            L"Usage:\n"
-            L"--device_friendly_name <string>   select device by it's friendly name\n"
-            L"--device_description <string>     select device by it's description\n"
-            L"--source_directory <path>         directory on device to copy files from\n"
-            L"--destination_directory <path>    directory on PC to copy files to\n"
-            L"--match <string>                  only files which contain this string will be copied\n"
-            L"\n"
-            L"--list_devices                    list all devices, other arguments are ignored\n"
-            L"--copy_files                      copy matched files\n"
-            L"--delete_files                    delete matched files\n"
-            L"                                  If --copy_files is also set, deletes only copied files\n"
-            L"--list_files                      show matched files\n"
-        );
-        return 0;
+    if (timeouts == 0) {
+        log_print(L"Simulated hang check failed: no %s call timed out.\n", args.simulate_hang);
+        return E_FAIL;
     }
+    if (FAILED(hr)) {
+        log_print(L"Simulated hang check failed: %s call timed out, but command failed.\n", args.simulate_hang);
+        return hr;
+    }
+    log_print(L"Simulated hang check passed: %s call timed out %lu times, command finished.\n", args.simulate_hang, timeouts);
+    return S_OK;
+}
 
+static DWORD WINAPI device_job_thread_proc(void* userdata) {
+    auto job = (DeviceJob*)userdata;
+    job->hr = process_device(job);
+    return 0;
+}
+
+// Runs command with parsed arguments. Broker is set when command is run by broker.
+static int run(Args& args, Broker* broker) {
     HRESULT hr = CoInitializeEx(0, COINIT_APARTMENTTHREADED | COINIT_SPEED_OVER_MEMORY | COINIT_DISABLE_OLE1DDE);
     if (FAILED(hr)) {
-        wprintf(L"CoInitializeEx failed: %s\n", hresult_to_string(hr));
+        log_print(L"CoInitializeEx failed: %s\n", error_string(hr));
         return 1;
     }
 
-    auto args = parse_args(argc, argv);
-    if (!args.ok) {
-        return 1;
-    }
+    logger.verbose = args.verbose;
 
-    // If copying files, normalize destination directory.
-    if (args.copy_files) {
+    // If copying files, normalize destination directories.
+    for (int i = 0; args.copy_files && i < args.ndestinations; ++i) {
         wchar_t* new_destination_directory = nullptr;
-        hr = PathAllocCanonicalize(args.destination_directory, PATHCCH_ALLOW_LONG_PATHS, &new_destination_directory);
+        hr = PathAllocCanonicalize(args.destination_directories[i], PATHCCH_ALLOW_LONG_PATHS, &new_destination_directory);
         if (SUCCEEDED(hr)) {
             hr = PathCchRemoveBackslash(new_destination_directory, 1 + wcslen(new_destination_directory));
         }
 
         if (FAILED(hr)) {
-            wprintf(L"Unable to normalize destination directory: %s\n", hresult_to_string(hr));
+            log_print(L"Unable to normalize destination directory: %s\n", error_string(hr));
+            CoUninitialize();
             return 1;
         }
 
-        delete[] args.destination_directory;
-        args.destination_directory = string_clone(new_destination_directory);
+        delete[] args.destination_directories[i];
+        args.destination_directories[i] = string_clone(new_destination_directory);
         LocalFree(new_destination_directory);
-        if (!args.destination_directory) {
+        if (!args.destination_directories[i]) {
             hr = E_OUTOFMEMORY;
-            wprintf(L"Unable to normalize destination directory: %s\n", hresult_to_string(hr));
+            log_print(L"Unable to normalize destination directory: %s\n", error_string(hr));
+            CoUninitialize();
             return 1;
         }
+
+        // The same file can't be written twice at once.
+        for (int j = 0; j < i; ++j) {
+            if (0 == _wcsicmp(args.destination_directories[j], args.destination_directories[i])) {
+                log_print(L"Destination directory \"%s\" is set more than once.\n", args.destination_directories[i]);
+                CoUninitialize();
+                return 1;
+            }
+        }
     }
 
     // Get all devices.
     int ndeviceinfos = 0;
     PortableDeviceInformation* deviceinfos = nullptr;
-    PortableDeviceInformation* deviceinfo = nullptr; // <-- don't free.
-    IPortableDeviceValues* client_information = nullptr;
-    IPortableDevice* device = nullptr;
-    IPortableDeviceContent* content = nullptr;
-    IPortableDeviceProperties* properties = nullptr;
-    IPortableDeviceResources* resources = nullptr;
-    wchar_t* source_directory_object_id = nullptr;
-    DeviceObjectInformation* src_objects = nullptr;
-    int src_nobjects = 0;
-    int copy_success_count = 0;
-    IPortableDevicePropVariantCollection* files_to_delete = nullptr;
-    IPortableDevicePropVariantCollection* file_deletion_results = nullptr;
+    DeviceJob* jobs = nullptr;
+    int njobs = 0;
+    Engine* engine = nullptr;
+    EngineSettings engine_settings;
+
+    // Listing from catalog doesn't need device connected: devices are matched by names saved in catalogs.
+    if (args.from_catalog && !args.refresh_catalog) {
+        hr = engine_enumerate_catalogs(args.catalog_directory, &deviceinfos, &ndeviceinfos);
+        if (FAILED(hr)) {
+            log_print(L"Unable to enumerate device catalogs: %s\n", error_string(hr));
+            goto quit;
+        }
 
-    hr = enumerate_devices(&deviceinfos, &ndeviceinfos);
-    if (FAILED(hr)) {
-        wprintf(L"Unable to enumerate devices: %s\n", hresult_to_string(hr));
-        goto quit;
-    }
+        if (ndeviceinfos == 0) {
+            log_print(L"No device catalogs were found (run with --refresh_catalog to create them).\n");
+            goto quit;
+        }
+    } else {
+        hr = engine_enumerate_devices(&deviceinfos, &ndeviceinfos);
+        if (FAILED(hr)) {
+            log_print(L"Unable to enumerate devices: %s\n", error_string(hr));
+            goto quit;
+        }
 
-    if (ndeviceinfos == 0) {
-        wprintf(L"No devices were found.\n");
-        return 0;
+        if (ndeviceinfos == 0) {
+            log_print(L"No devices were found.\n");
+            goto quit;
+        }
     }
 
     // Show found devices.
     if (args.list_devices) {
-        wprintf(L"Found %d devices:\n", ndeviceinfos);
+        log_print(L"Found %d devices:\n", ndeviceinfos);
         for (int i = 0; i < ndeviceinfos; ++i) {
             auto deviceinfo = &deviceinfos[i];
-            wprintf(L"Device %d:\n", i);
+            log_print(L"Device %d:\n", i);
             print_deviceinfo(deviceinfo);
         }
-        return 0;
-    }
-
-    // Find matching device.
-    deviceinfo = match_device(deviceinfos, ndeviceinfos, args);
-    if (!deviceinfo) {
-        wprintf(L"Unable to match device with provided arguments.\n");
         goto quit;
     }
 
-    wprintf(L"Selected device:\n");
-    print_deviceinfo(deviceinfo);
-
-    // Client information.
-    hr = CoCreateInstance(CLSID_PortableDeviceValues, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&client_information));
-    if (FAILED(hr)) {
-        wprintf(L"Unable to create client information structure: %s\n", hresult_to_string(hr));
+    // Find matching devices.
+    jobs = new (std::nothrow) DeviceJob[ndeviceinfos];
+    if (!jobs) {
+        hr = E_OUTOFMEMORY;
+        log_print(L"Unable to create device jobs: %s\n", error_string(hr));
         goto quit;
     }
 
-    // Attempt to set all bits of client information.
-    hr = client_information->SetStringValue(WPD_CLIENT_NAME, L"ru.miere.device_data_tool");
-    if (SUCCEEDED(hr)) {
-        hr = client_information->SetUnsignedIntegerValue(WPD_CLIENT_MAJOR_VERSION, 1);
-        if (SUCCEEDED(hr)) {
-            hr = client_information->SetUnsignedIntegerValue(WPD_CLIENT_MINOR_VERSION, 0);
-            if (SUCCEEDED(hr)) {
-                hr = client_information->SetUnsignedIntegerValue(WPD_CLIENT_REVISION, 0);
-                if (SUCCEEDED(hr)) {
-                    // Some device drivers need to impersonate the caller in order to function correctly.  Since our application does not
-                    // need to restrict its identity, specify SECURITY_IMPERSONATION so that we work with all devices.
-                    hr = client_information->SetUnsignedIntegerValue(WPD_CLIENT_SECURITY_QUALITY_OF_SERVICE, SECURITY_IMPERSONATION);
-                }
+    for (int i = 0; i < ndeviceinfos; ++i) {
+        if (match_device(deviceinfos[i], args)) {
+            auto& job = jobs[njobs];
+            job.args = &args;
+            job.deviceinfo = &deviceinfos[i];
+            job.name = make_device_job_name(deviceinfos[i], i, jobs, njobs);
+            if (!job.name) {
+                hr = E_OUTOFMEMORY;
+                log_print(L"Unable to create device jobs: %s\n", error_string(hr));
+                goto quit;
             }
+            ++njobs;
         }
     }
 
-    if (FAILED(hr)) {
-        wprintf(L"Unable to set client information: %s\n", hresult_to_string(hr));
+    if (njobs == 0) {
+        hr = E_FAIL;
+        log_print(L"Unable to match device with provided arguments.\n");
         goto quit;
     }
 
-    // Create device.
-    hr = CoCreateInstance(CLSID_PortableDeviceFTM, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&device));
-    if (FAILED(hr)) {
-        wprintf(L"Unable to create device structure: %s\n", hresult_to_string(hr));
-        goto quit;
+    // Destination disk is shared only when several devices are processed.
+    // Broker's engine is created with broker's own settings, commands with other engine options run in client.
+    if (broker) {
+        engine = broker->engine;
+    } else {
+        apply_engine_settings(args, &engine_settings);
+        engine_settings.disk_writers = njobs > 1 ? args.disk_writers : 0;
+        hr = engine_create(engine_settings, &engine);
+        if (FAILED(hr)) {
+            log_print(L"Unable to create engine: %s\n", error_string(hr));
+            goto quit;
+        }
     }
-
-    // @TODO: Timeout
-    hr = device->Open(deviceinfos[0].id, client_information);
-    if (FAILED(hr)) {
-        wprintf(L"Unable to connect to device: %s\n", hresult_to_string(hr));
-        goto quit;
+    for (int i = 0; i < njobs; ++i) {
+        jobs[i].engine = engine;
+        jobs[i].broker = broker;
     }
 
-    hr = device->Content(&content);
-    if (SUCCEEDED(hr)) {
-        hr = content->Transfer(&resources);
-        if (SUCCEEDED(hr)) {
-            hr = content->Properties(&properties);
+    if (njobs == 1) {
+        log_print(L"Selected device:\n");
+        print_deviceinfo(jobs[0].deviceinfo);
+        jobs[0].log_prefix = string_clone(L"");
+        for (int i = 0; i < args.ndestinations; ++i) {
+            jobs[0].destination_directories[jobs[0].ndestinations] = string_clone(args.destination_directories[i]);
+            if (!jobs[0].destination_directories[jobs[0].ndestinations]) break;
+            ++jobs[0].ndestinations;
+        }
+        if (!jobs[0].log_prefix || jobs[0].ndestinations != args.ndestinations) {
+            hr = E_OUTOFMEMORY;
+            log_print(L"Unable to create device jobs: %s\n", error_string(hr));
+            goto quit;
         }
-    }
 
-    if (FAILED(hr)) {
-        wprintf(L"Unable to get device structures: %s\n", hresult_to_string(hr));
+        hr = process_device(&jobs[0]);
         goto quit;
     }
-   
-    // Find source directory.
-    hr = find_device_object_by_path(content, properties, args.source_directory, &source_directory_object_id);
-    if (FAILED(hr)) {
-        wprintf(L"Unable to get source directory on the device: %s\n", hresult_to_string(hr));
-        goto quit;
+
+    // Several devices: each is processed on its own thread and copies files into its own subdirectory,
+    // unless layout puts device name into paths.
+    log_print(L"Selected %d devices:\n", njobs);
+    for (int i = 0; i < njobs; ++i) {
+        auto& job = jobs[i];
+        log_print(L"Device \"%s\":\n", job.name);
+        print_deviceinfo(job.deviceinfo);
+
+        job.shared_progress = true;
+        job.log_prefix = string_format(L"[%s] ", job.name);
+        if (!job.log_prefix) {
+            hr = E_OUTOFMEMORY;
+            log_print(L"Unable to create device jobs: %s\n", error_string(hr));
+            goto quit;
+        }
+
+        for (int k = 0; args.copy_files && k < args.ndestinations; ++k) {
+            wchar_t*& job_destination = job.destination_directories[job.ndestinations++];
+            if (args.layout && wcsstr(args.layout, L"{device}")) {
+                job_destination = string_clone(args.destination_directories[k]);
+                if (!job_destination) {
+                    hr = E_OUTOFMEMORY;
+                    log_print(L"Unable to create device jobs: %s\n", error_string(hr));
+                    goto quit;
+                }
+                continue;
+            }
+
+            wchar_t* destination_directory = nullptr;
+            hr = PathAllocCombine(args.destination_directories[k], job.name, PATHCCH_ALLOW_LONG_PATHS, &destination_directory);
+            if (SUCCEEDED(hr)) {
+                job_destination = string_clone(destination_directory);
+                LocalFree(destination_directory);
+                if (!job_destination) {
+                    hr = E_OUTOFMEMORY;
+                }
+            }
+            // With --durable_move its entry is flushed together with the first batch, see durable_commit_flush.
+            if (SUCCEEDED(hr) && !CreateDirectoryW(job_destination, nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+            if (FAILED(hr)) {
+                log_print(L"Unable to create destination directory for device \"%s\": %s\n", job.name, error_string(hr));
+                goto quit;
+            }
+        }
     }
 
-    // Get all source directory files (filtered).
-    hr = enumerate_device_objects(content, properties, source_directory_object_id, &src_objects, &src_nobjects, (void*)args.match, [](const wchar_t* object_name, void* userdata) {
-        const wchar_t* match = (const wchar_t*)userdata;
-        return match ? wcsstr(object_name, (wchar_t*)userdata) != nullptr : true;
-    });
-    
-    if (FAILED(hr)) {
-        wprintf(L"Unable to enumerate device objects: %s\n", hresult_to_string(hr));
-        goto quit;
+    if (args.copy_files) {
+        log_progress_begin(L"Copying", 0);
     }
 
-    if (src_nobjects == 0) {
-        wprintf(L"No files were matched.\n");;
-        hr = S_OK;
-        goto quit;
+    for (int i = 0; i < njobs; ++i) {
+        auto& job = jobs[i];
+        job.thread = CreateThread(nullptr, 0, device_job_thread_proc, &job, 0, nullptr);
+        if (!job.thread) {
+            job.hr = HRESULT_FROM_WIN32(GetLastError());
+            log_print(L"%sUnable to start device thread: %s\n", job.log_prefix, error_string(job.hr));
+        }
     }
 
-    // List files.
-    if (args.list_files) {
-        wprintf(L"Matched %d files:\n", src_nobjects);
-        for (int i = 0; i < src_nobjects; ++i) {
-            wprintf(L"- %s\n", src_objects[i].name);
+    hr = S_OK;
+    for (int i = 0; i < njobs; ++i) {
+        auto& job = jobs[i];
+        if (job.thread) {
+            WaitForSingleObject(job.thread, INFINITE);
+            CloseHandle(job.thread);
+            job.thread = nullptr;
+        }
+        if (FAILED(job.hr)) {
+            hr = job.hr;
         }
-        hr = S_OK;
-        goto quit;
     }
 
-    // Copy files.
     if (args.copy_files) {
-        wprintf(L"\nCopying %d files:\n", src_nobjects);
-        for (int i = 0; i < src_nobjects; ++i) {
-            DWORD optimal_buffer_size = 0;
-            IStream* stream = nullptr;
-            IStream* file_stream = nullptr;
-            const wchar_t* error_context = nullptr;
-            wchar_t* destination_path = nullptr;
-            char* buffer = nullptr;
-
-            hr = resources->GetStream(src_objects[i].id, WPD_RESOURCE_DEFAULT, STGM_READ, &optimal_buffer_size, &stream);
-            if (FAILED(hr)) {
-                error_context = L"Unable to get source file stream";
-                goto copy_quit;
-            }
-
-            hr = PathAllocCombine(args.destination_directory, src_objects[i].name, PATHCCH_ALLOW_LONG_PATHS, &destination_path);
-            if (FAILED(hr)) {
-                error_context = L"Cannot build destination path";
-                goto copy_quit;
-            }
+        log_progress_end(L"Copied (all devices)");
+    }
 
-            hr = SHCreateStreamOnFileW(destination_path, STGM_CREATE | STGM_WRITE, &file_stream);
-            if (FAILED(hr)) {
-                error_context = L"Unable to create destination file";
-                goto copy_quit;
+    quit:
+    if (args.simulate_hang && njobs > 0) {
+        hr = check_simulated_hang(args, jobs, njobs, hr);
+    }
+    if (jobs) {
+        for (int i = 0; i < ndeviceinfos; ++i) {
+            delete[] jobs[i].name;
+            delete[] jobs[i].log_prefix;
+            for (int k = 0; k < jobs[i].ndestinations; ++k) {
+                delete[] jobs[i].destination_directories[k];
             }
+        }
+        delete[] jobs;
+    }
+    if (!broker) {
+        engine_destroy(engine);
+    }
+    engine_free_devices(deviceinfos, ndeviceinfos);
 
-            buffer = new (std::nothrow) char[optimal_buffer_size];
-            if (!buffer) {
-                hr = E_OUTOFMEMORY;
-                error_context = L"Unable to create copy buffer";
-                goto copy_quit;
-            }
+    CoUninitialize();
+    return SUCCEEDED(hr) ? 0 : 1;
+}
 
-            while (1) {
-                DWORD nread = 0;
-                DWORD nwritten = 0;
+static LONGLONG get_time_counter() {
+    LARGE_INTEGER counter = { 0 };
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
 
-                hr = stream->Read(buffer, optimal_buffer_size, &nread);
-                if (FAILED(hr)) {
-                    error_context = L"Unable to read from source file";
-                    goto copy_quit;
-                }
+static double get_elapsed_ms(LONGLONG start_counter) {
+    LARGE_INTEGER frequency = { 0 };
+    QueryPerformanceFrequency(&frequency);
+    return (double)(get_time_counter() - start_counter) * 1000.0 / (double)frequency.QuadPart;
+}
 
-                if (nread == 0) {
-                    break;
-                }
+// Reads request of one client, runs it and sends back its output and exit code.
+static void run_broker_command(Broker* broker, HANDLE pipe, DWORD command_number) {
+    BrokerMessageHeader header = { 0 };
+    BYTE* data = nullptr;
+    wchar_t** argv = nullptr;
+    int argc = 0;
+    int exit_code = 1;
+    LONGLONG start_counter = get_time_counter();
+
+    HRESULT hr = broker_receive(pipe, &header, &data);
+    if (SUCCEEDED(hr) && header.type != BrokerMessage_Request) {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+    if (FAILED(hr)) {
+        log_print(L"Command %lu: unable to read request: %s\n", command_number, error_string(hr));
+        goto quit;
+    }
 
-                hr = file_stream->Write(buffer, nread, &nwritten);
-                if (FAILED(hr)) {
-                    error_context = L"Unable to write to destination file";
-                    goto copy_quit;
-                }
+    {
+        // First string is client's current directory, relative paths are resolved against it.
+        const wchar_t* strings = (const wchar_t*)data;
+        const wchar_t* strings_end = (const wchar_t*)(data + header.size);
+        int nstrings = 0;
+        for (const wchar_t* c = strings; c < strings_end; ++c) {
+            if (*c == L'\0') ++nstrings;
+        }
+        if (nstrings < 1) {
+            log_print(L"Command %lu: request is malformed.\n", command_number);
+            goto quit;
+        }
 
-                if (nwritten != nread) {
-                    hr = E_FAIL;
-                    error_context = L"Incomplete write to destination file";
-                    goto copy_quit;
-                }
-            }
+        argv = new (std::nothrow) wchar_t*[nstrings];
+        if (!argv) {
+            log_print(L"Command %lu: unable to read request: %s\n", command_number, error_string(E_OUTOFMEMORY));
+            goto quit;
+        }
+        argv[argc++] = (wchar_t*)L"device_data_tool";
+        const wchar_t* current_directory = strings;
+        for (const wchar_t* c = strings + wcslen(strings) + 1; argc < nstrings; c += wcslen(c) + 1) {
+            argv[argc++] = (wchar_t*)c;
+        }
 
-            copy_quit:
-            LocalFree(destination_path);
-            delete[] buffer;
-            safe_release(&stream);
-            safe_release(&file_stream);
-            if (SUCCEEDED(hr)) {
-                wprintf(L"- [OK] %s\n", src_objects[i].name);
-                src_objects[i].hr = S_OK;
-                ++copy_success_count;
-            } else {
-                wprintf(L"- [FAILED] %s\n  - %s: %s\n", src_objects[i].name, error_context, hresult_to_string(hr));
-                src_objects[i].hr = hr;
-            }
+        if (!SetCurrentDirectoryW(current_directory)) {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            log_print(L"Command %lu: unable to set current directory \"%s\": %s\n", command_number, current_directory, error_string(hr));
+            goto quit;
         }
     }
 
-    // Delete files.
-    if (args.delete_files) {
-        wprintf(L"\nDeleting %d files:\n", args.copy_files ? copy_success_count : src_nobjects);
+    {
+        bool broker_verbose = logger.verbose;
+        const wchar_t* mismatch = nullptr;
+        InterlockedExchange(&command_cancelled, 0);
+        log_redirect(pipe);
+        Args args = parse_args(argc, argv);
+        if (args.ok) {
+            mismatch = find_broker_settings_mismatch(broker, args);
+            if (!mismatch) {
+                exit_code = run(args, broker);
+            }
+        }
+        free_args(&args);
+        log_redirect(nullptr);
+        logger.verbose = broker_verbose;
 
-        hr = CoCreateInstance(CLSID_PortableDevicePropVariantCollection, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&files_to_delete));
-        if (FAILED(hr)) {
-            wprintf(L"Cannot create collection to hold deletion files: %s\n", hresult_to_string(hr));
+        if (mismatch) {
+            broker_send(pipe, BrokerMessage_Rejected, mismatch, (DWORD)(wcslen(mismatch) + 1) * sizeof(wchar_t));
+            log_print(L"Command %lu was sent back to client: its %s differs from broker's.\n", command_number, mismatch);
             goto quit;
         }
+    }
 
-        int delete_count = 0;
-        for (int i = 0; i < src_nobjects; ++i) {
-            if (FAILED(src_objects[i].hr)) {
-                continue;
-            }
+    broker_send(pipe, BrokerMessage_ExitCode, &exit_code, sizeof(exit_code));
+    log_print(L"Command %lu %s in %.1f ms with exit code %d.\n", command_number, command_cancelled ? L"was cancelled by client" : L"finished",
+        get_elapsed_ms(start_counter), exit_code);
 
-            PROPVARIANT file;
-            PropVariantInit(&file);
+    quit:
+    delete[] argv;
+    delete[] data;
+}
 
-            size_t id_size = (1 + wcslen(src_objects[i].id)) * sizeof(wchar_t);
-            file.vt = VT_LPWSTR;
-            file.pwszVal = (wchar_t*)CoTaskMemAlloc(id_size);
-            if (!file.pwszVal) {
-                src_objects[i].hr = E_OUTOFMEMORY;
-                continue;
-            }
-            memcpy(file.pwszVal, src_objects[i].id, id_size);
+static int run_broker(const Args& args) {
+    Broker broker;
+    EngineSettings engine_settings;
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    wchar_t* pipe_name = get_broker_pipe_name();
+    HRESULT hr = pipe_name ? S_OK : E_OUTOFMEMORY;
+    if (FAILED(hr)) {
+        log_print(L"Unable to start broker: %s\n", error_string(hr));
+        goto quit;
+    }
 
-            hr = files_to_delete->Add(&file);
-            if (FAILED(hr)) {
-                src_objects[i].hr = hr;
-                continue;
-            }
-            ++delete_count;
+    logger.verbose = args.verbose;
+    apply_engine_settings(args, &engine_settings);
+    engine_settings.disk_writers = args.disk_writers;
+    broker.settings = engine_settings;
+    hr = engine_create(engine_settings, &broker.engine);
+    if (FAILED(hr)) {
+        log_print(L"Unable to create engine: %s\n", error_string(hr));
+        goto quit;
+    }
+
+    // Single instance: clients queue up in WaitNamedPipe while command runs. Default security
+    // allows only the same user to write requests, remote clients are rejected.
+    pipe = CreateNamedPipeW(pipe_name, PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        1, BrokerPipeBufferSize, BrokerPipeBufferSize, 0, nullptr);
+    if (pipe == INVALID_HANDLE_VALUE) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        if (hr == HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED)) {
+            log_print(L"Broker is already running.\n");
+        } else {
+            log_print(L"Unable to create broker pipe: %s\n", error_string(hr));
         }
+        goto quit;
+    }
 
-        hr = content->Delete(PORTABLE_DEVICE_DELETE_NO_RECURSION, files_to_delete, &file_deletion_results);
-        if (FAILED(hr)) {
-            wprintf(L"Unable to delete files: %s\n", hresult_to_string(hr));
+    log_print(L"Broker is listening on %s, press Ctrl+C to stop it.\n", pipe_name);
+    for (DWORD command_number = 1; ; ++command_number) {
+        if (!ConnectNamedPipe(pipe, nullptr) && GetLastError() != ERROR_PIPE_CONNECTED) {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            log_print(L"Unable to wait for broker clients: %s\n", error_string(hr));
             goto quit;
         }
+        run_broker_command(&broker, pipe, command_number);
+        FlushFileBuffers(pipe);
+        DisconnectNamedPipe(pipe);
+    }
 
-        for (int i = 0, j = 0; i < src_nobjects; ++i) {
-            const wchar_t* error_context = nullptr;
-            bool is_valid = false;
-            PROPVARIANT value;
-
-            if (FAILED(src_objects[i].hr)) {
-                hr = src_objects[i].hr;
-                goto delete_quit;
-            }
-            is_valid = true;
+    quit:
+    if (pipe != INVALID_HANDLE_VALUE) {
+        CloseHandle(pipe);
+    }
+    broker_destroy(&broker);
+    delete[] pipe_name;
+    return SUCCEEDED(hr) ? 0 : 1;
+}
 
-            hr = file_deletion_results->GetAt(j, &value);
-            if (FAILED(hr)) {
-                error_context = L"Unable to get file deletion result";
-                goto delete_quit;
-            }
+// Ctrl+C of forwarded command: 0 - none, 1 - pressed, 2 - cancel message sent to broker.
+static LONG volatile forward_cancel = 0;
+static DWORD forward_thread_id = 0;
+
+// Interrupts blocking read of forwarding thread, which then sends cancel message. Pressing Ctrl+C
+// again terminates client as usual, broker then cancels command because client is gone.
+static BOOL WINAPI forward_ctrl_handler(DWORD type) {
+    if (type != CTRL_C_EVENT && type != CTRL_BREAK_EVENT) return FALSE;
+    if (InterlockedCompareExchange(&forward_cancel, 1, 0) != 0) return FALSE;
+
+    HANDLE thread = OpenThread(THREAD_TERMINATE, FALSE, forward_thread_id);
+    if (thread) {
+        // Thread may be between reads, retry until it notices.
+        for (int i = 0; i < 100 && forward_cancel == 1; ++i) {
+            CancelSynchronousIo(thread);
+            Sleep(10);
+        }
+        CloseHandle(thread);
+    }
+    return TRUE;
+}
 
-            if (value.vt != VT_ERROR) {
-                hr = E_FAIL;
-                error_context = L"Unexpected file deleting result value type";
-                goto delete_quit;
-            }
+// Sends command to running broker and prints its output. Returns false if broker is not running
+// or it rejected command because of different engine options, then command should be run in this process.
+static bool forward_to_broker(int argc, wchar_t** argv, int* out_exit_code) {
+    *out_exit_code = 1;
+    wchar_t* pipe_name = get_broker_pipe_name();
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    BYTE* request = nullptr;
+    DWORD request_size = 0;
+    wchar_t current_directory[MAX_PATH];
+    bool forwarded = false;
+    HRESULT hr = S_OK;
+
+    if (!pipe_name) goto quit;
+    while (1) {
+        pipe = CreateFileW(pipe_name, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+        if (pipe != INVALID_HANDLE_VALUE) break;
+        // Busy: broker runs command of other client.
+        if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeW(pipe_name, NMPWAIT_WAIT_FOREVER)) {
+            goto quit;
+        }
+    }
 
-            hr = HRESULT_FROM_WIN32(value.scode);
-            if (FAILED(hr)) {
-                error_context = L"Deletion error";
-                goto delete_quit;
-            }
+    // Broker is running, from now on command is not run locally even if it fails.
+    forwarded = true;
 
-            delete_quit:
-            if (!is_valid) {
-                continue;
-            }
+    {
+        DWORD current_directory_length = GetCurrentDirectoryW(_countof(current_directory), current_directory);
+        if (current_directory_length == 0 || current_directory_length >= _countof(current_directory)) {
+            hr = HRESULT_FROM_WIN32(current_directory_length == 0 ? GetLastError() : ERROR_FILENAME_EXCED_RANGE);
+            log_print(L"Unable to get current directory: %s\n", error_string(hr));
+            goto quit;
+        }
 
-            ++j;
-            if (SUCCEEDED(hr)) {
-                wprintf(L"- [OK] %s\n", src_objects[i].name);
-            } else {
-                wprintf(L"- [FAILED] %s\n  - %s: %s\n", src_objects[i].name, error_context, hresult_to_string(hr));
-            }
+        request_size = (DWORD)(wcslen(current_directory) + 1) * sizeof(wchar_t);
+        for (int i = 1; i < argc; ++i) {
+            request_size += (DWORD)(wcslen(argv[i]) + 1) * sizeof(wchar_t);
+        }
+        if (request_size > BrokerMaxMessageSize) {
+            log_print(L"Arguments are too long to be sent to broker.\n");
+            goto quit;
+        }
 
-            PropVariantClear(&value);
+        request = new (std::nothrow) BYTE[request_size];
+        if (!request) {
+            log_print(L"Unable to send command to broker: %s\n", error_string(E_OUTOFMEMORY));
+            goto quit;
+        }
+        wchar_t* dest = (wchar_t*)request;
+        wcscpy_s(dest, wcslen(current_directory) + 1, current_directory);
+        dest += wcslen(current_directory) + 1;
+        for (int i = 1; i < argc; ++i) {
+            wcscpy_s(dest, wcslen(argv[i]) + 1, argv[i]);
+            dest += wcslen(argv[i]) + 1;
         }
     }
 
-    hr = S_OK;
+    hr = broker_send(pipe, BrokerMessage_Request, request, request_size);
+    if (FAILED(hr)) {
+        log_print(L"Unable to send command to broker: %s\n", error_string(hr));
+        goto quit;
+    }
+
+    forward_thread_id = GetCurrentThreadId();
+    SetConsoleCtrlHandler(forward_ctrl_handler, TRUE);
+    while (1) {
+        if (InterlockedCompareExchange(&forward_cancel, 2, 1) == 1) {
+            log_print(L"Cancelling command in broker...\n");
+            broker_send(pipe, BrokerMessage_Cancel, nullptr, 0);
+        }
+
+        BrokerMessageHeader header = { 0 };
+        BYTE* data = nullptr;
+        hr = broker_receive(pipe, &header, &data);
+        if (hr == HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED)) {
+            continue;
+        }
+        if (FAILED(hr)) {
+            log_print(L"Connection to broker was lost: %s\n", error_string(hr));
+            break;
+        }
+
+        bool done = false;
+        if (header.type == BrokerMessage_Output) {
+            log_print(L"%s", (const wchar_t*)data);
+        } else if (header.type == BrokerMessage_ExitCode && header.size == sizeof(int)) {
+            *out_exit_code = *(const int*)data;
+            done = true;
+        } else if (header.type == BrokerMessage_Rejected) {
+            log_print(L"Broker runs with different %s, running command directly.\n", (const wchar_t*)data);
+            forwarded = false;
+            done = true;
+        }
+        delete[] data;
+        if (done) break;
+    }
+    SetConsoleCtrlHandler(forward_ctrl_handler, FALSE);
 
     quit:
-    delete[] deviceinfos;
-    safe_release(&client_information);
-    safe_release(&content);
-    safe_release(&resources);
-    safe_release(&properties);
-    safe_release(&files_to_delete);
-    safe_release(&file_deletion_results);
-    delete[] source_directory_object_id;
-    for (int i = 0; i < src_nobjects; ++i) {
-        delete[] src_objects[i].id;
-        delete[] src_objects[i].name;
+    if (pipe != INVALID_HANDLE_VALUE) {
+        CloseHandle(pipe);
     }
-    delete[] src_objects;
+    delete[] request;
+    delete[] pipe_name;
+    return forwarded;
+}
 
-    if (device) {
-        // Close explicitly to avoid Windows Explorer hanging after deleting files via this program.
-        HRESULT close_hr = device->Close();
-        if (FAILED(close_hr)) {
-            wprintf(L"Unable to close device: %s\n", hresult_to_string(close_hr));
-        }
+int wmain(int argc, wchar_t** argv) {
+    if (argc == 1) {
+        wprintf(
+            L"Usage:\n"
+            L"--device_friendly_name <string>   select device by it's friendly name (wildcards * and ? are allowed)\n"
+            L"--device_description <string>     select device by it's description (wildcards * and ? are allowed)\n"
+            L"--source_directory <path>         directory on device to copy files from\n"
+            L"--destination_directory <path>    directory on PC to copy files to, may be repeated to copy into several\n"
+            L"                                  directories with one read from device\n"
+            L"--match <string>                  only files which contain this string will be copied\n"
+            L"--min_size <size>                 only files at least this large (K, M, G and T suffixes are allowed)\n"
+            L"--max_size <size>                 only files at most this large\n"
+            L"--modified_after <date>           only files modified at or after date (YYYY-MM-DD[ HH:MM[:SS]])\n"
+            L"--modified_before <date>          only files modified before date\n"
+            L"--content_type <list>             only objects of these types: image, video, audio, document, folder, other\n"
+            L"--exclude_hidden                  skip hidden and system objects\n"
+            L"--retries <number>                how many times to retry operation failed with transient error, 0-100 (default: 3)\n"
+            L"--disk_writers <number>           max concurrent writes to destination disk in multi-device mode (default: 4)\n"
+            L"--commit_batch_files <number>     with --durable_move: max files flushed and deleted at once (default: 64)\n"
+            L"--commit_batch_seconds <number>   with --durable_move: max time file waits for flush after copy (default: 10)\n"
+            L"--read_streams <number>           with --copy_files: files of 128M and larger are read in this many parts at once, 1-8 (default: 4)\n"
+            L"--top <number>                    with --usage: how many largest folders and files to show (default: 10)\n"
+            L"--walkers <number>                with --usage: how many folders are listed at once, 1-8 (default: 4)\n"
+            L"--open_timeout <seconds>          max time to connect to device, 0 = no limit (default: 30)\n"
+            L"--enumerate_timeout <seconds>     max time of single folder listing or property request (default: 60)\n"
+            L"--read_timeout <seconds>          max time of single read from device file (default: 30)\n"
+            L"--delete_timeout <seconds>        max time of deleting single batch of files (default: 60)\n"
+            L"--simulate_hang <call>            for testing: first open, enumerate, read or delete call hangs until its timeout,\n"
+            L"                                  exit code is 1 unless it timed out and command finished\n"
+            L"--catalog_directory <path>        where device catalogs are stored (default: %%LOCALAPPDATA%%\\device_data_tool\\catalogs)\n"
+            L"--ledger_path <path>              history of copied files (default: %%LOCALAPPDATA%%\\device_data_tool\\ledger.dat)\n"
+            L"--layout <template>               with --copy_files: path of copied file inside destination directory (default: {name})\n"
+            L"                                  Tokens: {name}, {stem}, {ext}, {yyyy}, {mm}, {dd}, {device}, {hash:N}\n"
+            L"\n"
+            L"--list_devices                    list all devices, other arguments are ignored\n"
+            L"--all_devices                     select all connected devices\n"
+            L"--copy_files                      copy matched files\n"
+            L"--delete_files                    delete matched files\n"
+            L"                                  If --copy_files is also set, deletes only copied files\n"
+            L"--durable_move                    with --copy_files --delete_files: flush copied files to disk before deleting them\n"
+            L"--append                          with --copy_files: if destination file is beginning of device file, copy only the rest\n"
+            L"--skip_ingested                   with --copy_files: skip files which were copied before, even if they were moved since\n"
+            L"                                  Skipped files are not deleted by --delete_files\n"
+            L"--list_files                      show matched files\n"
+            L"--refresh_catalog                 save list of all device objects to catalog, unchanged folders are not read again\n"
+            L"--from_catalog                    with --list_files: list files from catalog without reading device\n"
+            L"--usage                           show total size of files under source directory by type, largest folders and files\n"
+            L"--verbose                         print result of every file instead of progress line\n"
+            L"\n"
+            L"--broker                          keep running and serve commands of other invocations, keeping devices connected\n"
+            L"                                  Uses its own --retries, --disk_writers, --catalog_directory, --ledger_path, timeouts and --verbose\n"
+            L"--no_broker                       run command in this process even if broker is running\n"
+            L"--timing                          print how long command took, whether it was run by broker, and device call latencies\n"
+        );
+        return 0;
+    }
 
-        ULONG last_reference = device->Release();
-        assert(last_reference == 0);
-        device = nullptr;
+    LONGLONG start_counter = get_time_counter();
+    if (!log_start()) {
+        wprintf(L"Unable to start logging, printing synchronously.\n");
     }
 
-    CoUninitialize();
-    return SUCCEEDED(hr) ? 0 : 1;
-}
\ No newline at end of file
+    int exit_code = 1;
+    auto args = parse_args(argc, argv);
+    if (args.ok) {
+        if (args.broker) {
+            exit_code = run_broker(args);
+        } else {
+            // Commands are forwarded to broker when it's running.
+            bool forwarded = !args.no_broker && forward_to_broker(argc, argv, &exit_code);
+            if (!forwarded) {
+                exit_code = run(args, nullptr);
+            }
+            if (args.timing) {
+                log_print(L"Command took %.1f ms (%s).\n", get_elapsed_ms(start_counter), forwarded ? L"broker" : L"direct");
+            }
+        }
+    }
+    free_args(&args);
+
+    log_stop();
+    return exit_code;
+}